@@ -0,0 +1,170 @@
+// data of Homework/fib: fib_input${index}.in and fib_output${index}.out
+//
+// usage: fib <index> <routes> <rounds> [seed]
+//
+// every round inserts up to <routes> prefixes, then queries them one by one
+// and in batches and finally erases some in bulk, a few at a time as well as
+// most of the table so that both ways of eraseRoutes are taken.
+// the generator has its own PRNG, the same arguments always give the same
+// files, so the committed data can be regenerated exactly
+use std::env;
+use std::fs::File;
+use std::io::BufWriter;
+use std::io::Write;
+
+// xorshift64*
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    // uniform in [low, high)
+    fn gen_range(&mut self, low: u32, high: u32) -> u32 {
+        low + (self.next() >> 32) as u32 % (high - low)
+    }
+}
+
+struct Route {
+    addr: u32, // host order
+    len: u32,
+    if_index: u32,
+    nexthop: u32, // big endian, as printed
+}
+
+fn mask(len: u32) -> u32 {
+    if len == 0 {
+        0
+    } else {
+        !0u32 << (32 - len)
+    }
+}
+
+// the same longest prefix match as query, by brute force
+fn lookup(table: &[Route], addr: u32) -> Option<&Route> {
+    let mut best: Option<&Route> = None;
+    for route in table {
+        if addr & mask(route.len) == route.addr && best.map_or(true, |b| route.len > b.len) {
+            best = Some(route);
+        }
+    }
+    best
+}
+
+// an address that is likely covered by a route, but not always
+fn gen_addr(rng: &mut Rng, table: &[Route]) -> u32 {
+    if table.is_empty() || rng.gen_range(0, 4) == 0 {
+        0x0a00_0000 | rng.gen_range(0, 1 << 24)
+    } else {
+        let route = &table[rng.gen_range(0, table.len() as u32) as usize];
+        route.addr | (rng.gen_range(0, u32::max_value()) & !mask(route.len))
+    }
+}
+
+fn answer(out: &mut impl Write, table: &[Route], addr: u32) {
+    match lookup(table, addr) {
+        Some(route) => write!(out, "0x{:08x} {}\n", route.nexthop, route.if_index),
+        None => write!(out, "Not Found\n"),
+    }
+    .expect("write");
+}
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    if args.len() < 4 {
+        eprintln!("usage: {} <index> <routes> <rounds> [seed]", args[0]);
+        std::process::exit(1);
+    }
+    let index = &args[1];
+    let routes: u32 = args[2].parse().unwrap();
+    let rounds: u32 = args[3].parse().unwrap();
+    let seed: u64 = args.get(4).map_or(1, |s| s.parse().unwrap());
+    let mut rng = Rng(seed.wrapping_mul(0x9e37_79b9_7f4a_7c15) | 1);
+
+    let file = File::create(format!("fib_input{}.in", index)).unwrap();
+    let ans_file = File::create(format!("fib_output{}.out", index)).unwrap();
+    let mut writer = BufWriter::new(file);
+    let mut ans_writer = BufWriter::new(ans_file);
+    let mut table: Vec<Route> = Vec::new();
+
+    for _ in 0..rounds {
+        for _ in 0..routes {
+            // mostly inside 10.0.0.0/8 so the prefixes nest, now and then a
+            // short one or the default route
+            let len = match rng.gen_range(0, 16) {
+                0 => 0,
+                1 => rng.gen_range(1, 8),
+                _ => rng.gen_range(8, 33),
+            };
+            let addr = (0x0a00_0000 | rng.gen_range(0, 1 << 24)) & mask(len);
+            let if_index = rng.gen_range(0, 4);
+            let nexthop = if rng.gen_range(0, 8) == 0 {
+                0
+            } else {
+                (0x0a00_0000 | rng.gen_range(1, 1 << 24)).swap_bytes()
+            };
+            write!(
+                writer,
+                "I,0x{:08x},{},{},0x{:08x}\n",
+                addr.swap_bytes(),
+                len,
+                if_index,
+                nexthop
+            )
+            .expect("write");
+            // update keeps the route it already has for the same prefix
+            if !table.iter().any(|r| r.addr == addr && r.len == len) {
+                table.push(Route {
+                    addr,
+                    len,
+                    if_index,
+                    nexthop,
+                });
+            }
+        }
+
+        for _ in 0..routes / 4 + 1 {
+            let addr = gen_addr(&mut rng, &table);
+            write!(writer, "Q,0x{:08x}\n", addr.swap_bytes()).expect("write");
+            answer(&mut ans_writer, &table, addr);
+        }
+        // longer than FIB_BATCH now and then, so lookups go in several groups
+        for _ in 0..4 {
+            let count = rng.gen_range(1, 50);
+            write!(writer, "B").expect("write");
+            let mut addrs = Vec::new();
+            for _ in 0..count {
+                let addr = gen_addr(&mut rng, &table);
+                write!(writer, ",0x{:08x}", addr.swap_bytes()).expect("write");
+                addrs.push(addr);
+            }
+            write!(writer, "\n").expect("write");
+            for addr in addrs {
+                answer(&mut ans_writer, &table, addr);
+            }
+        }
+
+        // a few routes, erased one by one, then most of the rest, rebuilt
+        for fraction in &[16, 2] {
+            let count = table.len() / fraction + 1;
+            if table.is_empty() {
+                break;
+            }
+            write!(writer, "D").expect("write");
+            for _ in 0..count.min(table.len()) {
+                let route = table.swap_remove(rng.gen_range(0, table.len() as u32) as usize);
+                write!(writer, ",0x{:08x},{}", route.addr.swap_bytes(), route.len).expect("write");
+            }
+            write!(writer, "\n").expect("write");
+            for _ in 0..4 {
+                let addr = gen_addr(&mut rng, &table);
+                write!(writer, "Q,0x{:08x}\n", addr.swap_bytes()).expect("write");
+                answer(&mut ans_writer, &table, addr);
+            }
+        }
+    }
+}
@@ -69,6 +69,39 @@ int main() {
       } else {
         printf("Not found: %d\n", res);
       }
+    } else if (strncmp(buffer, "stats", strlen("stats")) == 0) {
+      int if_index;
+      int from = 0, to = N_IFACE_ON_BOARD;
+      if (sscanf(buffer, "stats %d", &if_index) == 1) {
+        from = if_index;
+        to = if_index + 1;
+      }
+      for (int i = from; i < to; i++) {
+        HAL_InterfaceStats stats;
+        int res = HAL_GetInterfaceStats(i, &stats);
+        if (res != 0) {
+          printf("Interface %d: failed: %d\n", i, res);
+          continue;
+        }
+        printf("Interface %d:\n", i);
+        printf("\tRX: %llu packets, %llu bytes, %llu truncated, %llu dropped, "
+               "%llu kernel drops\n",
+               (unsigned long long)stats.rx_packets,
+               (unsigned long long)stats.rx_bytes,
+               (unsigned long long)stats.rx_truncated,
+               (unsigned long long)stats.rx_dropped,
+               (unsigned long long)stats.rx_kernel_drops);
+        printf("\tTX: %llu packets, %llu bytes, %llu errors\n",
+               (unsigned long long)stats.tx_packets,
+               (unsigned long long)stats.tx_bytes,
+               (unsigned long long)stats.tx_errors);
+        printf("\tARP: %llu requests and %llu replies received, %llu "
+               "requests and %llu replies sent\n",
+               (unsigned long long)stats.arp_requests_rx,
+               (unsigned long long)stats.arp_replies_rx,
+               (unsigned long long)stats.arp_requests_tx,
+               (unsigned long long)stats.arp_replies_tx);
+      }
     } else if (strncmp(buffer, "cap", strlen("cap")) == 0) {
       int mask = (1 << N_IFACE_ON_BOARD) - 1;
       macaddr_t src_mac;
@@ -132,6 +165,7 @@ int main() {
       printf("\ttime: show current ticks\n");
       printf("\tarp index a.b.c.d: lookup arp\n");
       printf("\tmac index: print MAC address of interface\n");
+      printf("\tstats [index]: show counters of one or every interface\n");
       printf("\tcap: capture one packet\n");
       printf("\tout index: send random packet to interface\n");
       printf("\tloop: read packets until interrupted\n");
@@ -9,6 +9,10 @@
 #include <arpa/inet.h>
 #elif defined ROUTER_BACKEND_STDIO
 #include <arpa/inet.h>
+#elif defined ROUTER_BACKEND_XDP
+#include <arpa/inet.h>
+#elif defined ROUTER_BACKEND_MEMORY
+#include <arpa/inet.h>
 #elif defined ROUTER_BACKEND_XILINX
 typedef uint32_t in_addr_t;
 #endif
@@ -27,6 +31,50 @@ enum HAL_ERROR_NUMBER {
   HAL_ERR_UNKNOWN,
 };
 
+/**
+ * @brief 批量收发接口使用的报文描述符
+ */
+typedef struct {
+  uint8_t *buffer;    // IP 报文缓冲区，由调用者分配
+  size_t buffer_size; // 缓冲区大小，仅接收时使用
+  size_t length; // 报文长度，接收时为 OUT（大于 buffer_size 表示被截断），发送时为 IN
+  macaddr_t src_mac; // 接收时为 OUT，IPv4 报文下层的源 MAC 地址
+  macaddr_t dst_mac; // 接收时为 OUT，发送时为 IN，IPv4 报文下层的目的 MAC 地址
+  int if_index; // 接收时为 OUT，发送时为 IN，接口索引号
+  uint64_t timestamp; // 接收时为 OUT，内核或 libpcap 记录的到达时间，与 HAL_GetTicksNs 同一时间基准（纳秒），0 表示不可用
+} HAL_Packet;
+
+/**
+ * @brief ARP 表的统计信息
+ */
+typedef struct {
+  uint64_t hits;        // 查询命中次数
+  uint64_t misses;      // 查询未命中次数
+  uint64_t evictions;   // 因为表满而被替换掉的表项数
+  uint64_t learn_drops; // 因为限速而没有学习的 ARP 报文数
+  uint64_t pending_sent;     // 等到 ARP 应答后发出的报文数
+  uint64_t pending_drops;    // 因为等待队列已满而丢弃的报文数
+  uint64_t pending_timeouts; // 等待 ARP 应答超时而丢弃的报文数
+} HAL_ArpStats;
+
+/**
+ * @brief 每个接口的收发统计信息
+ */
+typedef struct {
+  uint64_t rx_packets;   // 收到的 IPv4 报文数
+  uint64_t rx_bytes;     // 收到的 IPv4 报文总长度，不含链路层头部
+  uint64_t rx_truncated; // 因为缓冲区不够大而被截断的 IPv4 报文数
+  uint64_t rx_dropped;   // HAL 内部丢弃的报文数，如收包队列已满
+  uint64_t rx_kernel_drops; // 内核或网卡驱动因为缓冲区已满而丢弃的报文数
+  uint64_t tx_packets;      // 发出或加入发送队列的 IPv4 报文数
+  uint64_t tx_bytes;        // 发出的 IPv4 报文总长度，不含链路层头部
+  uint64_t tx_errors;       // 发送失败的报文数
+  uint64_t arp_requests_rx; // 收到的 ARP 请求数
+  uint64_t arp_replies_rx;  // 收到的 ARP 应答数
+  uint64_t arp_requests_tx; // 发出的 ARP 请求数
+  uint64_t arp_replies_tx;  // 发出的 ARP 应答数
+} HAL_InterfaceStats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,6 +97,25 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]);
  */
 uint64_t HAL_GetTicks();
 
+/**
+ * @brief 获取从启动到当前时刻的纳秒数
+ *
+ * 与 HAL_GetTicks 使用同一个单调时钟，开销很小，可以用于测量单个报文的处理时间
+ *
+ * @return uint64_t 纳秒数
+ */
+uint64_t HAL_GetTicksNs();
+
+/**
+ * @brief 获取当前线程最近一次接收函数返回时的毫秒数
+ *
+ * 每次调用 HAL_ReceiveIPPacket 等接收函数时记录一次，之后直到下一次接收都不变，
+ * 处理同一批报文时可以代替 HAL_GetTicks，避免反复读取时钟
+ *
+ * @return uint64_t 毫秒数，尚未接收过时为 HAL_Init 时的值
+ */
+uint64_t HAL_GetLoopTicks();
+
 /**
  * @brief 从 ARP 表中查询 IPv4 对应的 MAC 地址
  *
@@ -63,6 +130,43 @@ uint64_t HAL_GetTicks();
  */
 int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac);
 
+/**
+ * @brief 提前解析 IPv4 地址对应的 MAC 地址，一般在安装路由时对下一跳调用
+ *
+ * 与 HAL_ArpGetMacAddress 相同，表中不存在时会发出 ARP 请求，但不计入统计。
+ * 已经解析的地址在过期前一段时间内会被重新询问，因此周期性地对所有已知的下一跳
+ * 调用本函数，可以保证转发时它们总在 ARP 表中
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param ip IN，要解析的 IP 地址
+ * @return int 0 表示已经解析，HAL_ERR_IP_NOT_EXIST 表示正在等待应答，其他值为失败
+ */
+int HAL_ArpResolve(int if_index, in_addr_t ip);
+
+/**
+ * @brief 获取 ARP 表的统计信息
+ *
+ * ARP 表的大小是固定的，长时间没有更新的表项会过期，表满时替换最旧的表项；
+ * 同一个 IP 地址未应答的查询会在一段时间内直接失败，不会重复发送 ARP 报文
+ *
+ * @param o_stats OUT，统计信息
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_GetArpStats(HAL_ArpStats *o_stats);
+
+/**
+ * @brief 获取接口从 HAL_Init 开始的收发统计信息
+ *
+ * 可以在任何线程中调用；多个线程同时收发时读到的值可能稍有滞后。
+ * rx_kernel_drops 来自 pcap_stats 或者 PACKET_STATISTICS，
+ * 后端无法获取时为 0 ，此时丢包只能从收发数量的差值推断
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param o_stats OUT，统计信息
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats);
+
 /**
  * @brief 获取网卡的 MAC 地址，如果为全 0 代表系统中不存在该网卡或者获取失败
  *
@@ -72,6 +176,17 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac);
  */
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac);
 
+/**
+ * @brief 获取 HAL 可能交给调用者的最长的 IPv4 报文的长度
+ *
+ * 不小于这个长度的接收缓冲区不会截断报文。网卡或内核 GRO
+ * 合并后的报文可能远大于 MTU ，长度与后端、编译选项和运行时的情况有关，
+ * 收包缓冲区应当按照这里的返回值分配；在 HAL_Init 之前调用时返回的是上界
+ *
+ * @return size_t 报文的最大长度（不含以太网头）
+ */
+size_t HAL_GetMaxPacketSize();
+
 /**
  * @brief 接收一个 IPv4
  * 报文，保证不会收到自己发送的报文；请保证缓冲区大小足够大（如大于常见的
@@ -92,6 +207,49 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index);
 
+/**
+ * @brief 批量接收 IPv4 报文，语义同 HAL_ReceiveIPPacket
+ *
+ * 最多等待 timeout 毫秒直到收到第一个报文，之后只取出已经到达的报文，不再等待
+ *
+ * @param if_index_mask IN，接口索引号的 bitset，含义同 HAL_ReceiveIPPacket
+ * @param packets IN/OUT，报文描述符数组，调用者需要填好每一项的 buffer 和
+ * buffer_size，返回时前若干项的 length、src_mac、dst_mac、if_index 和 timestamp
+ * 被填写
+ * @param count IN，packets 数组的长度
+ * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待
+ * @return int >0 表示实际接收的报文个数，=0 表示超时返回，<0 表示发生错误
+ */
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout);
+
+/**
+ * @brief 借出式接收一个 IPv4 报文，不做拷贝，语义同 HAL_ReceiveIPPacket
+ *
+ * 报文留在 HAL 内部的缓冲区中借给调用者，可以原地修改（如更新 TTL
+ * 和校验和），之后调用 HAL_SendBorrowedIPPacket 原地发出，或者调用
+ * HAL_ReleaseIPPacket 归还。同一时间至多借出一个报文，再次调用任何收包函数
+ * 都会使之前借出的报文失效
+ *
+ * @param if_index_mask IN，接口索引号的 bitset，含义同 HAL_ReceiveIPPacket
+ * @param packet OUT，buffer 指向借出的 IP 报文，buffer_size
+ * 为其可用长度，length、src_mac、dst_mac、if_index 和 timestamp 同
+ * HAL_ReceiveIPPacketBatch
+ * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待
+ * @return int 1 表示借出了一个报文，=0 表示超时返回，<0 表示发生错误
+ */
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout);
+
+/**
+ * @brief 归还借出的报文而不发送
+ *
+ * @param packet IN/OUT，HAL_ReceiveIPPacketBorrowed 填写的描述符，返回后
+ * buffer 被置为空指针
+ * @return int 0 表示成功，非 0 为失败（如报文不是借出的或者已经失效）
+ */
+int HAL_ReleaseIPPacket(HAL_Packet *packet);
+
 /**
  * @brief 发送一个 IP 报文，它的源 MAC 地址就是对应接口的 MAC 地址
  *
@@ -100,10 +258,139 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
  * @param length IN，待发送报文的长度
  * @param dst_mac IN，IPv4 报文下层的目的 MAC 地址
  * @return int 0 表示成功，非 0 为失败
+ *
+ * 部分后端（如打开 HAL_PACKET_MMAP 的 Linux 后端）会把报文暂存在发送环中，
+ * 攒够一批或者下一次调用 HAL_ReceiveIPPacket 时再统一交给内核发送
  */
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac);
 
+/**
+ * @brief 把若干个 IP 报文加入发送队列，语义同 HAL_SendIPPacket
+ *
+ * 报文会被复制到 HAL 内部，返回后缓冲区即可复用；但报文不一定立即发出，
+ * 而是在队列满、调用 HAL_FlushSend 或者下一次收包时统一交给系统
+ *
+ * @param packets IN，报文描述符数组，使用每一项的 buffer、length、dst_mac 和
+ * if_index
+ * @param count IN，packets 数组的长度
+ * @return int >=0 表示加入队列的报文个数，<0 表示发生错误
+ */
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count);
+
+/**
+ * @brief 把一个 IPv4 报文发往下一跳 nexthop，不需要事先知道它的 MAC 地址
+ *
+ * 如果 ARP 表中有 nexthop，报文像 HAL_SendIPPacketBatch 一样加入发送队列；
+ * 否则报文被复制到 nexthop 的等待队列中并发出 ARP 请求，收到应答时自动发出。
+ * 每个邻居的等待队列长度和等待时间都有上限，超出的报文会被丢弃并计入
+ * HAL_GetArpStats 的统计中
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param buffer IN，IP 报文，调用后可以立即复用
+ * @param length IN，IP 报文长度
+ * @param nexthop IN，下一跳的 IPv4 地址
+ * @return int 0 表示已经加入发送队列，1 表示正在等待 ARP 应答，<0 表示失败，
+ * 等待队列已满时为 HAL_ERR_IP_NOT_EXIST
+ */
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop);
+
+/**
+ * @brief 获取下一跳 nexthop 的邻接表项，并增加它的引用计数
+ *
+ * 邻接表项保存了出接口和预先构造好的链路层头部，ARP 学到新的 MAC
+ * 地址或者表项过期时会自动更新。路由表项可以保存邻接表项的编号，转发时用
+ * HAL_SendIPPacketToAdjacency 发送，不需要再查询 ARP 表。下一跳尚未解析时会
+ * 发出 ARP 请求
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param nexthop IN，下一跳的 IPv4 地址
+ * @return int >0 表示邻接表项的编号，0 表示邻接表已满或者后端不支持，
+ * 此时请改用 HAL_SendIPPacketToNexthop，<0 表示发生错误
+ */
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop);
+
+/**
+ * @brief 减少邻接表项的引用计数，计数为 0 后编号可能被分配给其他下一跳
+ *
+ * 调用者需要保证此后没有其他线程还在用这个编号发送，例如释放和发送都在同一把
+ * 路由表锁的保护下进行
+ *
+ * @param adjacency IN，HAL_GetAdjacency 返回的编号
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_ReleaseAdjacency(int adjacency);
+
+/**
+ * @brief 把一个 IPv4 报文发往邻接表项对应的下一跳
+ *
+ * 下一跳已经解析时只需要复制一次链路层头部，报文像 HAL_SendIPPacketBatch
+ * 一样加入发送队列；否则与 HAL_SendIPPacketToNexthop 相同
+ *
+ * @param adjacency IN，HAL_GetAdjacency 返回的编号
+ * @param buffer IN，IP 报文，调用后可以立即复用
+ * @param length IN，IP 报文长度
+ * @return int 同 HAL_SendIPPacketToNexthop
+ */
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length);
+
+/**
+ * @brief 原地发送借出的报文并归还，源 MAC 地址就是对应接口的 MAC 地址
+ *
+ * 报文直接从借出的缓冲区发出，一般不再拷贝；发送前会先发出该接口队列中已有的报文
+ *
+ * @param packet IN/OUT，HAL_ReceiveIPPacketBorrowed 填写的描述符，调用者需要填好
+ * length（不超过 buffer_size）、dst_mac 和 if_index，返回后 buffer 被置为空指针
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet);
+
+/**
+ * @brief 替换收包过滤器，不符合条件的报文直接在内核中丢弃，不会被复制到用户态
+ *
+ * 初始化时默认的过滤器只保留 IPv4 和 ARP 报文（见 HAL_CAPTURE_FILTER），
+ * 并且不会收到自己发出的报文。注意如果过滤掉了 ARP ，HAL 将无法学习 ARP 表
+ *
+ * @param if_index_mask IN，接口索引号的 bitset，含义同 HAL_ReceiveIPPacket
+ * @param filter IN，pcap-filter(7) 语法的过滤表达式，如 "udp port 520"
+ * 只接收 RIP 报文；空指针表示恢复默认的过滤器
+ * @return int 0 表示成功，HAL_ERR_NOT_SUPPORTED 表示当前后端不支持，
+ * 其他非 0 为失败（如表达式无法编译）
+ */
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter);
+
+/**
+ * @brief 把发送队列中所有的报文交给系统发送
+ *
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_FlushSend();
+
+/**
+ * @brief 设置收发队列的个数，需要在 HAL_Init 之前调用
+ *
+ * 队列个数大于 1 时，每个接口上收到的报文会按照流的哈希分到各个队列，
+ * 同一个流的报文总是进入同一个队列，因此流内的顺序不会被打乱。
+ * 默认只有一个队列
+ *
+ * @param n IN，队列个数
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_InitQueues(int n);
+
+/**
+ * @brief 把调用者所在的线程绑定到一个队列上，并把线程固定在一个 CPU 上
+ *
+ * 调用 HAL_Init 的线程就是队列 0 ；其它队列需要各自的线程在 HAL_Init
+ * 之后调用本函数，之后该线程的收发函数只处理这个队列的报文，发送队列、
+ * 借出的报文和 HAL_SetCaptureFilter 也都只属于这个线程。ARP 表由所有队列共享
+ *
+ * @param queue IN，队列编号，范围为 [0, HAL_InitQueues 设置的个数)
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_BindQueue(int queue);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,556 @@
+#ifndef __ROUTER_HAL_ARP_H__
+#define __ROUTER_HAL_ARP_H__
+
+// don't include this file in your own code.
+// ARP cache of the backends: a fixed size set associative hash table, the
+// entries a key may live in share one cache line, so a lookup touches a
+// single line and memory does not grow with the number of neighbors.
+#include "router_hal.h"
+#include <atomic>
+#include <string.h>
+
+// log2 of the number of entries
+#ifndef HAL_ARP_TABLE_BITS
+#define HAL_ARP_TABLE_BITS 12
+#endif
+// entries of a set, 4 entries of 16 bytes fill a cache line
+#define HAL_ARP_WAYS 4
+// ms before a learned entry has to be resolved again
+#ifndef HAL_ARP_TIMEOUT
+#define HAL_ARP_TIMEOUT 300000
+#endif
+// ms before expiry in which a neighbor that is still in use is asked again,
+// with HAL_ARP_PROBES requests spread over that time, 0 to never ask early
+#ifndef HAL_ARP_REFRESH
+#define HAL_ARP_REFRESH 30000
+#endif
+#define HAL_ARP_PROBES 3
+// ms between two requests for the same address, lookups in between miss
+// without sending anything
+#ifndef HAL_ARP_RETRY
+#define HAL_ARP_RETRY 1000
+#endif
+// ms a neighbor has to keep its MAC address before it may change again
+#ifndef HAL_ARP_RELEARN_INTERVAL
+#define HAL_ARP_RELEARN_INTERVAL 1000
+#endif
+// ARP packets a sender may learn from per second, counted per sender address
+// so one flooding host can not starve the others, 0 for no limit
+#ifndef HAL_ARP_LEARN_RATE
+#define HAL_ARP_LEARN_RATE 8
+#endif
+// log2 of the number of senders the learn rate is counted for, senders that
+// hash to the same bucket share it, so a flood of spoofed addresses still
+// ends up limited to HAL_ARP_LEARN_RATE per bucket
+#ifndef HAL_ARP_LEARN_SOURCE_BITS
+#define HAL_ARP_LEARN_SOURCE_BITS 8
+#endif
+// IP packets held until their nexthop is resolved, in total and per neighbor
+#ifndef HAL_ARP_PENDING
+#define HAL_ARP_PENDING 128
+#endif
+#ifndef HAL_ARP_PENDING_PER_NEIGHBOR
+#define HAL_ARP_PENDING_PER_NEIGHBOR 4
+#endif
+// ms a held packet may wait for the reply
+#ifndef HAL_ARP_PENDING_TIMEOUT
+#define HAL_ARP_PENDING_TIMEOUT 3000
+#endif
+// nexthops the routes point at, with their link layer header prebuilt
+#ifndef HAL_MAX_ADJACENCIES
+#define HAL_MAX_ADJACENCIES 256
+#endif
+// longest link layer header of the backends, stdio adds an 802.1Q tag
+#define HAL_ADJACENCY_HEADER 18
+
+enum HAL_ArpState {
+  HAL_ARP_EMPTY = 0,
+  // a request was sent, no reply yet
+  HAL_ARP_INCOMPLETE,
+  HAL_ARP_VALID,
+  // address of our own interfaces, never expires
+  HAL_ARP_STATIC
+};
+
+// results of HAL_ArpTableLookup
+enum HAL_ArpLookupResult {
+  HAL_ARP_HIT = 0,
+  // resolved, but about to expire: use it and send a request now
+  HAL_ARP_HIT_REFRESH,
+  // unresolved, a request is already on its way
+  HAL_ARP_MISS,
+  // unresolved, the caller should send a request now
+  HAL_ARP_SEND_REQUEST
+};
+
+struct HAL_ArpEntry {
+  in_addr_t ip;
+  macaddr_t mac;
+  uint8_t if_index : 4;
+  uint8_t state : 4;
+  // requests sent to refresh a valid entry
+  uint8_t probes;
+  // low 32 bits of HAL_GetTicks() when the entry was last updated
+  uint32_t updated;
+};
+
+struct HAL_ArpPendingPacket {
+  bool used;
+  uint8_t if_index;
+  in_addr_t ip;
+  uint32_t queued;
+  // packets of a neighbor leave in this order
+  uint32_t seq;
+  uint32_t length;
+  uint8_t buffer[2048];
+};
+
+alignas(64) static HAL_ArpEntry arp_entries[1 << HAL_ARP_TABLE_BITS];
+static HAL_ArpStats arp_stats;
+#if HAL_ARP_LEARN_RATE > 0
+// token buckets of the senders, indexed by a hash of (if_index, ip)
+struct HAL_ArpLearnBucket {
+  // ARP packets that may still be learned from in the current second
+  uint32_t tokens;
+  // HAL_GetTicks() when the current second began
+  uint32_t second;
+};
+static HAL_ArpLearnBucket arp_learn_buckets[1 << HAL_ARP_LEARN_SOURCE_BITS];
+#endif
+
+struct HAL_Adjacency {
+  // odd while the entry is being rewritten or taken over by another nexthop,
+  // senders read it without a lock
+  std::atomic<uint32_t> version;
+  std::atomic<uint32_t> refs;
+  in_addr_t nexthop;
+  int if_index;
+  bool resolved;
+  uint8_t header[HAL_ADJACENCY_HEADER];
+};
+
+static HAL_ArpPendingPacket arp_pending[HAL_ARP_PENDING];
+static uint32_t arp_pending_count = 0;
+static uint32_t arp_pending_seq = 0;
+
+static HAL_Adjacency adjacencies[HAL_MAX_ADJACENCIES];
+
+// send a held packet to its now resolved nexthop, provided by the backend
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t dst_mac);
+
+// write the link layer header of an IPv4 frame from if_index to dst_mac,
+// provided by the backend
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header);
+
+// make the version odd before touching an adjacency readers may look at
+static inline void HAL_AdjacencyBeginWrite(HAL_Adjacency *adjacency) {
+  adjacency->version.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline void HAL_AdjacencyEndWrite(HAL_Adjacency *adjacency) {
+  adjacency->version.fetch_add(1, std::memory_order_release);
+}
+
+static inline void HAL_AdjacencyBuild(HAL_Adjacency *adjacency,
+                                      const uint8_t *mac) {
+  adjacency->resolved = mac != NULL;
+  if (mac) {
+    HAL_BuildHeader(adjacency->if_index, mac, adjacency->header);
+  }
+}
+
+// rebuild the header of an adjacency, NULL when the nexthop is unresolved
+static inline void HAL_AdjacencySet(HAL_Adjacency *adjacency,
+                                    const uint8_t *mac) {
+  HAL_AdjacencyBeginWrite(adjacency);
+  HAL_AdjacencyBuild(adjacency, mac);
+  HAL_AdjacencyEndWrite(adjacency);
+}
+
+// follow a change of ip on if_index in the adjacencies pointing at it
+static inline void HAL_AdjacencyUpdate(int if_index, in_addr_t ip,
+                                       const uint8_t *mac) {
+  for (int i = 0; i < HAL_MAX_ADJACENCIES; i++) {
+    HAL_Adjacency *adjacency = &adjacencies[i];
+    if (adjacency->refs.load(std::memory_order_relaxed) > 0 &&
+        adjacency->nexthop == ip && adjacency->if_index == if_index) {
+      HAL_AdjacencySet(adjacency, mac);
+    }
+  }
+}
+
+static inline void HAL_ArpTableInit() {
+  memset(arp_entries, 0, sizeof(arp_entries));
+  memset(&arp_stats, 0, sizeof(arp_stats));
+  memset(arp_pending, 0, sizeof(arp_pending));
+  arp_pending_count = 0;
+#if HAL_ARP_LEARN_RATE > 0
+  for (int i = 0; i < (1 << HAL_ARP_LEARN_SOURCE_BITS); i++) {
+    arp_learn_buckets[i].tokens = HAL_ARP_LEARN_RATE;
+    arp_learn_buckets[i].second = (uint32_t)HAL_GetTicks();
+  }
+#endif
+}
+
+#if HAL_ARP_LEARN_RATE > 0
+// take a token from the bucket of the sender ip, false if it has none left
+static inline bool HAL_ArpLearnToken(int if_index, in_addr_t ip,
+                                     uint32_t now) {
+  uint32_t hash = (ip ^ ((uint32_t)if_index << 29)) * 2654435761u;
+  HAL_ArpLearnBucket *bucket =
+      &arp_learn_buckets[hash >> (32 - HAL_ARP_LEARN_SOURCE_BITS)];
+  if (now - bucket->second >= 1000) {
+    bucket->second = now;
+    bucket->tokens = HAL_ARP_LEARN_RATE;
+  }
+  if (bucket->tokens == 0) {
+    return false;
+  }
+  bucket->tokens--;
+  return true;
+}
+#endif
+
+// the set (if_index, ip) maps to
+static inline HAL_ArpEntry *HAL_ArpSet(int if_index, in_addr_t ip) {
+  uint32_t hash = (ip ^ ((uint32_t)if_index << 29)) * 2654435761u;
+  uint32_t index = hash >> (32 - HAL_ARP_TABLE_BITS);
+  return &arp_entries[index & ~(HAL_ARP_WAYS - 1)];
+}
+
+static inline HAL_ArpEntry *HAL_ArpFind(int if_index, in_addr_t ip) {
+  HAL_ArpEntry *set = HAL_ArpSet(if_index, ip);
+  for (int i = 0; i < HAL_ARP_WAYS; i++) {
+    if (set[i].state != HAL_ARP_EMPTY && set[i].ip == ip &&
+        set[i].if_index == if_index) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+// take an entry of the set for (if_index, ip): an empty one, else the oldest
+// incomplete one, else the oldest valid one. NULL if the set is all static
+static inline HAL_ArpEntry *HAL_ArpAllocate(int if_index, in_addr_t ip,
+                                            uint32_t now) {
+  HAL_ArpEntry *set = HAL_ArpSet(if_index, ip);
+  HAL_ArpEntry *victim = NULL;
+  for (int i = 0; i < HAL_ARP_WAYS; i++) {
+    HAL_ArpEntry *entry = &set[i];
+    if (entry->state == HAL_ARP_EMPTY) {
+      victim = entry;
+      break;
+    }
+    if (entry->state == HAL_ARP_STATIC) {
+      continue;
+    }
+    if (victim == NULL || entry->state < victim->state ||
+        (entry->state == victim->state &&
+         now - entry->updated > now - victim->updated)) {
+      victim = entry;
+    }
+  }
+  if (victim == NULL) {
+    return NULL;
+  }
+  if (victim->state != HAL_ARP_EMPTY) {
+    arp_stats.evictions++;
+  }
+  if (victim->state == HAL_ARP_VALID) {
+    HAL_AdjacencyUpdate(victim->if_index, victim->ip, NULL);
+  }
+  victim->ip = ip;
+  victim->if_index = if_index;
+  victim->state = HAL_ARP_EMPTY;
+  victim->probes = 0;
+  victim->updated = now;
+  return victim;
+}
+
+static inline void HAL_ArpTableAddStatic(int if_index, in_addr_t ip,
+                                         const macaddr_t mac) {
+  HAL_ArpEntry *entry = HAL_ArpFind(if_index, ip);
+  if (entry == NULL) {
+    entry = HAL_ArpAllocate(if_index, ip, (uint32_t)HAL_GetTicks());
+  }
+  if (entry) {
+    memcpy(entry->mac, mac, sizeof(macaddr_t));
+    entry->state = HAL_ARP_STATIC;
+  }
+}
+
+// drop held packets that waited too long
+static inline void HAL_ArpPendingExpire(uint32_t now) {
+  for (int i = 0; i < HAL_ARP_PENDING && arp_pending_count > 0; i++) {
+    if (arp_pending[i].used &&
+        now - arp_pending[i].queued >= HAL_ARP_PENDING_TIMEOUT) {
+      arp_pending[i].used = false;
+      arp_pending_count--;
+      arp_stats.pending_timeouts++;
+    }
+  }
+}
+
+// send the packets held for ip on if_index in the order they came
+static inline void HAL_ArpPendingFlush(int if_index, in_addr_t ip,
+                                       const macaddr_t mac) {
+  if (arp_pending_count == 0) {
+    return;
+  }
+  HAL_ArpPendingExpire((uint32_t)HAL_GetTicks());
+  while (true) {
+    HAL_ArpPendingPacket *first = NULL;
+    for (int i = 0; i < HAL_ARP_PENDING; i++) {
+      HAL_ArpPendingPacket *packet = &arp_pending[i];
+      if (packet->used && packet->ip == ip && packet->if_index == if_index &&
+          (first == NULL || (int32_t)(packet->seq - first->seq) < 0)) {
+        first = packet;
+      }
+    }
+    if (first == NULL) {
+      break;
+    }
+    first->used = false;
+    arp_pending_count--;
+    arp_stats.pending_sent++;
+    HAL_ArpSendPending(if_index, first->buffer, first->length, mac);
+  }
+}
+
+// hold a copy of the packet until ip on if_index is resolved, false if it is
+// dropped because the queue of the neighbor or all queues are full
+static inline bool HAL_ArpPendingAdd(int if_index, in_addr_t ip,
+                                     const uint8_t *buffer, size_t length) {
+  uint32_t now = (uint32_t)HAL_GetTicks();
+  HAL_ArpPendingExpire(now);
+  HAL_ArpPendingPacket *slot = NULL;
+  int queued = 0;
+  for (int i = 0; i < HAL_ARP_PENDING; i++) {
+    HAL_ArpPendingPacket *packet = &arp_pending[i];
+    if (!packet->used) {
+      if (slot == NULL) {
+        slot = packet;
+      }
+    } else if (packet->ip == ip && packet->if_index == if_index) {
+      queued++;
+    }
+  }
+  if (slot == NULL || queued >= HAL_ARP_PENDING_PER_NEIGHBOR ||
+      length > sizeof(slot->buffer)) {
+    arp_stats.pending_drops++;
+    return false;
+  }
+  slot->used = true;
+  slot->if_index = if_index;
+  slot->ip = ip;
+  slot->queued = now;
+  slot->seq = arp_pending_seq++;
+  slot->length = length;
+  memcpy(slot->buffer, buffer, length);
+  arp_pending_count++;
+
+  // the reply may have been learned since the caller looked it up
+  HAL_ArpEntry *entry = HAL_ArpFind(if_index, ip);
+  if (entry &&
+      (entry->state == HAL_ARP_VALID || entry->state == HAL_ARP_STATIC)) {
+    macaddr_t mac;
+    memcpy(mac, entry->mac, sizeof(macaddr_t));
+    HAL_ArpPendingFlush(if_index, ip, mac);
+  }
+  return true;
+}
+
+// record that ip is at mac on if_index and send what was held for it, false
+// if dropped by the rate limits
+static inline bool HAL_ArpTableLearn(int if_index, in_addr_t ip,
+                                     const macaddr_t mac) {
+  uint32_t now = (uint32_t)HAL_GetTicks();
+  HAL_ArpEntry *entry = HAL_ArpFind(if_index, ip);
+  if (entry && entry->state == HAL_ARP_STATIC) {
+    return true;
+  }
+#if HAL_ARP_LEARN_RATE > 0
+  // limit how fast a flood from one sender can churn the table, answers to
+  // our own requests always go through
+  bool asked = entry && (entry->state == HAL_ARP_INCOMPLETE || entry->probes);
+  if (!asked && !HAL_ArpLearnToken(if_index, ip, now)) {
+    arp_stats.learn_drops++;
+    return false;
+  }
+#endif
+  if (entry) {
+#if HAL_ARP_RELEARN_INTERVAL > 0
+    // refreshing the same address is always fine, moving it is not
+    if (entry->state == HAL_ARP_VALID &&
+        memcmp(entry->mac, mac, sizeof(macaddr_t)) != 0 &&
+        now - entry->updated < HAL_ARP_RELEARN_INTERVAL) {
+      arp_stats.learn_drops++;
+      return false;
+    }
+#endif
+  } else {
+    entry = HAL_ArpAllocate(if_index, ip, now);
+    if (entry == NULL) {
+      arp_stats.learn_drops++;
+      return false;
+    }
+  }
+  bool changed = entry->state != HAL_ARP_VALID ||
+                 memcmp(entry->mac, mac, sizeof(macaddr_t)) != 0;
+  memcpy(entry->mac, mac, sizeof(macaddr_t));
+  entry->state = HAL_ARP_VALID;
+  entry->probes = 0;
+  entry->updated = now;
+  if (changed) {
+    HAL_AdjacencyUpdate(if_index, ip, mac);
+  }
+  HAL_ArpPendingFlush(if_index, ip, mac);
+  return true;
+}
+
+// whether a valid entry is due for its next refresh request
+static inline bool HAL_ArpProbeDue(HAL_ArpEntry *entry, uint32_t now) {
+  if (entry->state != HAL_ARP_VALID || entry->probes >= HAL_ARP_PROBES) {
+    return false;
+  }
+  uint32_t due = HAL_ARP_TIMEOUT - HAL_ARP_REFRESH +
+                 entry->probes * (HAL_ARP_REFRESH / HAL_ARP_PROBES);
+  if (HAL_ARP_REFRESH == 0 || now - entry->updated < due) {
+    return false;
+  }
+  entry->probes++;
+  return true;
+}
+
+// look ip up on if_index, o_mac is filled on HAL_ARP_HIT and
+// HAL_ARP_HIT_REFRESH. Misses are cached for HAL_ARP_RETRY ms so that only one
+// request goes out per address, and neighbors in use are asked again before
+// they expire. count is false when the control plane resolves a neighbor
+// before any packet needs it, that is not counted in the stats
+static inline int HAL_ArpTableLookup(int if_index, in_addr_t ip,
+                                     macaddr_t o_mac, bool count) {
+  uint32_t now = (uint32_t)HAL_GetTicks();
+  HAL_ArpEntry *entry = HAL_ArpFind(if_index, ip);
+  if (entry) {
+    if (entry->state == HAL_ARP_STATIC ||
+        (entry->state == HAL_ARP_VALID &&
+         now - entry->updated < HAL_ARP_TIMEOUT)) {
+      memcpy(o_mac, entry->mac, sizeof(macaddr_t));
+      if (count) {
+        arp_stats.hits++;
+      }
+      return HAL_ArpProbeDue(entry, now) ? HAL_ARP_HIT_REFRESH : HAL_ARP_HIT;
+    }
+    if (count) {
+      arp_stats.misses++;
+    }
+    if (entry->state == HAL_ARP_INCOMPLETE &&
+        now - entry->updated < HAL_ARP_RETRY) {
+      return HAL_ARP_MISS;
+    }
+    if (entry->state == HAL_ARP_VALID) {
+      // expired, stop sending to it until it answers again
+      HAL_AdjacencyUpdate(if_index, ip, NULL);
+    }
+  } else {
+    if (count) {
+      arp_stats.misses++;
+    }
+    entry = HAL_ArpAllocate(if_index, ip, now);
+    if (entry == NULL) {
+      return HAL_ARP_SEND_REQUEST;
+    }
+  }
+  entry->state = HAL_ARP_INCOMPLETE;
+  entry->updated = now;
+  return HAL_ARP_SEND_REQUEST;
+}
+
+// take a reference to the adjacency of nexthop on if_index, 1-based id or 0
+// if all of them are in use
+static inline int HAL_AdjacencyGet(int if_index, in_addr_t nexthop) {
+  HAL_Adjacency *adjacency = NULL;
+  for (int i = 0; i < HAL_MAX_ADJACENCIES; i++) {
+    uint32_t refs = adjacencies[i].refs.load(std::memory_order_relaxed);
+    if (refs > 0 && adjacencies[i].nexthop == nexthop &&
+        adjacencies[i].if_index == if_index) {
+      adjacencies[i].refs.store(refs + 1, std::memory_order_relaxed);
+      return i + 1;
+    }
+    if (refs == 0 && adjacency == NULL) {
+      adjacency = &adjacencies[i];
+    }
+  }
+  if (adjacency == NULL) {
+    return 0;
+  }
+  uint32_t now = (uint32_t)HAL_GetTicks();
+  HAL_ArpEntry *entry = HAL_ArpFind(if_index, nexthop);
+  bool valid = entry && (entry->state == HAL_ARP_STATIC ||
+                         (entry->state == HAL_ARP_VALID &&
+                          now - entry->updated < HAL_ARP_TIMEOUT));
+  // a sender still holding the id of the previous user must not mix the old
+  // nexthop with the new header
+  HAL_AdjacencyBeginWrite(adjacency);
+  adjacency->refs.store(1, std::memory_order_relaxed);
+  adjacency->nexthop = nexthop;
+  adjacency->if_index = if_index;
+  HAL_AdjacencyBuild(adjacency, valid ? entry->mac : NULL);
+  HAL_AdjacencyEndWrite(adjacency);
+  return adjacency - adjacencies + 1;
+}
+
+// drop a reference, callers must make sure no sender still uses the id once
+// the last one is gone
+static inline bool HAL_AdjacencyRelease(int id) {
+  if (id < 1 || id > HAL_MAX_ADJACENCIES) {
+    return false;
+  }
+  HAL_Adjacency *adjacency = &adjacencies[id - 1];
+  uint32_t refs = adjacency->refs.load(std::memory_order_relaxed);
+  if (refs == 0) {
+    return false;
+  }
+  if (refs > 1) {
+    adjacency->refs.store(refs - 1, std::memory_order_relaxed);
+    return true;
+  }
+  HAL_AdjacencyBeginWrite(adjacency);
+  adjacency->refs.store(0, std::memory_order_relaxed);
+  HAL_AdjacencyEndWrite(adjacency);
+  return true;
+}
+
+// copy what a sender needs out of an adjacency: 1 if it is resolved and
+// header is filled, 0 if not, -1 if there is no such adjacency
+static inline int HAL_AdjacencyRead(int id, uint8_t *header, int *if_index,
+                                    in_addr_t *nexthop) {
+  if (id < 1 || id > HAL_MAX_ADJACENCIES) {
+    return -1;
+  }
+  HAL_Adjacency *adjacency = &adjacencies[id - 1];
+  while (true) {
+    uint32_t version = adjacency->version.load(std::memory_order_acquire);
+    if (version & 1) {
+      continue;
+    }
+    bool used = adjacency->refs.load(std::memory_order_relaxed) > 0;
+    bool resolved = adjacency->resolved;
+    *if_index = adjacency->if_index;
+    *nexthop = adjacency->nexthop;
+    if (resolved) {
+      memcpy(header, adjacency->header, HAL_ADJACENCY_HEADER);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (adjacency->version.load(std::memory_order_relaxed) == version) {
+      if (!used) {
+        return -1;
+      }
+      return resolved ? 1 : 0;
+    }
+  }
+}
+
+#endif
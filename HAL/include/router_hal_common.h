@@ -3,7 +3,58 @@
 
 // don't include this file in your own code.
 #include "router_hal.h"
+#include <atomic>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+
+// ns of capture time after which the offset below is sampled again, so a
+// step or slew of the wall clock only skews the timestamps for a while
+#ifndef HAL_CLOCK_RESAMPLE_NS
+#define HAL_CLOCK_RESAMPLE_NS 1000000000
+#endif
+
+// CLOCK_REALTIME minus CLOCK_MONOTONIC in nanoseconds; capture timestamps are
+// wall clock times and are shifted by it onto the clock of HAL_GetTicksNs
+std::atomic<int64_t> realtime_offset_ns(0);
+// CLOCK_REALTIME in nanoseconds when the offset was sampled
+std::atomic<uint64_t> realtime_sampled_ns(0);
+
+void HAL_SampleClock() {
+  // keep the narrowest of a few monotonic, realtime, monotonic reads, so a
+  // preemption in between does not end up in the offset
+  int64_t best_width = INT64_MAX;
+  for (int i = 0; i < 3; i++) {
+    struct timespec before = {0}, real = {0}, after = {0};
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    int64_t before_ns = (int64_t)before.tv_sec * 1000000000 + before.tv_nsec;
+    int64_t after_ns = (int64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+    int64_t real_ns = (int64_t)real.tv_sec * 1000000000 + real.tv_nsec;
+    if (after_ns - before_ns < best_width) {
+      best_width = after_ns - before_ns;
+      realtime_offset_ns.store(real_ns - (before_ns + best_width / 2),
+                               std::memory_order_relaxed);
+      realtime_sampled_ns.store(real_ns, std::memory_order_relaxed);
+    }
+  }
+}
+
+void HAL_InitClock() { HAL_SampleClock(); }
+
+// convert a wall clock capture timestamp to the clock of HAL_GetTicksNs
+uint64_t HAL_RealtimeToTicksNs(uint64_t sec, uint64_t nsec) {
+  uint64_t real = sec * 1000000000 + nsec;
+  // the timestamp itself tells when the offset is due, one thread resamples
+  uint64_t sampled = realtime_sampled_ns.load(std::memory_order_relaxed);
+  if ((int64_t)(real - sampled) >= HAL_CLOCK_RESAMPLE_NS &&
+      realtime_sampled_ns.compare_exchange_strong(sampled, real,
+                                                  std::memory_order_relaxed)) {
+    HAL_SampleClock();
+  }
+  return real - realtime_offset_ns.load(std::memory_order_relaxed);
+}
 
 // send igmp join to the multicast address
 void HAL_JoinIGMPGroup(int if_index, in_addr_t ip) {
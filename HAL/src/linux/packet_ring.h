@@ -0,0 +1,401 @@
+#ifndef __PACKET_RING_H__
+#define __PACKET_RING_H__
+
+// AF_PACKET memory-mapped rings, only included by router_hal.cpp
+// ref: https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// TPACKET_V3 RX ring parameters, override them with -D if needed
+// memory used per interface = HAL_RX_RING_BLOCK_SIZE * HAL_RX_RING_BLOCK_NR
+#ifndef HAL_RX_RING_BLOCK_SIZE
+#define HAL_RX_RING_BLOCK_SIZE (1 << 18)
+#endif
+#ifndef HAL_RX_RING_BLOCK_NR
+#define HAL_RX_RING_BLOCK_NR 16
+#endif
+#ifndef HAL_RX_RING_FRAME_SIZE
+#define HAL_RX_RING_FRAME_SIZE 2048
+#endif
+// milliseconds before the kernel hands a partially filled block to us
+#ifndef HAL_RX_RING_BLOCK_TIMEOUT
+#define HAL_RX_RING_BLOCK_TIMEOUT 1
+#endif
+
+// TPACKET_V2 TX ring parameters
+// frames per interface =
+// HAL_TX_RING_BLOCK_SIZE / HAL_TX_RING_FRAME_SIZE * HAL_TX_RING_BLOCK_NR
+#ifndef HAL_TX_RING_BLOCK_SIZE
+#define HAL_TX_RING_BLOCK_SIZE (1 << 16)
+#endif
+#ifndef HAL_TX_RING_BLOCK_NR
+#define HAL_TX_RING_BLOCK_NR 8
+#endif
+#ifndef HAL_TX_RING_FRAME_SIZE
+#define HAL_TX_RING_FRAME_SIZE 2048
+#endif
+// kick the kernel once this many frames are queued
+#ifndef HAL_TX_RING_KICK_BATCH
+#define HAL_TX_RING_KICK_BATCH 64
+#endif
+
+struct PacketRxRing {
+  int fd;
+  uint8_t *map;
+  size_t map_size;
+  struct tpacket_req3 req;
+  // block currently owned by us
+  uint32_t block;
+  bool in_block;
+  uint32_t packets_left;
+  struct tpacket3_hdr *frame;
+};
+
+static struct tpacket_block_desc *PacketRxRingBlock(struct PacketRxRing *ring,
+                                                    uint32_t index) {
+  return (struct tpacket_block_desc *)(ring->map +
+                                       (size_t)index * ring->req.tp_block_size);
+}
+
+// open a TPACKET_V3 socket on interface, return 0 on success
+// with vnet_hdr, a struct PacketVnetHdr precedes every frame and frames
+// aggregated by GRO are delivered whole
+static int PacketRxRingOpen(struct PacketRxRing *ring, const char *ifname,
+                            bool vnet_hdr) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    return -1;
+  }
+
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0) {
+    return -1;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) <
+      0) {
+    close(fd);
+    return -1;
+  }
+
+  // must come before the ring is set up
+  int enable = 1;
+  if (vnet_hdr && setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &enable,
+                             sizeof(enable)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = HAL_RX_RING_BLOCK_SIZE;
+  req.tp_block_nr = HAL_RX_RING_BLOCK_NR;
+  req.tp_frame_size = HAL_RX_RING_FRAME_SIZE;
+  req.tp_frame_nr =
+      HAL_RX_RING_BLOCK_SIZE / HAL_RX_RING_FRAME_SIZE * HAL_RX_RING_BLOCK_NR;
+  req.tp_retire_blk_tov = HAL_RX_RING_BLOCK_TIMEOUT;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+  void *map =
+      mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    munmap(map, map_size);
+    close(fd);
+    return -1;
+  }
+
+#ifdef PACKET_IGNORE_OUTGOING
+  // frames we send ourselves are never queued on this socket
+  int ignore_outgoing = 1;
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore_outgoing,
+             sizeof(ignore_outgoing));
+#endif
+
+  // same as pcap_open_live(promisc = 1)
+  struct packet_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+
+  ring->fd = fd;
+  ring->map = (uint8_t *)map;
+  ring->map_size = map_size;
+  ring->req = req;
+  return 0;
+}
+
+// unmap and close the socket of ring
+static void PacketRxRingClose(struct PacketRxRing *ring) {
+  if (ring->fd < 0) {
+    return;
+  }
+  munmap(ring->map, ring->map_size);
+  close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+// replace the classic BPF filter on the socket of ring
+static int PacketRxRingSetFilter(struct PacketRxRing *ring,
+                                 const struct sock_fprog *program) {
+  return setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, program,
+                    sizeof(*program));
+}
+
+// return the next frame in the ring, or NULL if nothing is ready
+// the frame stays valid until the next call, tstamp is the wall clock time
+// in nanoseconds the kernel received it
+static const uint8_t *PacketRxRingNext(struct PacketRxRing *ring,
+                                       uint32_t *caplen, uint32_t *len,
+                                       uint8_t *pkttype, uint64_t *tstamp) {
+  while (true) {
+    struct tpacket_block_desc *desc = PacketRxRingBlock(ring, ring->block);
+    if (ring->in_block && ring->packets_left == 0) {
+      // every frame in this block was consumed, give it back
+      __sync_synchronize();
+      desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+      ring->in_block = false;
+      ring->block = (ring->block + 1) % ring->req.tp_block_nr;
+      continue;
+    }
+    if (!ring->in_block) {
+      if ((desc->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+        return NULL;
+      }
+      __sync_synchronize();
+      ring->in_block = true;
+      ring->packets_left = desc->hdr.bh1.num_pkts;
+      ring->frame = (struct tpacket3_hdr *)((uint8_t *)desc +
+                                            desc->hdr.bh1.offset_to_first_pkt);
+      continue;
+    }
+
+    struct tpacket3_hdr *hdr = ring->frame;
+    ring->packets_left--;
+    ring->frame = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    struct sockaddr_ll *sll =
+        (struct sockaddr_ll *)((uint8_t *)hdr +
+                               TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    *caplen = hdr->tp_snaplen;
+    *len = hdr->tp_len;
+    *pkttype = sll->sll_pkttype;
+    *tstamp = (uint64_t)hdr->tp_sec * 1000000000 + hdr->tp_nsec;
+    return (const uint8_t *)hdr + hdr->tp_mac;
+  }
+}
+
+// struct virtio_net_hdr, <linux/virtio_net.h> does not compile as C++
+struct PacketVnetHdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+#define PACKET_VNET_F_NEEDS_CSUM 1
+#define PACKET_VNET_GSO_NONE 0
+#define PACKET_VNET_GSO_TCPV4 1
+
+// open a plain socket on interface that sends frames behind a struct
+// PacketVnetHdr, so the kernel segments and checksums them on the way out;
+// return the fd, -1 on failure
+static int PacketGsoSocketOpen(const char *ifname) {
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    return -1;
+  }
+  // protocol 0: this socket never receives anything
+  int fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int enable = 1;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &enable, sizeof(enable)) <
+      0) {
+    close(fd);
+    return -1;
+  }
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct PacketTxRing {
+  int fd;
+  int ifindex;
+  uint8_t *map;
+  size_t map_size;
+  struct tpacket_req req;
+  // next slot to fill
+  uint32_t head;
+  // frames filled but not kicked yet
+  uint32_t pending;
+};
+
+static struct tpacket2_hdr *PacketTxRingFrame(struct PacketTxRing *ring,
+                                              uint32_t index) {
+  uint32_t frames_per_block = ring->req.tp_block_size / ring->req.tp_frame_size;
+  return (struct tpacket2_hdr *)(ring->map +
+                                 (size_t)(index / frames_per_block) *
+                                     ring->req.tp_block_size +
+                                 (size_t)(index % frames_per_block) *
+                                     ring->req.tp_frame_size);
+}
+
+// where the frame data starts inside a TX slot
+static const size_t PACKET_TX_RING_DATA_OFFSET =
+    TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+// open a TPACKET_V2 TX ring on interface, return 0 on success
+static int PacketTxRingOpen(struct PacketTxRing *ring, const char *ifname,
+                            bool qdisc_bypass) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    return -1;
+  }
+
+  // protocol 0: this socket never receives anything
+  int fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int version = TPACKET_V2;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) <
+      0) {
+    close(fd);
+    return -1;
+  }
+
+  // drop malformed frames instead of stalling the ring
+  int loss = 1;
+  setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss));
+
+  if (qdisc_bypass) {
+    int bypass = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass));
+  }
+
+  struct tpacket_req req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = HAL_TX_RING_BLOCK_SIZE;
+  req.tp_block_nr = HAL_TX_RING_BLOCK_NR;
+  req.tp_frame_size = HAL_TX_RING_FRAME_SIZE;
+  req.tp_frame_nr =
+      HAL_TX_RING_BLOCK_SIZE / HAL_TX_RING_FRAME_SIZE * HAL_TX_RING_BLOCK_NR;
+  if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  size_t map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+  void *map =
+      mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    munmap(map, map_size);
+    close(fd);
+    return -1;
+  }
+
+  ring->fd = fd;
+  ring->ifindex = ifindex;
+  ring->map = (uint8_t *)map;
+  ring->map_size = map_size;
+  ring->req = req;
+  return 0;
+}
+
+// hand every filled slot to the kernel with a single sendto
+// if wait is set, return only after they have been sent
+static int PacketTxRingKick(struct PacketTxRing *ring, bool wait) {
+  if (ring->pending == 0) {
+    return 0;
+  }
+  ring->pending = 0;
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = ring->ifindex;
+  if (sendto(ring->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT,
+             (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+      errno != EAGAIN) {
+    return -1;
+  }
+  return 0;
+}
+
+// return the data area of the next free slot, NULL if the frame does not
+// fit in a slot; kicks and waits for the kernel if the ring is full
+static uint8_t *PacketTxRingSlot(struct PacketTxRing *ring, size_t length) {
+  if (length > ring->req.tp_frame_size - PACKET_TX_RING_DATA_OFFSET) {
+    return NULL;
+  }
+  struct tpacket2_hdr *hdr = PacketTxRingFrame(ring, ring->head);
+  if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+    PacketTxRingKick(ring, true);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+      return NULL;
+    }
+  }
+  return (uint8_t *)hdr + PACKET_TX_RING_DATA_OFFSET;
+}
+
+// queue the slot returned by PacketTxRingSlot for transmission
+static void PacketTxRingCommit(struct PacketTxRing *ring, size_t length) {
+  struct tpacket2_hdr *hdr = PacketTxRingFrame(ring, ring->head);
+  hdr->tp_len = length;
+  __sync_synchronize();
+  hdr->tp_status = TP_STATUS_SEND_REQUEST;
+  ring->head = (ring->head + 1) % ring->req.tp_frame_nr;
+  if (++ring->pending >= HAL_TX_RING_KICK_BATCH) {
+    PacketTxRingKick(ring, false);
+  }
+}
+
+#endif
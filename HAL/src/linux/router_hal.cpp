@@ -1,20 +1,32 @@
 #include "router_hal.h"
 #include "router_hal_common.h"
+#include "router_hal_arp.h"
 #include <stdio.h>
 
+#include <errno.h>
 #include <ifaddrs.h>
+#ifdef HAL_RX_THREADS
+#include <atomic>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#endif
 #include <linux/if_packet.h>
-#include <map>
+#include <mutex>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <pcap.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
-#include <utility>
+#include <unistd.h>
 
 #ifndef HAL_PLATFORM_TESTING
 #include "platform/standard.h"
@@ -22,6 +34,13 @@
 #include "platform/testing.h"
 #endif
 
+#ifdef HAL_PACKET_MMAP
+#include "packet_ring.h"
+#else
+// only the ring knows where the virtio_net_hdr of a frame is
+#undef HAL_PACKET_VNET_HDR
+#endif
+
 const int IP_OFFSET = 14;
 
 bool inited = false;
@@ -29,11 +48,1247 @@ int debugEnabled = 0;
 in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
 macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
 
-pcap_t *pcap_in_handles[N_IFACE_ON_BOARD];
-pcap_t *pcap_out_handles[N_IFACE_ON_BOARD];
+// number of queues set by HAL_InitQueues, each thread bound to a queue has
+// its own capture and send handles, see HAL_PER_QUEUE
+#ifndef HAL_MAX_QUEUES
+#define HAL_MAX_QUEUES 64
+#endif
+int queue_count = 1;
+// fanout group of each interface when there is more than one queue
+int fanout_ids[N_IFACE_ON_BOARD];
+
+#ifdef HAL_RX_THREADS
+// the RX threads work on the handles opened by HAL_Init
+#define HAL_PER_QUEUE
+#else
+#define HAL_PER_QUEUE thread_local
+#endif
+
+HAL_PER_QUEUE pcap_t *pcap_in_handles[N_IFACE_ON_BOARD];
+HAL_PER_QUEUE pcap_t *pcap_out_handles[N_IFACE_ON_BOARD];
+#ifdef HAL_PACKET_MMAP
+HAL_PER_QUEUE PacketRxRing rx_rings[N_IFACE_ON_BOARD];
+HAL_PER_QUEUE PacketTxRing tx_rings[N_IFACE_ON_BOARD];
+#ifdef HAL_TX_QDISC_BYPASS
+const bool tx_qdisc_bypass = true;
+#else
+const bool tx_qdisc_bypass = false;
+#endif
+#endif
+
+#ifdef HAL_PACKET_VNET_HDR
+// frames aggregated by GRO are captured whole and forwarded as one unit,
+// sockets with PACKET_VNET_HDR send those larger than the MTU and the kernel
+// cuts them into segments on the way out
+#ifndef HAL_MTU
+#define HAL_MTU 1500
+#endif
+HAL_PER_QUEUE bool rx_vnet_hdr[N_IFACE_ON_BOARD];
+HAL_PER_QUEUE int gso_fds[N_IFACE_ON_BOARD];
+// segment size of the aggregated packets handed out since the last receive
+// call, by the buffer they were delivered in, so that they leave in segments
+// of the size they arrived in
+#ifndef HAL_RX_GSO_MAX
+#define HAL_RX_GSO_MAX 64
+#endif
+struct RxGsoSize {
+  const uint8_t *buffer;
+  uint16_t gso_size;
+};
+thread_local RxGsoSize rx_gso_sizes[HAL_RX_GSO_MAX];
+thread_local size_t rx_gso_count = 0;
+#endif
+
+// the ARP table is shared by the RX threads and every bound queue
+std::mutex arp_mutex;
+
+// counters of HAL_GetInterfaceStats, every thread counts into a row of its
+// own and the rows are summed when read: rows below HAL_MAX_QUEUES belong to
+// the queues, the others to the RX threads
+HAL_InterfaceStats stats_rows[HAL_MAX_QUEUES + N_IFACE_ON_BOARD]
+                             [N_IFACE_ON_BOARD];
+thread_local HAL_InterfaceStats *stats = stats_rows[0];
+// queue of the calling thread, set by HAL_BindQueue
+thread_local int bound_queue = 0;
+
+// capture sockets of every queue, so that any thread can collect the drops
+// counted by the kernel; PACKET_STATISTICS resets them on each read
+std::mutex kernel_drops_mutex;
+struct KernelDrops {
+  bool opened;
+  pcap_t *handle;
+  int fd;
+  uint64_t drops;
+} kernel_drops[HAL_MAX_QUEUES][N_IFACE_ON_BOARD];
+
+// filter attached to every capture handle by HAL_Init, in pcap-filter(7)
+// syntax, so frames we never want are dropped in the kernel
+#ifndef HAL_CAPTURE_FILTER
+#define HAL_CAPTURE_FILTER "ip or arp"
+#endif
+
+// frames queued by HAL_SendIPPacketBatch when the TX ring is not in use,
+// sent together with sendmmsg
+#ifndef HAL_SEND_BATCH
+#define HAL_SEND_BATCH 64
+#endif
+#define HAL_SEND_FRAME_SIZE 2048
+struct SendQueue {
+  uint8_t frames[HAL_SEND_BATCH][HAL_SEND_FRAME_SIZE];
+  struct iovec iovs[HAL_SEND_BATCH];
+  struct mmsghdr msgs[HAL_SEND_BATCH];
+  unsigned int count;
+};
+HAL_PER_QUEUE SendQueue send_queues[N_IFACE_ON_BOARD];
+
+// port to start the next round robin from
+HAL_PER_QUEUE int next_port = 0;
+
+#ifdef HAL_RX_THREADS
+// one RX thread per interface drains its socket into a lock-free single
+// producer single consumer queue, the caller of HAL_ReceiveIPPacket consumes
+#ifndef HAL_RX_QUEUE_SIZE
+#define HAL_RX_QUEUE_SIZE 1024 // must be a power of 2
+#endif
+struct RxQueue {
+  struct {
+    uint32_t caplen;
+    uint64_t timestamp;
+  } slots[HAL_RX_QUEUE_SIZE];
+  // HAL_RX_QUEUE_SIZE frames of frame_size bytes, as long as the snaplen of
+  // the capture; pages are only touched as far as the frames reach
+  uint8_t *frames;
+  size_t frame_size;
+  // written by the RX thread
+  alignas(64) std::atomic<uint32_t> head;
+  // written by the consumer
+  alignas(64) std::atomic<uint32_t> tail;
+  // the slot handed out last is still in use by the consumer
+  bool held;
+  // signalled by the RX thread when it has queued frames
+  int event_fd;
+} rx_queues[N_IFACE_ON_BOARD];
+
+std::thread rx_threads[N_IFACE_ON_BOARD];
+// readable once the RX threads have to stop
+int rx_stop_fd = -1;
+// the RX threads send ARP replies and held packets through sockets of their
+// own, the pcap handles belong to the thread calling the HAL
+int rx_tx_fds[N_IFACE_ON_BOARD];
+// interface of the RX thread, -1 on other threads
+thread_local int rx_thread_if = -1;
+#endif
+
+// frame lent out by HAL_ReceiveIPPacketBorrowed, it lives in the capture
+// buffer of libpcap or the RX ring and is valid until the next receive
+HAL_PER_QUEUE uint8_t *borrowed_frame = NULL;
+
+// epoll instances waiting on the capture fds, one for each interface mask,
+// created on first use; -2 means some fd can not be waited on
+HAL_PER_QUEUE int epoll_fds[1 << N_IFACE_ON_BOARD];
+
+#ifdef HAL_BUSY_POLL
+// spin for a while before going to sleep, the budget is adapted like NAPI:
+// doubled when spinning catches a packet, halved when it does not
+#ifndef HAL_BUSY_POLL_MIN_US
+#define HAL_BUSY_POLL_MIN_US 10
+#endif
+#ifndef HAL_BUSY_POLL_MAX_US
+#define HAL_BUSY_POLL_MAX_US 500
+#endif
+HAL_PER_QUEUE int64_t busy_poll_us = HAL_BUSY_POLL_MIN_US;
+#endif
+
+// HAL_GetTicks() when the last receive of this thread returned
+thread_local uint64_t loop_ticks = 0;
+
+bool HAL_CaptureEnabled(int if_index) {
+#ifdef HAL_PACKET_MMAP
+  return rx_rings[if_index].fd >= 0;
+#else
+  return pcap_in_handles[if_index] != NULL;
+#endif
+}
+
+#ifdef HAL_PACKET_VNET_HDR
+// one's complement sum of length bytes in network order, not folded
+uint32_t HAL_ChecksumAdd(uint32_t sum, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i + 1 < length; i += 2) {
+    sum += (data[i] << 8) | data[i + 1];
+  }
+  if (length & 1) {
+    sum += data[length - 1] << 8;
+  }
+  return sum;
+}
+
+uint16_t HAL_ChecksumFold(uint32_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return sum;
+}
+
+// locally generated frames come with only the pseudo header summed into
+// their TCP or UDP checksum; complete it unless the frame is left for
+// segmentation, whose checksums are redone on the way out anyway
+void HAL_FinishChecksum(uint8_t *frame, uint32_t caplen) {
+  const struct PacketVnetHdr *vnet =
+      (const struct PacketVnetHdr *)(frame - sizeof(struct PacketVnetHdr));
+  if ((vnet->flags & PACKET_VNET_F_NEEDS_CSUM) == 0 ||
+      vnet->gso_type != PACKET_VNET_GSO_NONE ||
+      (uint32_t)vnet->csum_start + vnet->csum_offset + 2 > caplen) {
+    return;
+  }
+  uint16_t checksum = ~HAL_ChecksumFold(HAL_ChecksumAdd(
+      0, &frame[vnet->csum_start], caplen - vnet->csum_start));
+  frame[vnet->csum_start + vnet->csum_offset] = checksum >> 8;
+  frame[vnet->csum_start + vnet->csum_offset + 1] = checksum & 0xff;
+}
+
+// remember the segment size of an aggregated frame delivered in buffer
+void HAL_NoteGsoSize(const uint8_t *frame, const uint8_t *buffer) {
+  const struct PacketVnetHdr *vnet =
+      (const struct PacketVnetHdr *)(frame - sizeof(struct PacketVnetHdr));
+  if (vnet->gso_type == PACKET_VNET_GSO_NONE || vnet->gso_size == 0 ||
+      rx_gso_count == HAL_RX_GSO_MAX) {
+    return;
+  }
+  rx_gso_sizes[rx_gso_count].buffer = buffer;
+  rx_gso_sizes[rx_gso_count].gso_size = vnet->gso_size;
+  rx_gso_count++;
+}
+
+// segment size the packet in buffer arrived with, 0 if it is unknown
+uint16_t HAL_ReceivedGsoSize(const uint8_t *buffer) {
+  for (size_t i = 0; i < rx_gso_count; i++) {
+    if (rx_gso_sizes[i].buffer == buffer) {
+      return rx_gso_sizes[i].gso_size;
+    }
+  }
+  return 0;
+}
+#endif
+
+// fetch the next frame from the socket of if_index, NULL if there is none
+// the frame is only valid until the next call, timestamp is when the kernel
+// received it on the clock of HAL_GetTicksNs
+const uint8_t *HAL_CaptureFrame(int if_index, uint32_t *caplen,
+                                uint64_t *timestamp) {
+#ifdef HAL_PACKET_MMAP
+  uint32_t len;
+  uint8_t pkttype;
+  uint64_t tstamp;
+  const uint8_t *packet = PacketRxRingNext(&rx_rings[if_index], caplen, &len,
+                                           &pkttype, &tstamp);
+  if (packet && pkttype == PACKET_OUTGOING) {
+    // report outbound frames as empty ones, so they are skipped
+    *caplen = 0;
+  }
+  if (packet) {
+    *timestamp = HAL_RealtimeToTicksNs(0, tstamp);
+#ifdef HAL_PACKET_VNET_HDR
+    if (rx_vnet_hdr[if_index]) {
+      HAL_FinishChecksum((uint8_t *)packet, *caplen);
+    }
+#endif
+  }
+  return packet;
+#else
+  struct pcap_pkthdr hdr;
+  const uint8_t *packet = pcap_next(pcap_in_handles[if_index], &hdr);
+  *caplen = packet ? hdr.caplen : 0;
+  if (packet) {
+    *timestamp = HAL_RealtimeToTicksNs(hdr.ts.tv_sec, hdr.ts.tv_usec * 1000);
+  }
+  return packet;
+#endif
+}
+
+// compile filter and attach it to the capture handle of if_index
+int HAL_AttachFilter(int if_index, const char *filter) {
+  struct bpf_program program;
+#ifdef HAL_PACKET_MMAP
+  // our own socket: let libpcap compile it, then attach it ourselves
+  // the snaplen ends up in the accepting return, keep it large
+  pcap_t *compiler = pcap_open_dead(DLT_EN10MB, 0x40000);
+  if (!compiler) {
+    return -1;
+  }
+  int res = pcap_compile(compiler, &program, filter, 1, PCAP_NETMASK_UNKNOWN);
+  if (res < 0 && debugEnabled) {
+    fprintf(stderr, "HAL_AttachFilter: pcap_compile failed with %s\n",
+            pcap_geterr(compiler));
+  }
+  pcap_close(compiler);
+  if (res < 0) {
+    return -1;
+  }
+  struct sock_fprog fprog;
+  fprog.len = program.bf_len;
+  // struct bpf_insn has the same layout as struct sock_filter
+  fprog.filter = (struct sock_filter *)program.bf_insns;
+  res = PacketRxRingSetFilter(&rx_rings[if_index], &fprog);
+#else
+  pcap_t *handle = pcap_in_handles[if_index];
+  if (pcap_compile(handle, &program, filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_AttachFilter: pcap_compile failed with %s\n",
+              pcap_geterr(handle));
+    }
+    return -1;
+  }
+  int res = pcap_setfilter(handle, &program);
+#endif
+  pcap_freecode(&program);
+  return res;
+}
+
+// fetch the next frame captured on if_index, NULL if there is none
+// the frame is only valid until the next call
+const uint8_t *HAL_NextFrame(int if_index, uint32_t *caplen,
+                             uint64_t *timestamp) {
+#ifdef HAL_RX_THREADS
+  // the socket belongs to the RX thread, take frames from its queue
+  RxQueue *queue = &rx_queues[if_index];
+  uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+  if (queue->held) {
+    // the previous frame is no longer needed
+    tail++;
+    queue->tail.store(tail, std::memory_order_release);
+    queue->held = false;
+  }
+  if (tail == queue->head.load(std::memory_order_acquire)) {
+    return NULL;
+  }
+  queue->held = true;
+  *caplen = queue->slots[tail & (HAL_RX_QUEUE_SIZE - 1)].caplen;
+  *timestamp = queue->slots[tail & (HAL_RX_QUEUE_SIZE - 1)].timestamp;
+  return &queue->frames[(tail & (HAL_RX_QUEUE_SIZE - 1)) * queue->frame_size];
+#else
+  return HAL_CaptureFrame(if_index, caplen, timestamp);
+#endif
+}
+
+bool HAL_UsingTxRing(int if_index) {
+#ifdef HAL_PACKET_MMAP
+  return tx_rings[if_index].fd >= 0;
+#else
+  return false;
+#endif
+}
+
+// send every frame in the queue of if_index with one sendmmsg
+int HAL_FlushSendQueue(int if_index) {
+  SendQueue *queue = &send_queues[if_index];
+  unsigned int sent = 0;
+  int res = 0;
+  while (sent < queue->count) {
+    int n = sendmmsg(pcap_fileno(pcap_out_handles[if_index]),
+                     &queue->msgs[sent], queue->count - sent, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_FlushSend: sendmmsg failed with %s\n",
+                strerror(errno));
+      }
+      stats[if_index].tx_errors += queue->count - sent;
+      res = HAL_ERR_UNKNOWN;
+      break;
+    }
+    sent += n;
+  }
+  queue->count = 0;
+  return res;
+}
+
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header) {
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+}
+
+// queue a frame made of a prebuilt link layer header and an IP packet
+bool HAL_QueueFrame(int if_index, const uint8_t *header, const uint8_t *buffer,
+                    size_t length) {
+  uint8_t *eth_buffer;
+#ifdef HAL_PACKET_MMAP
+  if (tx_rings[if_index].fd >= 0) {
+    // build the frame in place in the TX ring
+    eth_buffer = PacketTxRingSlot(&tx_rings[if_index], length + IP_OFFSET);
+    if (!eth_buffer) {
+      // keep the order of frames already queued
+      PacketTxRingKick(&tx_rings[if_index], false);
+      return false;
+    }
+    memcpy(eth_buffer, header, IP_OFFSET);
+    memcpy(&eth_buffer[IP_OFFSET], buffer, length);
+    PacketTxRingCommit(&tx_rings[if_index], length + IP_OFFSET);
+    stats[if_index].tx_packets++;
+    stats[if_index].tx_bytes += length;
+    return true;
+  }
+#endif
+  SendQueue *queue = &send_queues[if_index];
+  if (length + IP_OFFSET > HAL_SEND_FRAME_SIZE) {
+    HAL_FlushSendQueue(if_index);
+    return false;
+  }
+  if (queue->count == HAL_SEND_BATCH) {
+    HAL_FlushSendQueue(if_index);
+  }
+  eth_buffer = queue->frames[queue->count];
+  memcpy(eth_buffer, header, IP_OFFSET);
+  memcpy(&eth_buffer[IP_OFFSET], buffer, length);
+  queue->iovs[queue->count].iov_len = length + IP_OFFSET;
+  queue->count++;
+  stats[if_index].tx_packets++;
+  stats[if_index].tx_bytes += length;
+  return true;
+}
+
+// put an IP packet behind an Ethernet header into the TX ring or the send
+// queue of if_index, return false if it is too large to be queued
+bool HAL_QueueIPPacket(int if_index, const uint8_t *buffer, size_t length,
+                       const macaddr_t dst_mac) {
+  uint8_t header[IP_OFFSET];
+  HAL_BuildHeader(if_index, dst_mac, header);
+  return HAL_QueueFrame(if_index, header, buffer, length);
+}
+
+#ifdef HAL_PACKET_VNET_HDR
+// send a TCP packet larger than the MTU, usually one aggregated by GRO, and
+// let the kernel cut it into segments, 1 if it can not be sent this way
+// frames queued on if_index must have been flushed already
+int HAL_SendGsoFrame(int if_index, const uint8_t *header, const uint8_t *buffer,
+                     size_t length) {
+  if (gso_fds[if_index] < 0 || length <= HAL_MTU || length < 20) {
+    return 1;
+  }
+  size_t ip_len = (buffer[0] & 0xf) * 4;
+  // TCP only, no fragments
+  if ((buffer[0] >> 4) != 4 || buffer[9] != 6 ||
+      ((buffer[6] & 0x3f) | buffer[7]) != 0 || ip_len + 20 > length) {
+    return 1;
+  }
+  size_t tcp_len = (buffer[ip_len + 12] >> 4) * 4;
+  size_t hdr_len = ip_len + tcp_len;
+  if (tcp_len < 20 || hdr_len >= length || hdr_len + 1 > HAL_MTU) {
+    return 1;
+  }
+
+  struct PacketVnetHdr vnet;
+  memset(&vnet, 0, sizeof(vnet));
+  vnet.flags = PACKET_VNET_F_NEEDS_CSUM;
+  vnet.gso_type = PACKET_VNET_GSO_TCPV4;
+  vnet.hdr_len = IP_OFFSET + hdr_len;
+  // keep the segments as large as they came in, but no larger than our MTU
+  vnet.gso_size = HAL_MTU - hdr_len;
+  uint16_t received = HAL_ReceivedGsoSize(buffer);
+  if (received != 0 && received < vnet.gso_size) {
+    vnet.gso_size = received;
+  }
+  vnet.csum_start = IP_OFFSET + ip_len;
+  vnet.csum_offset = 16;
+
+  // the kernel expects the pseudo header sum in the TCP checksum field,
+  // change a copy of the headers so that the packet itself is left alone
+  uint8_t headers[120];
+  memcpy(headers, buffer, hdr_len);
+  uint32_t sum = HAL_ChecksumAdd(0, &buffer[12], 8);
+  sum += 6 + (length - ip_len);
+  uint16_t checksum = HAL_ChecksumFold(sum);
+  headers[ip_len + 16] = checksum >> 8;
+  headers[ip_len + 17] = checksum & 0xff;
+
+  struct iovec iovs[4];
+  iovs[0].iov_base = &vnet;
+  iovs[0].iov_len = sizeof(vnet);
+  iovs[1].iov_base = (void *)header;
+  iovs[1].iov_len = IP_OFFSET;
+  iovs[2].iov_base = headers;
+  iovs[2].iov_len = hdr_len;
+  iovs[3].iov_base = (void *)&buffer[hdr_len];
+  iovs[3].iov_len = length - hdr_len;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iovs;
+  msg.msg_iovlen = 4;
+  while (sendmsg(gso_fds[if_index], &msg, 0) < 0) {
+    if (errno != EINTR) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_SendGsoFrame: sendmsg failed with %s\n",
+                strerror(errno));
+      }
+      stats[if_index].tx_errors++;
+      return HAL_ERR_UNKNOWN;
+    }
+  }
+  stats[if_index].tx_packets++;
+  stats[if_index].tx_bytes += length;
+  return 0;
+}
+#endif
+
+// send a whole frame on if_index, 0 on success
+int HAL_InjectFrame(int if_index, const uint8_t *frame, size_t length) {
+#ifdef HAL_RX_THREADS
+  if (rx_thread_if == if_index) {
+    return send(rx_tx_fds[if_index], frame, length, 0) < 0 ? -1 : 0;
+  }
+#endif
+  return pcap_inject(pcap_out_handles[if_index], frame, length) < 0 ? -1 : 0;
+}
+
+// why the last HAL_InjectFrame on if_index failed
+const char *HAL_InjectError(int if_index) {
+#ifdef HAL_RX_THREADS
+  if (rx_thread_if == if_index) {
+    return strerror(errno);
+  }
+#endif
+  return pcap_geterr(pcap_out_handles[if_index]);
+}
+
+bool HAL_ArpLearn(int if_index, in_addr_t ip, const macaddr_t mac) {
+  std::lock_guard<std::mutex> guard(arp_mutex);
+  return HAL_ArpTableLearn(if_index, ip, mac);
+}
+
+int HAL_ArpLookup(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  std::lock_guard<std::mutex> guard(arp_mutex);
+  return HAL_ArpTableLookup(if_index, ip, o_mac, count);
+}
+
+// packets held for arp may be released on an RX thread, so they go out
+// directly instead of through the send queues of the caller
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t dst_mac) {
+  if (!pcap_out_handles[if_index]) {
+    return;
+  }
+  uint8_t frame[IP_OFFSET + sizeof(arp_pending[0].buffer)];
+  HAL_BuildHeader(if_index, dst_mac, frame);
+  memcpy(&frame[IP_OFFSET], buffer, length);
+  if (HAL_InjectFrame(if_index, frame, length + IP_OFFSET) == 0) {
+    stats[if_index].tx_packets++;
+    stats[if_index].tx_bytes += length;
+  } else {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_ArpSendPending: inject failed with %s\n",
+              HAL_InjectError(if_index));
+    }
+    stats[if_index].tx_errors++;
+  }
+}
+
+void HAL_HandleArp(int if_index, const uint8_t *packet, uint32_t caplen) {
+  if (caplen < 42) {
+    // truncated
+    return;
+  }
+  if (packet[21] == 0x01) {
+    stats[if_index].arp_requests_rx++;
+  } else if (packet[21] == 0x02) {
+    stats[if_index].arp_replies_rx++;
+  }
+  // learn it
+  macaddr_t mac;
+  memcpy(mac, &packet[22], sizeof(macaddr_t));
+  in_addr_t ip;
+  memcpy(&ip, &packet[28], sizeof(in_addr_t));
+  if (HAL_ArpLearn(if_index, ip, mac) && debugEnabled) {
+    fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
+            inet_ntoa(in_addr{ip}));
+  }
+
+  in_addr_t dst_ip;
+  memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
+  // ask me: reply
+  if (dst_ip == interface_addrs[if_index] && packet[21] == 0x01) {
+    // reply
+    uint8_t buffer[64] = {0};
+    // dst mac
+    memcpy(buffer, &packet[6], sizeof(macaddr_t));
+    // src mac
+    macaddr_t mac;
+    HAL_GetInterfaceMacAddress(if_index, mac);
+    memcpy(&buffer[6], mac, sizeof(macaddr_t));
+    // ARP
+    buffer[12] = 0x08;
+    buffer[13] = 0x06;
+    // hardware type
+    buffer[15] = 0x01;
+    // protocol type
+    buffer[16] = 0x08;
+    // hardware size
+    buffer[18] = 0x06;
+    // protocol size
+    buffer[19] = 0x04;
+    // opcode
+    buffer[21] = 0x02;
+    // sender
+    memcpy(&buffer[22], mac, sizeof(macaddr_t));
+    memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
+    // target
+    memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
+    memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
+
+    if (HAL_InjectFrame(if_index, buffer, sizeof(buffer)) == 0) {
+      stats[if_index].arp_replies_tx++;
+    }
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
+              inet_ntoa(in_addr{ip}));
+    }
+  }
+}
+
+// handle a captured frame, return true if it is an IPv4 packet for the caller
+bool HAL_DeliverFrame(int if_index, const uint8_t *frame, uint32_t caplen,
+                      uint64_t timestamp, HAL_Packet *packet) {
+  if (caplen < IP_OFFSET ||
+      memcmp(&frame[6], interface_mac[if_index], sizeof(macaddr_t)) == 0) {
+    // skip outbound, in case the kernel can not filter them out
+    return false;
+  } else if (frame[12] == 0x08 && frame[13] == 0x00) {
+    // IPv4
+    // TODO: what if len != caplen
+    // Beware: might be larger than MTU because of offloading, see
+    // HAL_PACKET_VNET_HDR
+    size_t ip_len = caplen - IP_OFFSET;
+    if (packet->buffer == NULL) {
+      // lend the frame out in place, both buffers are mapped writable
+      borrowed_frame = (uint8_t *)frame;
+      packet->buffer = &borrowed_frame[IP_OFFSET];
+      packet->buffer_size = ip_len;
+    } else {
+      size_t real_length =
+          packet->buffer_size > ip_len ? ip_len : packet->buffer_size;
+      memcpy(packet->buffer, &frame[IP_OFFSET], real_length);
+      if (real_length < ip_len) {
+        stats[if_index].rx_truncated++;
+      }
+    }
+#if defined(HAL_PACKET_VNET_HDR) && !defined(HAL_RX_THREADS)
+    // frames queued by the RX threads have left their header behind
+    if (rx_vnet_hdr[if_index]) {
+      HAL_NoteGsoSize(frame, packet->buffer);
+    }
+#endif
+    stats[if_index].rx_packets++;
+    stats[if_index].rx_bytes += ip_len;
+    memcpy(packet->dst_mac, &frame[0], sizeof(macaddr_t));
+    memcpy(packet->src_mac, &frame[6], sizeof(macaddr_t));
+    packet->length = ip_len;
+    packet->if_index = if_index;
+    packet->timestamp = timestamp;
+    return true;
+  } else if (frame[12] == 0x08 && frame[13] == 0x06) {
+    // ARP
+    HAL_HandleArp(if_index, frame, caplen);
+  }
+  return false;
+}
+
+bool HAL_IsBorrowed(const HAL_Packet *packet) {
+  return borrowed_frame != NULL &&
+         packet->buffer == &borrowed_frame[IP_OFFSET];
+}
+
+// fd of the capture socket of if_index
+int HAL_SocketFd(int if_index) {
+#ifdef HAL_PACKET_MMAP
+  return rx_rings[if_index].fd;
+#else
+  return pcap_get_selectable_fd(pcap_in_handles[if_index]);
+#endif
+}
+
+// close the capture socket of if_index, so nothing is received on it
+void HAL_CloseCapture(int if_index) {
+#ifdef HAL_PACKET_MMAP
+  PacketRxRingClose(&rx_rings[if_index]);
+#else
+  if (pcap_in_handles[if_index]) {
+    pcap_close(pcap_in_handles[if_index]);
+    pcap_in_handles[if_index] = NULL;
+  }
+#endif
+}
+
+// spread the frames of if_index over the queues by flow hash, frames of one
+// flow always end up in the same queue
+int HAL_JoinFanout(int if_index) {
+  int arg = fanout_ids[if_index] |
+            ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+  return setsockopt(HAL_SocketFd(if_index), SOL_PACKET, PACKET_FANOUT, &arg,
+                    sizeof(arg));
+}
+
+// fd that becomes readable when if_index has frames for HAL_NextFrame
+int HAL_CaptureFd(int if_index) {
+#ifdef HAL_RX_THREADS
+  return rx_queues[if_index].event_fd;
+#else
+  return HAL_SocketFd(if_index);
+#endif
+}
+
+#ifdef HAL_RX_THREADS
+// body of the RX thread of if_index: ARP is answered right here, IPv4
+// frames are queued for the consumer
+void HAL_RxThread(int if_index) {
+  stats = stats_rows[HAL_MAX_QUEUES + if_index];
+  rx_thread_if = if_index;
+  RxQueue *queue = &rx_queues[if_index];
+  struct pollfd fds[2];
+  fds[0].fd = HAL_SocketFd(if_index);
+  fds[0].events = POLLIN;
+  fds[1].fd = rx_stop_fd;
+  fds[1].events = POLLIN;
+  while (true) {
+    bool queued = false;
+    const uint8_t *frame;
+    uint32_t caplen;
+    uint64_t timestamp;
+    while ((frame = HAL_CaptureFrame(if_index, &caplen, &timestamp)) !=
+           NULL) {
+      if (caplen < IP_OFFSET ||
+          memcmp(&frame[6], interface_mac[if_index], sizeof(macaddr_t)) == 0) {
+        // skip outbound
+        continue;
+      } else if (frame[12] == 0x08 && frame[13] == 0x00) {
+        // IPv4
+        uint32_t head = queue->head.load(std::memory_order_relaxed);
+        if (caplen > queue->frame_size ||
+            head - queue->tail.load(std::memory_order_acquire) ==
+                HAL_RX_QUEUE_SIZE) {
+          // too large or the consumer falls behind: drop it like a NIC would
+          stats[if_index].rx_dropped++;
+          continue;
+        }
+        queue->slots[head & (HAL_RX_QUEUE_SIZE - 1)].caplen = caplen;
+        queue->slots[head & (HAL_RX_QUEUE_SIZE - 1)].timestamp = timestamp;
+        memcpy(&queue->frames[(head & (HAL_RX_QUEUE_SIZE - 1)) *
+                              queue->frame_size],
+               frame, caplen);
+        queue->head.store(head + 1, std::memory_order_release);
+        queued = true;
+      } else if (frame[12] == 0x08 && frame[13] == 0x06) {
+        // ARP
+        HAL_HandleArp(if_index, frame, caplen);
+      }
+    }
+    if (queued) {
+      uint64_t one = 1;
+      // EAGAIN: the counter is saturated, the consumer is woken up anyway
+      if (write(queue->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN &&
+          debugEnabled) {
+        fprintf(stderr, "HAL_RxThread: write to eventfd failed with %s\n",
+                strerror(errno));
+      }
+    }
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_RxThread: poll failed with %s\n",
+                strerror(errno));
+      }
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+  }
+}
+
+// open a socket that sends on if_index and never receives, -1 on failure
+int HAL_OpenTxSocket(int if_index) {
+  unsigned int ifindex = if_nametoindex(interfaces[if_index]);
+  if (ifindex == 0) {
+    return -1;
+  }
+  // protocol 0: no frames are queued on it
+  int fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// start the RX thread of every capturing interface
+int HAL_StartRxThreads() {
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    rx_tx_fds[i] = -1;
+  }
+  rx_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rx_stop_fd < 0) {
+    return HAL_ERR_UNKNOWN;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    rx_queues[i].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!HAL_CaptureEnabled(i)) {
+      continue;
+    }
+    rx_tx_fds[i] = HAL_OpenTxSocket(i);
+    // frames longer than the snaplen never reach the queue
+#ifdef HAL_PACKET_MMAP
+    rx_queues[i].frame_size = IP_OFFSET + 65535;
+#else
+    rx_queues[i].frame_size = pcap_snapshot(pcap_in_handles[i]);
+#endif
+    rx_queues[i].frames =
+        (uint8_t *)calloc(HAL_RX_QUEUE_SIZE, rx_queues[i].frame_size);
+    if (rx_queues[i].event_fd < 0 || rx_tx_fds[i] < 0 ||
+        rx_queues[i].frames == NULL) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: can not set up the RX thread for %s\n",
+                interfaces[i]);
+      }
+      return HAL_ERR_UNKNOWN;
+    }
+    rx_threads[i] = std::thread(HAL_RxThread, i);
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: RX thread started for %s\n", interfaces[i]);
+    }
+  }
+  return 0;
+}
+
+// stop and join the RX threads, at exit before the globals they use go away
+void HAL_StopRxThreads() {
+  uint64_t one = 1;
+  if (write(rx_stop_fd, &one, sizeof(one)) < 0) {
+    // the threads would never see the request
+    return;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (rx_threads[i].joinable()) {
+      rx_threads[i].join();
+    }
+    if (rx_tx_fds[i] >= 0) {
+      close(rx_tx_fds[i]);
+      rx_tx_fds[i] = -1;
+    }
+  }
+}
+#endif
+
+// epoll instance for the capturing interfaces in mask, -1 if unavailable
+int HAL_EpollFd(int mask) {
+  if (epoll_fds[mask] == -1) {
+    epoll_fds[mask] = -2;
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      if ((mask & (1 << i)) == 0 || !HAL_CaptureEnabled(i)) {
+        continue;
+      }
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      event.data.u32 = i;
+      int capture_fd = HAL_CaptureFd(i);
+      if (capture_fd < 0 ||
+          epoll_ctl(fd, EPOLL_CTL_ADD, capture_fd, &event) < 0) {
+        if (debugEnabled) {
+          fprintf(stderr,
+                  "HAL_ReceiveIPPacket: can not wait on %s, falling back to "
+                  "polling\n",
+                  interfaces[i]);
+        }
+        close(fd);
+        return -1;
+      }
+    }
+    epoll_fds[mask] = fd;
+  }
+  return epoll_fds[mask] >= 0 ? epoll_fds[mask] : -1;
+}
+
+// one round robin pass over the interfaces in mask, continuing from where
+// the last pass stopped; returns the number of packets filled in
+size_t HAL_ReceivePass(int mask, HAL_Packet *packets, size_t count) {
+  size_t received = 0;
+  for (int round = 0; round < N_IFACE_ON_BOARD && received < count;
+       round++) {
+    int current_port = next_port;
+    next_port = (next_port + 1) % N_IFACE_ON_BOARD;
+    if ((mask & (1 << current_port)) == 0 ||
+        !HAL_CaptureEnabled(current_port)) {
+      continue;
+    }
+
+    // drain this port
+    const uint8_t *frame;
+    uint32_t caplen;
+    uint64_t timestamp;
+    while (received < count &&
+           (frame = HAL_NextFrame(current_port, &caplen, &timestamp)) !=
+               NULL) {
+      if (HAL_DeliverFrame(current_port, frame, caplen, timestamp,
+                           &packets[received])) {
+        received++;
+      }
+    }
+  }
+  return received;
+}
+
+#ifdef HAL_BUSY_POLL
+uint64_t HAL_GetMicroseconds() {
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000 + (uint64_t)tp.tv_nsec / 1000;
+}
+#endif
+
+// wait for packets on the interfaces in if_index_mask
+int HAL_WaitFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // receiving again invalidates the frame lent out last time
+  borrowed_frame = NULL;
+
+  bool flag = false;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (HAL_CaptureEnabled(i) && (if_index_mask & (1 << i))) {
+      flag = true;
+    }
+  }
+  if (!flag) {
+    if (debugEnabled) {
+      fprintf(stderr,
+              "HAL_ReceiveIPPacket: no viable interfaces open for capture\n");
+    }
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+
+  // frames queued since the last call go out before we start waiting
+  HAL_FlushSend();
+#ifdef HAL_PACKET_VNET_HDR
+  rx_gso_count = 0;
+#endif
+
+  int mask = if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1);
+  int epoll_fd = HAL_EpollFd(mask);
+  int64_t begin = HAL_GetTicks();
+  int64_t current_time = begin;
+#ifdef HAL_BUSY_POLL
+  bool spun = false;
+#endif
+  do {
+    size_t received = HAL_ReceivePass(mask, packets, count);
+    if (received > 0) {
+      return received;
+    }
+    if (timeout == 0) {
+      break;
+    }
+#ifdef HAL_BUSY_POLL
+    if (!spun) {
+      // traffic tends to come in bursts, so spin a little before sleeping
+      spun = true;
+      uint64_t deadline = HAL_GetMicroseconds() + busy_poll_us;
+      if (timeout != -1 &&
+          deadline > (uint64_t)(begin + timeout) * 1000) {
+        deadline = (uint64_t)(begin + timeout) * 1000;
+      }
+      while (HAL_GetMicroseconds() < deadline) {
+        received = HAL_ReceivePass(mask, packets, count);
+        if (received > 0) {
+          busy_poll_us = busy_poll_us * 2 > HAL_BUSY_POLL_MAX_US
+                             ? HAL_BUSY_POLL_MAX_US
+                             : busy_poll_us * 2;
+          return received;
+        }
+      }
+      busy_poll_us = busy_poll_us / 2 < HAL_BUSY_POLL_MIN_US
+                         ? HAL_BUSY_POLL_MIN_US
+                         : busy_poll_us / 2;
+      current_time = HAL_GetTicks();
+      continue;
+    }
+#endif
+    if (epoll_fd >= 0) {
+      // sleep until some interface becomes readable or time is up
+      int wait = -1;
+      if (timeout != -1) {
+        wait = begin + timeout - current_time;
+        if (wait <= 0) {
+          break;
+        }
+      }
+      struct epoll_event events[N_IFACE_ON_BOARD];
+      int ready = epoll_wait(epoll_fd, events, N_IFACE_ON_BOARD, wait);
+      if (ready < 0 && errno != EINTR) {
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_ReceiveIPPacket: epoll_wait failed with %s\n",
+                  strerror(errno));
+        }
+        return HAL_ERR_UNKNOWN;
+      }
+#ifdef HAL_RX_THREADS
+      // reset the eventfds before draining the queues they announce
+      for (int i = 0; i < ready; i++) {
+        uint64_t value;
+        // EAGAIN: already reset by an earlier wait
+        if (read(rx_queues[events[i].data.u32].event_fd, &value,
+                 sizeof(value)) < 0 &&
+            errno != EAGAIN && debugEnabled) {
+          fprintf(stderr, "HAL_ReceiveIPPacket: read from eventfd failed "
+                          "with %s\n",
+                  strerror(errno));
+        }
+      }
+#endif
+    }
+    // -1 for infinity
+  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+  return 0;
+}
+
+// shared by the copying and the borrowing receive, remembers when the wait
+// ended for HAL_GetLoopTicks
+int HAL_ReceiveFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  int res = HAL_WaitFrames(if_index_mask, packets, count, timeout);
+  loop_ticks = HAL_GetTicks();
+  return res;
+}
+
+// open the capture and send handles of the calling thread on every interface
+// fails if a capture socket can not share its frames with the other queues
+int HAL_OpenQueue() {
+  // init pcap handles
+  char error_buffer[PCAP_ERRBUF_SIZE];
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+#ifdef HAL_PACKET_MMAP
+    // capture through our own TPACKET_V3 ring instead of pcap
+    pcap_in_handles[i] = NULL;
+    bool opened = false;
+#ifdef HAL_PACKET_VNET_HDR
+    rx_vnet_hdr[i] = PacketRxRingOpen(&rx_rings[i], interfaces[i], true) == 0;
+    opened = rx_vnet_hdr[i];
+#endif
+    if (opened || PacketRxRingOpen(&rx_rings[i], interfaces[i], false) == 0) {
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: TPACKET_V3 capture enabled for %s with %d blocks "
+                "of %d bytes\n",
+                interfaces[i], HAL_RX_RING_BLOCK_NR, HAL_RX_RING_BLOCK_SIZE);
+      }
+    } else {
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: TPACKET_V3 capture disabled for %s, either the "
+                "interface does not exist or permission is denied\n",
+                interfaces[i]);
+      }
+    }
+#else
+    pcap_in_handles[i] =
+        pcap_open_live(interfaces[i], BUFSIZ, 1, 1, error_buffer);
+    if (pcap_in_handles[i]) {
+      pcap_setnonblock(pcap_in_handles[i], 1, error_buffer);
+      // do not capture what we send ourselves
+      pcap_setdirection(pcap_in_handles[i], PCAP_D_IN);
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: pcap capture enabled for %s\n",
+                interfaces[i]);
+      }
+    } else {
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: pcap capture disabled for %s, either the interface "
+                "does not exist or permission is denied\n",
+                interfaces[i]);
+      }
+    }
+#endif
+    if (HAL_CaptureEnabled(i) && queue_count > 1) {
+      if (HAL_JoinFanout(i) == 0) {
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_Init: %s joined fanout group %d\n",
+                  interfaces[i], fanout_ids[i]);
+        }
+      } else {
+        // without fanout every queue would see every frame and forward it
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_Init: %s failed to join fanout group %d: %s\n",
+                  interfaces[i], fanout_ids[i], strerror(errno));
+        }
+        HAL_CloseCapture(i);
+        return HAL_ERR_UNKNOWN;
+      }
+    }
+    if (HAL_CaptureEnabled(i)) {
+      if (HAL_AttachFilter(i, HAL_CAPTURE_FILTER) == 0) {
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_Init: capture filter \"%s\" attached for %s\n",
+                  HAL_CAPTURE_FILTER, interfaces[i]);
+        }
+      }
+    }
+    pcap_out_handles[i] =
+        pcap_open_live(interfaces[i], BUFSIZ, 1, 0, error_buffer);
+    if (pcap_out_handles[i]) {
+      // the out handle is only used for sending, keep the kernel from
+      // queueing every frame on it too
+      struct bpf_insn reject = BPF_STMT(BPF_RET | BPF_K, 0);
+      struct bpf_program program = {1, &reject};
+      pcap_setfilter(pcap_out_handles[i], &program);
+    }
+#ifdef HAL_PACKET_MMAP
+#ifdef HAL_PACKET_VNET_HDR
+    gso_fds[i] = PacketGsoSocketOpen(interfaces[i]);
+    if (debugEnabled) {
+      fprintf(stderr,
+              "HAL_Init: GRO frames %s captured whole and %s sent with "
+              "segmentation offload on %s\n",
+              rx_vnet_hdr[i] ? "are" : "are not",
+              gso_fds[i] >= 0 ? "are" : "are not", interfaces[i]);
+    }
+#endif
+    if (PacketTxRingOpen(&tx_rings[i], interfaces[i], tx_qdisc_bypass) ==
+        0) {
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: PACKET_TX_RING enabled for %s with %d frames%s\n",
+                interfaces[i], tx_rings[i].req.tp_frame_nr,
+                tx_qdisc_bypass ? ", bypassing qdisc" : "");
+      }
+    }
+#endif
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(kernel_drops_mutex);
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      kernel_drops[bound_queue][i].opened = true;
+      kernel_drops[bound_queue][i].handle = pcap_in_handles[i];
+      kernel_drops[bound_queue][i].fd =
+          HAL_CaptureEnabled(i) ? HAL_SocketFd(i) : -1;
+    }
+  }
+
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    SendQueue *queue = &send_queues[i];
+    for (int j = 0; j < HAL_SEND_BATCH; j++) {
+      queue->iovs[j].iov_base = queue->frames[j];
+      queue->msgs[j].msg_hdr.msg_iov = &queue->iovs[j];
+      queue->msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  for (int i = 0; i < (1 << N_IFACE_ON_BOARD); i++) {
+    epoll_fds[i] = -1;
+  }
+  return 0;
+}
+
+void HAL_SendArpRequest(int if_index, in_addr_t ip,
+                        const macaddr_t dst_mac) {
+  if (!pcap_out_handles[if_index]) {
+    return;
+  }
+  if (debugEnabled) {
+    fprintf(
+        stderr,
+        "HAL_SendArpRequest: asking for ip address %s with arp request\n",
+        inet_ntoa(in_addr{ip}));
+  }
+  uint8_t buffer[64] = {0};
+  // dst mac, broadcast unless the neighbor is asked directly
+  if (dst_mac) {
+    memcpy(buffer, dst_mac, sizeof(macaddr_t));
+  } else {
+    memset(buffer, 0xff, sizeof(macaddr_t));
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // ARP
+  buffer[12] = 0x08;
+  buffer[13] = 0x06;
+  // hardware type
+  buffer[15] = 0x01;
+  // protocol type
+  buffer[16] = 0x08;
+  // hardware size
+  buffer[18] = 0x06;
+  // protocol size
+  buffer[19] = 0x04;
+  // opcode
+  buffer[21] = 0x01;
+  // sender
+  memcpy(&buffer[22], mac, sizeof(macaddr_t));
+  memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+
+  if (pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer)) >= 0) {
+    stats[if_index].arp_requests_tx++;
+  }
+}
+
+// look ip up and send the arp request the table asks for
+int HAL_ArpQuery(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  int result = HAL_ArpLookup(if_index, ip, o_mac, count);
+  if (result == HAL_ARP_HIT_REFRESH) {
+    // about to expire, ask the neighbor directly if it is still there
+    HAL_SendArpRequest(if_index, ip, o_mac);
+  } else if (result == HAL_ARP_SEND_REQUEST) {
+    // not found, the table rate limits arp request by 1 req/s per address
+    HAL_SendArpRequest(if_index, ip, NULL);
+  }
+  return result == HAL_ARP_HIT || result == HAL_ARP_HIT_REFRESH
+             ? 0
+             : HAL_ERR_IP_NOT_EXIST;
+}
 
-std::map<std::pair<in_addr_t, int>, macaddr_t> arp_table;
-std::map<std::pair<in_addr_t, int>, uint64_t> arp_timer;
+// drops counted by the kernel on the capture socket of if_index in queue
+uint64_t HAL_KernelDrops(int queue, int if_index) {
+  KernelDrops *entry = &kernel_drops[queue][if_index];
+  if (!entry->opened) {
+    // not bound yet
+    return 0;
+  }
+#ifdef HAL_PACKET_MMAP
+  if (entry->fd >= 0) {
+    struct tpacket_stats_v3 kstats;
+    socklen_t len = sizeof(kstats);
+    if (getsockopt(entry->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len) ==
+        0) {
+      entry->drops += kstats.tp_drops;
+    }
+  }
+#else
+  struct pcap_stat pstats;
+  if (entry->handle && pcap_stats(entry->handle, &pstats) == 0) {
+    // libpcap keeps the total itself
+    entry->drops = pstats.ps_drop;
+  }
+#endif
+  return entry->drops;
+}
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -41,6 +1296,9 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     return 0;
   }
   debugEnabled = debug;
+  HAL_InitClock();
+  loop_ticks = HAL_GetTicks();
+  HAL_ArpTableInit();
 
   // find matching interfaces and get their MAC address
   struct ifaddrs *ifaddr, *ifa;
@@ -61,8 +1319,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
         memcpy(interface_mac[i],
                ((struct sockaddr_ll *)ifa->ifa_addr)->sll_addr,
                sizeof(macaddr_t));
-        memcpy(arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-               interface_mac[i], sizeof(macaddr_t));
+        HAL_ArpTableAddStatic(i, if_addrs[i], interface_mac[i]);
         if (debugEnabled) {
           fprintf(stderr, "HAL_Init: found MAC addr of interface %s\n",
                   interfaces[i]);
@@ -73,32 +1330,26 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
   }
   freeifaddrs(ifaddr);
 
-  // init pcap handles
-  char error_buffer[PCAP_ERRBUF_SIZE];
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-    pcap_in_handles[i] =
-        pcap_open_live(interfaces[i], BUFSIZ, 1, 1, error_buffer);
-    if (pcap_in_handles[i]) {
-      pcap_setnonblock(pcap_in_handles[i], 1, error_buffer);
-      if (debugEnabled) {
-        fprintf(stderr, "HAL_Init: pcap capture enabled for %s\n",
-                interfaces[i]);
-      }
-    } else {
-      if (debugEnabled) {
-        fprintf(stderr,
-                "HAL_Init: pcap capture disabled for %s, either the interface "
-                "does not exist or permission is denied\n",
-                interfaces[i]);
-      }
-    }
-    pcap_out_handles[i] =
-        pcap_open_live(interfaces[i], BUFSIZ, 1, 0, error_buffer);
+    fanout_ids[i] = (getpid() * N_IFACE_ON_BOARD + i) & 0xffff;
+  }
+  int res = HAL_OpenQueue();
+  if (res < 0) {
+    return res;
   }
 
   memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
 
   inited = true;
+#ifdef HAL_RX_THREADS
+  // threads still running at exit would use the globals as they are
+  // destroyed, so they are stopped first
+  atexit(HAL_StopRxThreads);
+  res = HAL_StartRxThreads();
+  if (res < 0) {
+    return res;
+  }
+#endif
   // send igmp to join RIP multicast group
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
     if (pcap_out_handles[i]) {
@@ -119,6 +1370,15 @@ uint64_t HAL_GetTicks() {
   return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
 }
 
+uint64_t HAL_GetTicksNs() {
+  // served by the vDSO, no system call is made
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
 int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -134,54 +1394,65 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  // lookup arp table
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, it->second, sizeof(macaddr_t));
+  return HAL_ArpQuery(if_index, ip, o_mac, true);
+}
+
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // multicast needs no resolution
+  if ((ip & 0xe0) == 0xe0) {
     return 0;
-  } else if (pcap_out_handles[if_index] &&
-             arp_timer[std::pair<in_addr_t, int>(ip, if_index)] + 1000 <
-                 HAL_GetTicks()) {
-    // not found, send arp request
-    // rate limit arp request by 1 req/s
-    arp_timer[std::pair<in_addr_t, int>(ip, if_index)] = HAL_GetTicks();
-    if (debugEnabled) {
-      fprintf(
-          stderr,
-          "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
-          inet_ntoa(in_addr{ip}));
-    }
-    uint8_t buffer[64] = {0};
-    // dst mac
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // ARP
-    buffer[12] = 0x08;
-    buffer[13] = 0x06;
-    // hardware type
-    buffer[15] = 0x01;
-    // protocol type
-    buffer[16] = 0x08;
-    // hardware size
-    buffer[18] = 0x06;
-    // protocol size
-    buffer[19] = 0x04;
-    // opcode
-    buffer[21] = 0x01;
-    // sender
-    memcpy(&buffer[22], mac, sizeof(macaddr_t));
-    memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+  }
+
+  macaddr_t mac;
+  return HAL_ArpQuery(if_index, ip, mac, false);
+}
+
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  std::lock_guard<std::mutex> guard(arp_mutex);
+  *o_stats = arp_stats;
+  return 0;
+}
 
-    pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
   }
-  return HAL_ERR_IP_NOT_EXIST;
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memset(o_stats, 0, sizeof(*o_stats));
+  for (int row = 0; row < HAL_MAX_QUEUES + N_IFACE_ON_BOARD; row++) {
+    const HAL_InterfaceStats *counters = &stats_rows[row][if_index];
+    o_stats->rx_packets += counters->rx_packets;
+    o_stats->rx_bytes += counters->rx_bytes;
+    o_stats->rx_truncated += counters->rx_truncated;
+    o_stats->rx_dropped += counters->rx_dropped;
+    o_stats->tx_packets += counters->tx_packets;
+    o_stats->tx_bytes += counters->tx_bytes;
+    o_stats->tx_errors += counters->tx_errors;
+    o_stats->arp_requests_rx += counters->arp_requests_rx;
+    o_stats->arp_replies_rx += counters->arp_replies_rx;
+    o_stats->arp_requests_tx += counters->arp_requests_tx;
+    o_stats->arp_replies_tx += counters->arp_replies_tx;
+  }
+  std::lock_guard<std::mutex> guard(kernel_drops_mutex);
+  for (int queue = 0; queue < queue_count; queue++) {
+    o_stats->rx_kernel_drops += HAL_KernelDrops(queue, if_index);
+  }
+  return 0;
 }
 
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
@@ -196,121 +1467,77 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   return 0;
 }
 
+size_t HAL_GetMaxPacketSize() {
+#if defined(HAL_PACKET_MMAP)
+  // the ring hands over whole frames, GRO merged ones can be up to 64 KiB
+  return 65535;
+#else
+  // libpcap cuts frames at the snaplen
+  return BUFSIZ - IP_OFFSET;
+#endif
+}
+
 int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index) {
+  if (if_index == NULL || buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_Packet packet;
+  packet.buffer = buffer;
+  packet.buffer_size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
   }
-  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
-      (timeout < 0 && timeout != -1) || (if_index == NULL) || (buffer == NULL)) {
+  if (packets == NULL || count == 0) {
     return HAL_ERR_INVALID_PARAMETER;
   }
-
-  bool flag = false;
-  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-    if (pcap_in_handles[i] && (if_index_mask & (1 << i))) {
-      flag = true;
-    }
-  }
-  if (!flag) {
-    if (debugEnabled) {
-      fprintf(stderr,
-              "HAL_ReceiveIPPacket: no viable interfaces open for capture\n");
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
     }
-    return HAL_ERR_IFACE_NOT_EXIST;
   }
 
-  int64_t begin = HAL_GetTicks();
-  int64_t current_time = 0;
-  // Round robin
-  int current_port = 0;
-  struct pcap_pkthdr hdr;
-  do {
-    if ((if_index_mask & (1 << current_port)) == 0 ||
-        !pcap_in_handles[current_port]) {
-      current_port = (current_port + 1) % N_IFACE_ON_BOARD;
-      continue;
-    }
 
-    const uint8_t *packet = pcap_next(pcap_in_handles[current_port], &hdr);
-    if (packet && hdr.caplen >= IP_OFFSET &&
-        memcmp(&packet[6], interface_mac[current_port], sizeof(macaddr_t)) ==
-            0) {
-      // skip outbound
-      continue;
-    } else if (packet && hdr.caplen >= IP_OFFSET && packet[12] == 0x08 &&
-               packet[13] == 0x00) {
-      // IPv4
-      // TODO: what if len != caplen
-      // Beware: might be larger than MTU because of offloading
-      size_t ip_len = hdr.caplen - IP_OFFSET;
-      size_t real_length = length > ip_len ? ip_len : length;
-      memcpy(buffer, &packet[IP_OFFSET], real_length);
-      memcpy(dst_mac, &packet[0], sizeof(macaddr_t));
-      memcpy(src_mac, &packet[6], sizeof(macaddr_t));
-      *if_index = current_port;
-      return ip_len;
-    } else if (packet && hdr.caplen >= IP_OFFSET && packet[12] == 0x08 &&
-               packet[13] == 0x06) {
-      // ARP
-      // learn it
-      macaddr_t mac;
-      memcpy(mac, &packet[22], sizeof(macaddr_t));
-      in_addr_t ip;
-      memcpy(&ip, &packet[28], sizeof(in_addr_t));
-      memcpy(arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-             sizeof(macaddr_t));
-      if (debugEnabled) {
-        fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
-                inet_ntoa(in_addr{ip}));
-      }
+  return HAL_ReceiveFrames(if_index_mask, packets, count, timeout);
+}
 
-      in_addr_t dst_ip;
-      memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
-      // ask me: reply
-      if (dst_ip == interface_addrs[current_port] && packet[21] == 0x01) {
-        // reply
-        uint8_t buffer[64] = {0};
-        // dst mac
-        memcpy(buffer, &packet[6], sizeof(macaddr_t));
-        // src mac
-        macaddr_t mac;
-        HAL_GetInterfaceMacAddress(current_port, mac);
-        memcpy(&buffer[6], mac, sizeof(macaddr_t));
-        // ARP
-        buffer[12] = 0x08;
-        buffer[13] = 0x06;
-        // hardware type
-        buffer[15] = 0x01;
-        // protocol type
-        buffer[16] = 0x08;
-        // hardware size
-        buffer[18] = 0x06;
-        // protocol size
-        buffer[19] = 0x04;
-        // opcode
-        buffer[21] = 0x02;
-        // sender
-        memcpy(&buffer[22], mac, sizeof(macaddr_t));
-        memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
-        // target
-        memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
-        memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
-
-        pcap_inject(pcap_out_handles[current_port], buffer, sizeof(buffer));
-        if (debugEnabled) {
-          fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
-                  inet_ntoa(in_addr{ip}));
-        }
-      }
-      // otherwise: learn and ignore
-      continue;
-    }
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // a NULL buffer asks HAL_DeliverFrame to lend the frame out
+  packet->buffer = NULL;
+  packet->buffer_size = 0;
+  return HAL_ReceiveFrames(if_index_mask, packet, 1, timeout);
+}
 
-    current_port = (current_port + 1) % N_IFACE_ON_BOARD;
-    // -1 for infinity
-  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // the frame itself is given back to libpcap or the ring on the next receive
+  borrowed_frame = NULL;
+  packet->buffer = NULL;
   return 0;
 }
 
@@ -325,16 +1552,28 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
   if (!pcap_out_handles[if_index]) {
     return HAL_ERR_IFACE_NOT_EXIST;
   }
+  if (HAL_QueueIPPacket(if_index, buffer, length, dst_mac)) {
+    // the TX ring is kicked later, the send queue goes out right now
+    return HAL_UsingTxRing(if_index) ? 0 : HAL_FlushSendQueue(if_index);
+  }
+
+  // too large to be queued
+#ifdef HAL_PACKET_VNET_HDR
+  uint8_t header[IP_OFFSET];
+  HAL_BuildHeader(if_index, dst_mac, header);
+  int res = HAL_SendGsoFrame(if_index, header, buffer, length);
+  if (res <= 0) {
+    return res;
+  }
+#endif
   uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
-  // IPv4
-  eth_buffer[12] = 0x08;
-  eth_buffer[13] = 0x00;
+  HAL_BuildHeader(if_index, dst_mac, eth_buffer);
   memcpy(&eth_buffer[IP_OFFSET], buffer, length);
   if (pcap_inject(pcap_out_handles[if_index], eth_buffer, length + IP_OFFSET) >=
       0) {
     free(eth_buffer);
+    stats[if_index].tx_packets++;
+    stats[if_index].tx_bytes += length;
     return 0;
   } else {
     if (debugEnabled) {
@@ -342,7 +1581,245 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
               pcap_geterr(pcap_out_handles[if_index]));
     }
     free(eth_buffer);
+    stats[if_index].tx_errors++;
+    return HAL_ERR_UNKNOWN;
+  }
+}
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].if_index >= N_IFACE_ON_BOARD || packets[i].if_index < 0 ||
+        packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+    if (!pcap_out_handles[packets[i].if_index]) {
+      return HAL_ERR_IFACE_NOT_EXIST;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    HAL_Packet *packet = &packets[i];
+    if (!HAL_QueueIPPacket(packet->if_index, packet->buffer, packet->length,
+                           packet->dst_mac)) {
+      int res = HAL_SendIPPacket(packet->if_index, packet->buffer,
+                                 packet->length, packet->dst_mac);
+      if (res < 0) {
+        return res;
+      }
+    }
+  }
+  return count;
+}
+
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res == 0) {
+    HAL_Packet packet;
+    packet.buffer = buffer;
+    packet.length = length;
+    memcpy(packet.dst_mac, dst_mac, sizeof(macaddr_t));
+    packet.if_index = if_index;
+    res = HAL_SendIPPacketBatch(&packet, 1);
+    return res < 0 ? res : 0;
+  } else if (res != HAL_ERR_IP_NOT_EXIST) {
+    return res;
+  }
+  std::lock_guard<std::mutex> guard(arp_mutex);
+  // keep it until the arp reply comes
+  return HAL_ArpPendingAdd(if_index, nexthop, buffer, length)
+             ? 1
+             : HAL_ERR_IP_NOT_EXIST;
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int adjacency;
+  {
+    std::lock_guard<std::mutex> guard(arp_mutex);
+    adjacency = HAL_AdjacencyGet(if_index, nexthop);
+  }
+  // start resolving it right away
+  HAL_ArpResolve(if_index, nexthop);
+  return adjacency;
+}
+
+int HAL_ReleaseAdjacency(int adjacency) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  std::lock_guard<std::mutex> guard(arp_mutex);
+  return HAL_AdjacencyRelease(adjacency) ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t header[HAL_ADJACENCY_HEADER];
+  int if_index;
+  in_addr_t nexthop;
+  int resolved = HAL_AdjacencyRead(adjacency, header, &if_index, &nexthop);
+  if (resolved < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  } else if (resolved == 0) {
+    return HAL_SendIPPacketToNexthop(if_index, buffer, length, nexthop);
+  }
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  if (!HAL_QueueFrame(if_index, header, buffer, length)) {
+    // the header starts with the MAC address of the nexthop
+    int res = HAL_SendIPPacket(if_index, buffer, length, header);
+    return res < 0 ? res : 0;
+  }
+  return 0;
+}
+
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet) ||
+      packet->length > packet->buffer_size ||
+      packet->if_index >= N_IFACE_ON_BOARD || packet->if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int if_index = packet->if_index;
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  uint8_t *frame = borrowed_frame;
+  borrowed_frame = NULL;
+  packet->buffer = NULL;
+#ifdef HAL_PACKET_MMAP
+  // the TX ring needs its own copy anyway
+  if (HAL_UsingTxRing(if_index) &&
+      HAL_QueueIPPacket(if_index, &frame[IP_OFFSET], packet->length,
+                        packet->dst_mac)) {
+    return 0;
+  }
+#endif
+
+  // rewrite the ethernet header in place, the ethertype is already IPv4
+  memcpy(frame, packet->dst_mac, sizeof(macaddr_t));
+  memcpy(&frame[6], interface_mac[if_index], sizeof(macaddr_t));
+  // keep the order of frames already queued
+  if (send_queues[if_index].count > 0) {
+    HAL_FlushSendQueue(if_index);
+  }
+#ifdef HAL_PACKET_VNET_HDR
+  int res = HAL_SendGsoFrame(if_index, frame, &frame[IP_OFFSET],
+                             packet->length);
+  if (res <= 0) {
+    return res;
+  }
+#endif
+  if (pcap_inject(pcap_out_handles[if_index], frame,
+                  packet->length + IP_OFFSET) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_SendBorrowedIPPacket: pcap_inject failed with %s\n",
+              pcap_geterr(pcap_out_handles[if_index]));
+    }
+    stats[if_index].tx_errors++;
     return HAL_ERR_UNKNOWN;
   }
+  stats[if_index].tx_packets++;
+  stats[if_index].tx_bytes += packet->length;
+  return 0;
+}
+
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (filter == NULL) {
+    filter = HAL_CAPTURE_FILTER;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if ((if_index_mask & (1 << i)) && HAL_CaptureEnabled(i) &&
+        HAL_AttachFilter(i, filter) < 0) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+  return 0;
+}
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1 || n > HAL_MAX_QUEUES) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+#ifdef HAL_RX_THREADS
+  if (n > 1) {
+    // the RX threads already own the sockets
+    return HAL_ERR_NOT_SUPPORTED;
+  }
+#endif
+  queue_count = n;
+  return 0;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (queue < 0 || queue >= queue_count) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  bound_queue = queue;
+  stats = stats_rows[queue];
+  // queue 0 was opened by HAL_Init on its own thread
+  if (queue > 0) {
+    int res = HAL_OpenQueue();
+    if (res < 0) {
+      return res;
+    }
+  }
+  // keep the thread and its sockets on one core
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(queue % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 &&
+      debugEnabled) {
+    fprintf(stderr, "HAL_BindQueue: failed to pin queue %d to a CPU\n",
+            queue);
+  }
+  return 0;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  int res = 0;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+#ifdef HAL_PACKET_MMAP
+    if (tx_rings[i].fd >= 0 && PacketTxRingKick(&tx_rings[i], false) < 0) {
+      res = HAL_ERR_UNKNOWN;
+    }
+#endif
+    if (send_queues[i].count > 0 && HAL_FlushSendQueue(i) < 0) {
+      res = HAL_ERR_UNKNOWN;
+    }
+  }
+  return res;
+}
 }
-}
\ No newline at end of file
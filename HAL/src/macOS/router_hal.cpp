@@ -1,9 +1,9 @@
 #include "router_hal.h"
 #include "router_hal_common.h"
+#include "router_hal_arp.h"
 #include <stdio.h>
 
 #include <ifaddrs.h>
-#include <map>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <net/if_dl.h>
@@ -16,10 +16,15 @@
 #include <sys/sysctl.h>
 #include <sys/types.h>
 #include <time.h>
-#include <utility>
 
 const int IP_OFFSET = 14;
 
+// filter attached to every capture handle by HAL_Init, in pcap-filter(7)
+// syntax, so frames we never want are dropped in the kernel
+#ifndef HAL_CAPTURE_FILTER
+#define HAL_CAPTURE_FILTER "ip or arp"
+#endif
+
 const char *interfaces[N_IFACE_ON_BOARD] = {
     "en0",
     "en1",
@@ -29,19 +34,118 @@ const char *interfaces[N_IFACE_ON_BOARD] = {
 
 bool inited = false;
 int debugEnabled = 0;
+
+// buffer behind HAL_ReceiveIPPacketBorrowed
+uint8_t borrow_buffer[2048];
+int borrowed = 0;
+
+// arrival time of the packet HAL_ReceiveIPPacket returned last, picked up by
+// the descriptor based receives
+uint64_t last_timestamp = 0;
+
+// HAL_GetTicks() when the last receive returned
+uint64_t loop_ticks = 0;
+
+// counters of HAL_GetInterfaceStats, kernel drops come from pcap_stats
+HAL_InterfaceStats interface_stats[N_IFACE_ON_BOARD];
 in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
 macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
 
 pcap_t *pcap_in_handles[N_IFACE_ON_BOARD];
 pcap_t *pcap_out_handles[N_IFACE_ON_BOARD];
 
-// workaround for clang
-struct macaddr_wrap {
+// compile filter and attach it to handle
+int HAL_AttachFilter(pcap_t *handle, const char *filter) {
+  struct bpf_program program;
+  if (pcap_compile(handle, &program, filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_AttachFilter: pcap_compile failed with %s\n",
+              pcap_geterr(handle));
+    }
+    return -1;
+  }
+  int res = pcap_setfilter(handle, &program);
+  pcap_freecode(&program);
+  return res;
+}
+
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header) {
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+}
+
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t dst_mac) {
   macaddr_t mac;
-};
+  memcpy(mac, dst_mac, sizeof(macaddr_t));
+  HAL_SendIPPacket(if_index, buffer, length, mac);
+}
+
+void HAL_SendArpRequest(int if_index, in_addr_t ip,
+                        const macaddr_t dst_mac) {
+  if (!pcap_out_handles[if_index]) {
+    return;
+  }
+  if (debugEnabled) {
+    struct in_addr addr;
+    addr.s_addr = ip;
+    fprintf(
+        stderr,
+        "HAL_SendArpRequest: asking for ip address %s with arp request\n",
+        inet_ntoa(addr));
+  }
+  uint8_t buffer[64] = {0};
+  // dst mac, broadcast unless the neighbor is asked directly
+  if (dst_mac) {
+    memcpy(buffer, dst_mac, sizeof(macaddr_t));
+  } else {
+    memset(buffer, 0xff, sizeof(macaddr_t));
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // ARP
+  buffer[12] = 0x08;
+  buffer[13] = 0x06;
+  // hardware type
+  buffer[15] = 0x01;
+  // protocol type
+  buffer[16] = 0x08;
+  // hardware size
+  buffer[18] = 0x06;
+  // protocol size
+  buffer[19] = 0x04;
+  // opcode
+  buffer[21] = 0x01;
+  // sender
+  memcpy(&buffer[22], mac, sizeof(macaddr_t));
+  memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+
+  if (pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer)) >= 0) {
+    interface_stats[if_index].arp_requests_tx++;
+  }
+}
 
-std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
-std::map<std::pair<in_addr_t, int>, uint64_t> arp_timer;
+// look ip up and send the arp request the table asks for
+int HAL_ArpQuery(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  int result = HAL_ArpTableLookup(if_index, ip, o_mac, count);
+  if (result == HAL_ARP_HIT_REFRESH) {
+    // about to expire, ask the neighbor directly if it is still there
+    HAL_SendArpRequest(if_index, ip, o_mac);
+  } else if (result == HAL_ARP_SEND_REQUEST) {
+    // not found, the table rate limits arp request by 1 req/s per address
+    HAL_SendArpRequest(if_index, ip, NULL);
+  }
+  return result == HAL_ARP_HIT || result == HAL_ARP_HIT_REFRESH
+             ? 0
+             : HAL_ERR_IP_NOT_EXIST;
+}
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -49,6 +153,9 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     return 0;
   }
   debugEnabled = debug;
+  HAL_InitClock();
+  loop_ticks = HAL_GetTicks();
+  HAL_ArpTableInit();
 
   struct ifaddrs *ifaddr, *ifa;
   if (getifaddrs(&ifaddr) < 0) {
@@ -110,8 +217,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     caddr_t mac = LLADDR(sdl);
     // found
     memcpy(interface_mac[i], mac, sizeof(macaddr_t));
-    memcpy(&arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-           interface_mac[i], sizeof(macaddr_t));
+    HAL_ArpTableAddStatic(i, if_addrs[i], interface_mac[i]);
     if (debugEnabled) {
       macaddr_t m;
       // handle signedness
@@ -129,6 +235,9 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
         pcap_open_live(interfaces[i], BUFSIZ, 1, 1, error_buffer);
     if (pcap_in_handles[i]) {
       pcap_setnonblock(pcap_in_handles[i], 1, error_buffer);
+      // do not capture what we send ourselves
+      pcap_setdirection(pcap_in_handles[i], PCAP_D_IN);
+      HAL_AttachFilter(pcap_in_handles[i], HAL_CAPTURE_FILTER);
       if (debugEnabled) {
         fprintf(stderr, "HAL_Init: pcap capture enabled for %s\n",
                 interfaces[i]);
@@ -166,6 +275,14 @@ uint64_t HAL_GetTicks() {
   return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
 }
 
+uint64_t HAL_GetTicksNs() {
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
 int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -180,53 +297,52 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, &it->second, sizeof(macaddr_t));
+  return HAL_ArpQuery(if_index, ip, o_mac, true);
+}
+
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // multicast needs no resolution
+  if ((ip & 0xe0) == 0xe0) {
     return 0;
-  } else if (pcap_out_handles[if_index] &&
-             arp_timer[std::pair<in_addr_t, int>(ip, if_index)] + 1000 <
-                 HAL_GetTicks()) {
-    arp_timer[std::pair<in_addr_t, int>(ip, if_index)] = HAL_GetTicks();
-    if (debugEnabled) {
-      struct in_addr addr;
-      addr.s_addr = ip;
-      fprintf(
-          stderr,
-          "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
-          inet_ntoa(addr));
-    }
-    uint8_t buffer[64] = {0};
-    // dst mac
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // ARP
-    buffer[12] = 0x08;
-    buffer[13] = 0x06;
-    // hardware type
-    buffer[15] = 0x01;
-    // protocol type
-    buffer[16] = 0x08;
-    // hardware size
-    buffer[18] = 0x06;
-    // protocol size
-    buffer[19] = 0x04;
-    // opcode
-    buffer[21] = 0x01;
-    // sender
-    memcpy(&buffer[22], mac, sizeof(macaddr_t));
-    memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[38], &ip, sizeof(in_addr_t));
-
-    pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
-  }
-  return HAL_ERR_IP_NOT_EXIST;
+  }
+
+  macaddr_t mac;
+  return HAL_ArpQuery(if_index, ip, mac, false);
+}
+
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = arp_stats;
+  return 0;
+}
+
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = interface_stats[if_index];
+  struct pcap_stat pstats;
+  if (pcap_in_handles[if_index] &&
+      pcap_stats(pcap_in_handles[if_index], &pstats) == 0) {
+    // dropped by BPF because its buffer was full
+    o_stats->rx_kernel_drops = pstats.ps_drop;
+  }
+  return 0;
 }
 
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
@@ -241,6 +357,11 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   return 0;
 }
 
+size_t HAL_GetMaxPacketSize() {
+  // libpcap cuts frames at the snaplen
+  return BUFSIZ - IP_OFFSET;
+}
+
 int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index) {
@@ -291,20 +412,31 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
       size_t ip_len = hdr.caplen - IP_OFFSET;
       size_t real_length = length > ip_len ? ip_len : length;
       memcpy(buffer, &packet[IP_OFFSET], real_length);
+      if (real_length < ip_len) {
+        interface_stats[current_port].rx_truncated++;
+      }
+      interface_stats[current_port].rx_packets++;
+      interface_stats[current_port].rx_bytes += ip_len;
       memcpy(dst_mac, &packet[0], sizeof(macaddr_t));
       memcpy(src_mac, &packet[6], sizeof(macaddr_t));
       *if_index = current_port;
+      last_timestamp =
+          HAL_RealtimeToTicksNs(hdr.ts.tv_sec, hdr.ts.tv_usec * 1000);
+      loop_ticks = HAL_GetTicks();
       return ip_len;
     } else if (packet && hdr.caplen >= IP_OFFSET && packet[12] == 0x08 &&
                packet[13] == 0x06) {
       // ARP
+      if (hdr.caplen >= 42 && packet[21] == 0x01) {
+        interface_stats[current_port].arp_requests_rx++;
+      } else if (hdr.caplen >= 42 && packet[21] == 0x02) {
+        interface_stats[current_port].arp_replies_rx++;
+      }
       macaddr_t mac;
       memcpy(mac, &packet[22], sizeof(macaddr_t));
       in_addr_t ip;
       memcpy(&ip, &packet[28], sizeof(in_addr_t));
-      memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-             sizeof(macaddr_t));
-      if (debugEnabled) {
+      if (HAL_ArpTableLearn(current_port, ip, mac) && debugEnabled) {
         struct in_addr addr;
         addr.s_addr = ip;
         fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
@@ -342,7 +474,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
         memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
 
-        pcap_inject(pcap_out_handles[current_port], buffer, sizeof(buffer));
+        if (pcap_inject(pcap_out_handles[current_port], buffer,
+                        sizeof(buffer)) >= 0) {
+          interface_stats[current_port].arp_replies_tx++;
+        }
         if (debugEnabled) {
           struct in_addr addr;
           addr.s_addr = ip;
@@ -356,9 +491,133 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
     current_port = (current_port + 1) % N_IFACE_ON_BOARD;
     // -1 for infinity
   } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+  loop_ticks = current_time;
+  return 0;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
+  if (packets == NULL || count == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no native batching on this platform: wait for the first packet, then take
+  // whatever is immediately available
+  size_t received = 0;
+  while (received < count) {
+    HAL_Packet *packet = &packets[received];
+    int res = HAL_ReceiveIPPacket(
+        if_index_mask, packet->buffer, packet->buffer_size, packet->src_mac,
+        packet->dst_mac, received == 0 ? timeout : 0, &packet->if_index);
+    if (res < 0) {
+      return received > 0 ? (int)received : res;
+    } else if (res == 0) {
+      break;
+    }
+    packet->length = res;
+    packet->timestamp = last_timestamp;
+    received++;
+  }
+  return received;
+}
+
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no way to lend out the capture buffer on this platform, receive into our
+  // own buffer instead
+  borrowed = 0;
+  packet->buffer = borrow_buffer;
+  packet->buffer_size = sizeof(borrow_buffer);
+  int res = HAL_ReceiveIPPacket(if_index_mask, packet->buffer,
+                                packet->buffer_size, packet->src_mac,
+                                packet->dst_mac, timeout, &packet->if_index);
+  if (res <= 0) {
+    packet->buffer = NULL;
+    return res;
+  }
+  packet->length = res;
+  packet->timestamp = last_timestamp;
+  borrowed = 1;
+  return 1;
+}
+
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = 0;
+  packet->buffer = NULL;
   return 0;
 }
 
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res == 0) {
+    return HAL_SendIPPacket(if_index, buffer, length, dst_mac);
+  } else if (res != HAL_ERR_IP_NOT_EXIST) {
+    return res;
+  }
+  // keep it until the arp reply comes
+  return HAL_ArpPendingAdd(if_index, nexthop, buffer, length)
+             ? 1
+             : HAL_ERR_IP_NOT_EXIST;
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int adjacency = HAL_AdjacencyGet(if_index, nexthop);
+  // start resolving it right away
+  HAL_ArpResolve(if_index, nexthop);
+  return adjacency;
+}
+
+int HAL_ReleaseAdjacency(int adjacency) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return HAL_AdjacencyRelease(adjacency) ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t header[HAL_ADJACENCY_HEADER];
+  int if_index;
+  in_addr_t nexthop;
+  int resolved = HAL_AdjacencyRead(adjacency, header, &if_index, &nexthop);
+  if (resolved < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  } else if (resolved == 0) {
+    return HAL_SendIPPacketToNexthop(if_index, buffer, length, nexthop);
+  }
+  // every frame is injected on its own here, only the lookup is saved
+  return HAL_SendIPPacket(if_index, buffer, length, header);
+}
+
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer ||
+      packet->length > packet->buffer_size) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = 0;
+  packet->buffer = NULL;
+  return HAL_SendIPPacket(packet->if_index, borrow_buffer, packet->length,
+                          packet->dst_mac);
+}
+
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
   if (!inited) {
@@ -371,15 +630,13 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
     return HAL_ERR_IFACE_NOT_EXIST;
   }
   uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
-  // IPv4
-  eth_buffer[12] = 0x08;
-  eth_buffer[13] = 0x00;
+  HAL_BuildHeader(if_index, dst_mac, eth_buffer);
   memcpy(&eth_buffer[IP_OFFSET], buffer, length);
   if (pcap_inject(pcap_out_handles[if_index], eth_buffer, length + IP_OFFSET) >=
       0) {
     free(eth_buffer);
+    interface_stats[if_index].tx_packets++;
+    interface_stats[if_index].tx_bytes += length;
     return 0;
   } else {
     if (debugEnabled) {
@@ -387,7 +644,64 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
               pcap_geterr(pcap_out_handles[if_index]));
     }
     free(eth_buffer);
+    interface_stats[if_index].tx_errors++;
     return HAL_ERR_UNKNOWN;
   }
 }
-}
\ No newline at end of file
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no send queue on this platform, every packet goes out right away
+  for (size_t i = 0; i < count; i++) {
+    int res = HAL_SendIPPacket(packets[i].if_index, packets[i].buffer,
+                               packets[i].length, packets[i].dst_mac);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return count;
+}
+
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (filter == NULL) {
+    filter = HAL_CAPTURE_FILTER;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if ((if_index_mask & (1 << i)) && pcap_in_handles[i] &&
+        HAL_AttachFilter(pcap_in_handles[i], filter) < 0) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+  return 0;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return 0;
+}
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // only a single queue
+  return n == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return queue == 0 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+}
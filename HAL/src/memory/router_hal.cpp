@@ -0,0 +1,679 @@
+#include "router_hal.h"
+#include <stdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+// every neighbor answers at once, so learn on every miss without rate limits
+#define HAL_ARP_RELEARN_INTERVAL 0
+#define HAL_ARP_LEARN_RATE 0
+#include "router_hal_arp.h"
+
+// packets are kept without the link layer, the header built for adjacencies
+// is plain Ethernet
+const int IP_OFFSET = 14;
+
+// number of packets handed out before HAL_ERR_EOF is reported
+#ifndef HAL_MEMORY_PACKETS
+#define HAL_MEMORY_PACKETS 10000000
+#endif
+
+// flows in the generated traffic, each one is a single packet in the ring
+#ifndef HAL_MEMORY_FLOWS
+#define HAL_MEMORY_FLOWS 1024
+#endif
+
+// every HAL_MEMORY_REMOTE-th flow goes to a network behind a neighbor that
+// announces it over RIP, so it takes a learned nexthop and its adjacency;
+// 0 keeps all flows on directly connected networks
+#ifndef HAL_MEMORY_REMOTE
+#define HAL_MEMORY_REMOTE 2
+#endif
+
+// length of a generated IPv4 packet, 46 bytes make a minimum sized frame
+#ifndef HAL_MEMORY_LENGTH
+#define HAL_MEMORY_LENGTH 46
+#endif
+
+bool inited = false;
+int debugEnabled = 0;
+in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
+macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
+
+// the packets handed out in turn, forever, stored back to back in ring_data
+struct MemoryFrame {
+  uint32_t offset;
+  uint16_t length;
+  uint8_t if_index;
+  macaddr_t src_mac;
+};
+std::vector<MemoryFrame> ring_frames;
+std::vector<uint8_t> ring_data;
+size_t ring_next = 0;
+// longest packet in the ring, returned by HAL_GetMaxPacketSize
+size_t ring_max_length = 0;
+
+// buffer behind HAL_ReceiveIPPacketBorrowed, the ring itself is never lent
+// out so packets stay intact for the next round
+uint8_t borrow_buffer[2048];
+bool borrowed = false;
+
+// what went through the router, reported at exit
+struct {
+  // returned by HAL_GetInterfaceStats
+  HAL_InterfaceStats interfaces[N_IFACE_ON_BOARD];
+  // over all interfaces, compared against HAL_MEMORY_PACKETS
+  uint64_t rx_packets;
+  // packets sent with a wrong IPv4 header checksum
+  uint64_t tx_bad_checksum;
+  // folded sum of everything sent, so the data is read like a NIC would
+  uint64_t sink;
+} memory_stats;
+
+// HAL_GetTicksNs() of the first receive and of the end of input
+uint64_t begin_ns = 0;
+uint64_t end_ns = 0;
+
+// HAL_GetTicks() when the last receive returned
+uint64_t loop_ticks = 0;
+
+// MAC address every neighbor answers with
+void HAL_NeighborMac(in_addr_t ip, macaddr_t o_mac) {
+  o_mac[0] = 0x02;
+  o_mac[1] = 0x00;
+  memcpy(&o_mac[2], &ip, sizeof(in_addr_t));
+}
+
+uint16_t HAL_Checksum(const uint8_t *data, size_t length) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < length; i += 2) {
+    sum += (data[i] << 8) | data[i + 1];
+  }
+  if (length & 1) {
+    sum += data[length - 1] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+// append an IPv4 packet to the ring
+void HAL_AddFrame(int if_index, const uint8_t *packet, size_t length,
+                  const macaddr_t src_mac) {
+  MemoryFrame frame;
+  frame.offset = ring_data.size();
+  frame.length = length;
+  frame.if_index = if_index;
+  memcpy(frame.src_mac, src_mac, sizeof(macaddr_t));
+  ring_data.insert(ring_data.end(), packet, packet + length);
+  ring_frames.push_back(frame);
+  if (length > ring_max_length) {
+    ring_max_length = length;
+  }
+}
+
+// host on the network behind the neighbor of if_index, 172.16.if_index.host
+in_addr_t HAL_RemoteAddr(int if_index, uint32_t host) {
+  return 0x000010ac | ((uint32_t)if_index << 16) | (host << 24);
+}
+
+// a RIP response from .254 on if_index announcing the network behind it,
+// kept in the ring so that it is refreshed like a periodic update
+void HAL_GenerateRoute(int if_index) {
+  in_addr_t src = (interface_addrs[if_index] & 0x00ffffff) | (254u << 24);
+  // 224.0.0.9
+  in_addr_t dst = 0x090000e0;
+  in_addr_t network = HAL_RemoteAddr(if_index, 0);
+
+  uint8_t packet[20 + 8 + 4 + 20] = {0};
+  // IPv4 header
+  packet[0] = 0x45;
+  packet[3] = sizeof(packet);
+  packet[8] = 1;
+  packet[9] = 17;
+  memcpy(&packet[12], &src, sizeof(in_addr_t));
+  memcpy(&packet[16], &dst, sizeof(in_addr_t));
+  uint16_t checksum = HAL_Checksum(packet, 20);
+  packet[10] = checksum >> 8;
+  packet[11] = checksum & 0xff;
+  // UDP header, 520 to 520
+  packet[20] = 520 >> 8;
+  packet[21] = 520 & 0xff;
+  packet[22] = 520 >> 8;
+  packet[23] = 520 & 0xff;
+  packet[25] = sizeof(packet) - 20;
+  // RIPv2 response with one entry: family 2, the /24, metric 1
+  packet[28] = 2;
+  packet[29] = 2;
+  packet[33] = 2;
+  memcpy(&packet[36], &network, sizeof(in_addr_t));
+  packet[40] = packet[41] = packet[42] = 0xff;
+  packet[51] = 1;
+
+  macaddr_t src_mac;
+  HAL_NeighborMac(src, src_mac);
+  HAL_AddFrame(if_index, packet, sizeof(packet), src_mac);
+}
+
+// fill the ring with UDP packets from hosts on one interface to hosts on the
+// next one, in the /24 of the interface addresses or behind its neighbor
+void HAL_GenerateFrames() {
+  if (HAL_MEMORY_REMOTE > 0) {
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      HAL_GenerateRoute(i);
+    }
+  }
+  for (int k = 0; k < HAL_MEMORY_FLOWS; k++) {
+    int in_if = k % N_IFACE_ON_BOARD;
+    int out_if = (k + 1) % N_IFACE_ON_BOARD;
+    uint32_t host = 2 + (k / N_IFACE_ON_BOARD) % 250;
+    in_addr_t src = (interface_addrs[in_if] & 0x00ffffff) | (host << 24);
+    in_addr_t dst = (interface_addrs[out_if] & 0x00ffffff) | (host << 24);
+    if (HAL_MEMORY_REMOTE > 0 && k % HAL_MEMORY_REMOTE == 0) {
+      dst = HAL_RemoteAddr(out_if, host);
+    }
+
+    uint8_t packet[HAL_MEMORY_LENGTH] = {0};
+    // IPv4 header
+    packet[0] = 0x45;
+    packet[2] = HAL_MEMORY_LENGTH >> 8;
+    packet[3] = HAL_MEMORY_LENGTH & 0xff;
+    packet[4] = k >> 8;
+    packet[5] = k & 0xff;
+    // don't fragment
+    packet[6] = 0x40;
+    // ttl
+    packet[8] = 64;
+    // UDP
+    packet[9] = 17;
+    memcpy(&packet[12], &src, sizeof(in_addr_t));
+    memcpy(&packet[16], &dst, sizeof(in_addr_t));
+    uint16_t checksum = HAL_Checksum(packet, 20);
+    packet[10] = checksum >> 8;
+    packet[11] = checksum & 0xff;
+    // UDP header, from a port per flow to discard
+    packet[20] = (1024 + k) >> 8;
+    packet[21] = (1024 + k) & 0xff;
+    packet[23] = 9;
+    packet[24] = (HAL_MEMORY_LENGTH - 20) >> 8;
+    packet[25] = (HAL_MEMORY_LENGTH - 20) & 0xff;
+
+    macaddr_t src_mac;
+    HAL_NeighborMac(src, src_mac);
+    HAL_AddFrame(in_if, packet, sizeof(packet), src_mac);
+  }
+}
+
+// fill the ring with the IPv4 frames of a capture, the VLAN number is the
+// interface like in the stdio backend; return 0 on success
+int HAL_LoadFrames(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return -1;
+  }
+  uint32_t header[6];
+  if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != 0xa1b2c3d4) {
+    // only the native pcap format
+    fclose(fp);
+    return -1;
+  }
+  uint32_t record[4];
+  uint8_t frame[0x40000];
+  while (fread(record, sizeof(record), 1, fp) == 1) {
+    uint32_t caplen = record[2];
+    if (caplen > sizeof(frame) || fread(frame, caplen, 1, fp) != 1) {
+      break;
+    }
+    if (caplen >= 18 + 20 && frame[12] == 0x81 && frame[13] == 0x00 &&
+        frame[15] < N_IFACE_ON_BOARD && frame[16] == 0x08 &&
+        frame[17] == 0x00) {
+      HAL_AddFrame(frame[15], &frame[18], caplen - 18, &frame[6]);
+    }
+  }
+  fclose(fp);
+  return ring_frames.empty() ? -1 : 0;
+}
+
+void HAL_SinkPacket(int if_index, const uint8_t *buffer, size_t length) {
+  memory_stats.interfaces[if_index].tx_packets++;
+  memory_stats.interfaces[if_index].tx_bytes += length;
+  if (length < 20 || HAL_Checksum(buffer, 20) != 0) {
+    memory_stats.tx_bad_checksum++;
+  }
+  uint64_t sum = 0;
+  for (size_t i = 0; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, &buffer[i], sizeof(word));
+    sum += word;
+  }
+  memory_stats.sink += sum;
+}
+
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header) {
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+}
+
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t /* dst_mac */) {
+  HAL_SinkPacket(if_index, buffer, length);
+}
+
+// look ip up, a missing neighbor answers right away
+int HAL_ArpQuery(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  int result = HAL_ArpTableLookup(if_index, ip, o_mac, count);
+  if (result != HAL_ARP_HIT) {
+    HAL_NeighborMac(ip, o_mac);
+    HAL_ArpTableLearn(if_index, ip, o_mac);
+  }
+  return 0;
+}
+
+// print what went through the router and how fast
+void HAL_PrintSummary() {
+  uint64_t elapsed = (end_ns ? end_ns : HAL_GetTicksNs()) - begin_ns;
+  uint64_t rx_bytes = 0, tx_packets = 0, tx_bytes = 0;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    rx_bytes += memory_stats.interfaces[i].rx_bytes;
+    tx_packets += memory_stats.interfaces[i].tx_packets;
+    tx_bytes += memory_stats.interfaces[i].tx_bytes;
+  }
+  fprintf(stderr,
+          "HAL_Memory: received %llu packets (%llu bytes), sent %llu packets "
+          "(%llu bytes, %llu with bad checksum) in %.3f s, %.3f Mpps, sink "
+          "%016llx\n",
+          (unsigned long long)memory_stats.rx_packets,
+          (unsigned long long)rx_bytes,
+          (unsigned long long)tx_packets, (unsigned long long)tx_bytes,
+          (unsigned long long)memory_stats.tx_bad_checksum, elapsed / 1e9,
+          elapsed ? memory_stats.rx_packets * 1e3 / elapsed : 0.0,
+          (unsigned long long)memory_stats.sink);
+}
+
+// hand out packets from the ring, never waits
+int HAL_ReceiveFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // receiving again invalidates the packet lent out last time
+  borrowed = false;
+
+  uint64_t now = HAL_GetTicksNs();
+  loop_ticks = now / 1000000;
+  if (begin_ns == 0) {
+    begin_ns = now;
+  }
+  if (memory_stats.rx_packets >= HAL_MEMORY_PACKETS) {
+    if (end_ns == 0) {
+      end_ns = now;
+    }
+    return HAL_ERR_EOF;
+  }
+
+  size_t received = 0;
+  // one round over the ring at most, in case no packet matches the mask
+  for (size_t round = 0; round < ring_frames.size() && received < count &&
+                         memory_stats.rx_packets < HAL_MEMORY_PACKETS;
+       round++) {
+    const MemoryFrame *frame = &ring_frames[ring_next];
+    ring_next = ring_next + 1 == ring_frames.size() ? 0 : ring_next + 1;
+    if ((if_index_mask & (1 << frame->if_index)) == 0) {
+      continue;
+    }
+    HAL_Packet *packet = &packets[received++];
+    if (packet->buffer == NULL) {
+      packet->buffer = borrow_buffer;
+      packet->buffer_size = sizeof(borrow_buffer);
+      borrowed = true;
+    }
+    size_t real_length = packet->buffer_size > frame->length
+                             ? frame->length
+                             : packet->buffer_size;
+    memcpy(packet->buffer, &ring_data[frame->offset], real_length);
+    if (real_length < frame->length) {
+      memory_stats.interfaces[frame->if_index].rx_truncated++;
+    }
+    memcpy(packet->src_mac, frame->src_mac, sizeof(macaddr_t));
+    memcpy(packet->dst_mac, interface_mac[frame->if_index],
+           sizeof(macaddr_t));
+    packet->length = frame->length;
+    packet->if_index = frame->if_index;
+    packet->timestamp = now;
+    memory_stats.rx_packets++;
+    memory_stats.interfaces[frame->if_index].rx_packets++;
+    memory_stats.interfaces[frame->if_index].rx_bytes += frame->length;
+  }
+  return received;
+}
+
+extern "C" {
+int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
+  if (inited) {
+    return 0;
+  }
+  debugEnabled = debug;
+  loop_ticks = HAL_GetTicks();
+  HAL_ArpTableInit();
+
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    // hard coded MAC
+    macaddr_t mac = {2, 3, 3, 0, 0, (uint8_t)i};
+    memcpy(interface_mac[i], mac, sizeof(macaddr_t));
+    HAL_ArpTableAddStatic(i, if_addrs[i], interface_mac[i]);
+  }
+  memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
+
+  // packets come from HAL_MEMORY_INPUT if it names a capture, generated
+  // otherwise
+  const char *input = getenv("HAL_MEMORY_INPUT");
+  if (input != NULL && HAL_LoadFrames(input) == 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: %zu packets loaded from %s\n",
+              ring_frames.size(), input);
+    }
+  } else {
+    if (input != NULL && debugEnabled) {
+      fprintf(stderr, "HAL_Init: can not load packets from %s\n", input);
+    }
+    ring_frames.clear();
+    ring_data.clear();
+    ring_max_length = 0;
+    HAL_GenerateFrames();
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: %zu packets generated\n",
+              ring_frames.size());
+    }
+  }
+  atexit(HAL_PrintSummary);
+
+  inited = true;
+  return 0;
+}
+
+uint64_t HAL_GetTicks() {
+  struct timespec tp = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
+}
+
+uint64_t HAL_GetTicksNs() {
+  struct timespec tp = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
+int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  if ((ip & 0xe0) == 0xe0) {
+    uint8_t multicasting_mac[6] = {0x01, 0, 0x5e, (uint8_t)((ip >> 8) & 0x7f), (uint8_t)(ip >> 16), (uint8_t)(ip >> 24)};
+    memcpy(o_mac, multicasting_mac, sizeof(macaddr_t));
+    return 0;
+  }
+
+  return HAL_ArpQuery(if_index, ip, o_mac, true);
+}
+
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // multicast needs no resolution
+  if ((ip & 0xe0) == 0xe0) {
+    return 0;
+  }
+
+  macaddr_t mac;
+  return HAL_ArpQuery(if_index, ip, mac, false);
+}
+
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = arp_stats;
+  return 0;
+}
+
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = memory_stats.interfaces[if_index];
+  return 0;
+}
+
+int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+
+  memcpy(o_mac, interface_mac[if_index], sizeof(macaddr_t));
+  return 0;
+}
+
+size_t HAL_GetMaxPacketSize() {
+  // frames read from the input file are only known after init
+  return inited ? ring_max_length : 65535;
+}
+
+int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
+                        macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
+                        int *if_index) {
+  if (if_index == NULL || buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_Packet packet;
+  packet.buffer = buffer;
+  packet.buffer_size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL || count == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+
+  return HAL_ReceiveFrames(if_index_mask, packets, count, timeout);
+}
+
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // a NULL buffer asks HAL_ReceiveFrames to lend the packet out
+  packet->buffer = NULL;
+  packet->buffer_size = 0;
+  return HAL_ReceiveFrames(if_index_mask, packet, 1, timeout);
+}
+
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = false;
+  packet->buffer = NULL;
+  return 0;
+}
+
+int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
+                     macaddr_t /* dst_mac */) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_SinkPacket(if_index, buffer, length);
+  return 0;
+}
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].if_index >= N_IFACE_ON_BOARD || packets[i].if_index < 0 ||
+        packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    HAL_SinkPacket(packets[i].if_index, packets[i].buffer, packets[i].length);
+  }
+  return count;
+}
+
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res < 0) {
+    return res;
+  }
+  // neighbors always answer at once, nothing is ever left waiting
+  HAL_SinkPacket(if_index, buffer, length);
+  return 0;
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int adjacency = HAL_AdjacencyGet(if_index, nexthop);
+  // start resolving it right away
+  HAL_ArpResolve(if_index, nexthop);
+  return adjacency;
+}
+
+int HAL_ReleaseAdjacency(int adjacency) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return HAL_AdjacencyRelease(adjacency) ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t header[HAL_ADJACENCY_HEADER];
+  int if_index;
+  in_addr_t nexthop;
+  int resolved = HAL_AdjacencyRead(adjacency, header, &if_index, &nexthop);
+  if (resolved < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  } else if (resolved == 0) {
+    return HAL_SendIPPacketToNexthop(if_index, buffer, length, nexthop);
+  }
+  HAL_SinkPacket(if_index, buffer, length);
+  return 0;
+}
+
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer ||
+      packet->length > packet->buffer_size ||
+      packet->if_index >= N_IFACE_ON_BOARD || packet->if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = false;
+  HAL_SinkPacket(packet->if_index, packet->buffer, packet->length);
+  packet->buffer = NULL;
+  return 0;
+}
+
+int HAL_SetCaptureFilter(int /* if_index_mask */, const char * /* filter */) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  // there is no kernel to filter in
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  // packets are consumed as they are sent
+  return 0;
+}
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // only a single queue
+  return n == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return queue == 0 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+}
@@ -1,12 +1,20 @@
 #include "router_hal.h"
 #include <stdio.h>
 
-#include <map>
 #include <pcap.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
-#include <utility>
+#include <unistd.h>
+
+// the output must only depend on the input, so learn everything and ask again
+// on every miss instead of rate limiting or refreshing by wall clock
+#define HAL_ARP_REFRESH 0
+#define HAL_ARP_RELEARN_INTERVAL 0
+#define HAL_ARP_LEARN_RATE 0
+#include "router_hal_arp.h"
 
 const int IP_OFFSET = 18; // 6 + 6 + 4 + 2
 
@@ -19,16 +27,502 @@ macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
 // input
 pcap_t *pcap_handle;
 
+// when stdin is a regular pcap file it is mapped into memory and parsed here,
+// libpcap is only used for pipes and formats we do not know
+uint8_t *input_map = NULL;
+size_t input_size = 0;
+size_t input_offset = 0;
+// the file was written on a host of the other byte order
+bool input_swapped = false;
+// the record timestamps are in nanoseconds instead of microseconds
+bool input_nanosecond = false;
+
+// a record read too early is kept here and returned by the next read
+bool record_held = false;
+const uint8_t *held_frame;
+uint32_t held_caplen;
+uint64_t held_tstamp;
+
+#ifdef HAL_VIRTUAL_CLOCK
+// time is driven by the capture: a record arrives at its own timestamp,
+// counted from the first record, and waiting for input jumps the clock to the
+// next record or to the end of the timeout instead of sleeping
+uint64_t virtual_ns = 0;
+uint64_t virtual_base_ns = 0;
+bool virtual_based = false;
+#endif
+
 // output
 pcap_t *pcap_out_handle;
 pcap_dumper_t *pcap_dumper;
 
-// workaround for clang
-struct macaddr_wrap {
-  macaddr_t mac;
+// an ARP frame read while a batch was being filled is kept here and handled at
+// the beginning of the next call, so the output stays in input order
+uint8_t stashed_frame[0x40000];
+uint32_t stashed_caplen = 0;
+uint64_t stashed_timestamp = 0;
+
+// HAL_GetTicks() when the last receive returned
+uint64_t loop_ticks = 0;
+
+// counters of HAL_GetInterfaceStats, nothing is ever dropped by a kernel here
+HAL_InterfaceStats interface_stats[N_IFACE_ON_BOARD];
+
+// frame lent out by HAL_ReceiveIPPacketBorrowed, it lives in the read buffer
+// of libpcap and is valid until the next receive
+uint8_t *borrowed_frame = NULL;
+
+// output frames are collected here as pcap records and written together
+uint8_t output_buffer[1 << 20];
+size_t output_used = 0;
+// timestamp of the output records, taken once per receive
+uint32_t output_ts_sec = 0;
+uint32_t output_ts_usec = 0;
+
+// record header in the pcap file format
+struct pcap_record_header {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t caplen;
+  uint32_t len;
 };
 
-std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
+// remember the current time for HAL_GetLoopTicks and the output records
+void HAL_UpdateLoopTicks() {
+  loop_ticks = HAL_GetTicks();
+  output_ts_sec = loop_ticks / 1000;
+  output_ts_usec = loop_ticks % 1000 * 1000;
+}
+
+// write everything in the output buffer to stdout
+void HAL_FlushOutput() {
+  if (output_used == 0) {
+    return;
+  }
+  if (!outputInited) {
+    // output
+    pcap_out_handle = pcap_open_dead(DLT_EN10MB, 0x40000);
+    pcap_dumper = pcap_dump_open(pcap_out_handle, "-");
+    outputInited = true;
+  }
+  fwrite(output_buffer, 1, output_used, pcap_dump_file(pcap_dumper));
+  output_used = 0;
+}
+
+// append a pcap record of length bytes to the output buffer, return where the
+// frame should be written
+uint8_t *HAL_AppendOutput(size_t length) {
+  if (output_used + sizeof(pcap_record_header) + length >
+      sizeof(output_buffer)) {
+    HAL_FlushOutput();
+  }
+  pcap_record_header header;
+  header.ts_sec = output_ts_sec;
+  header.ts_usec = output_ts_usec;
+  header.caplen = header.len = length;
+  memcpy(&output_buffer[output_used], &header, sizeof(header));
+  uint8_t *frame = &output_buffer[output_used + sizeof(header)];
+  output_used += sizeof(header) + length;
+  return frame;
+}
+
+uint32_t HAL_InputWord(const uint8_t *p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return input_swapped ? __builtin_bswap32(word) : word;
+}
+
+// map stdin if it is a regular file in the pcap format with Ethernet frames,
+// return 0 on success
+int HAL_MapInput() {
+  struct stat st;
+  if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < 24) {
+    return -1;
+  }
+  // private and writable, so borrowed frames can be modified in place
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   STDIN_FILENO, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  uint32_t magic;
+  memcpy(&magic, map, sizeof(magic));
+  if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+    input_swapped = false;
+  } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+    input_swapped = true;
+  } else {
+    // pcapng or something else, leave it to libpcap
+    munmap(map, st.st_size);
+    return -1;
+  }
+  input_map = (uint8_t *)map;
+  if (HAL_InputWord(&input_map[20]) != DLT_EN10MB) {
+    munmap(map, st.st_size);
+    input_map = NULL;
+    return -1;
+  }
+  input_nanosecond = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+  input_size = st.st_size;
+  input_offset = 24;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+// fetch the next record of the input, return 1 if frame is set, 0 if there
+// is none yet and HAL_ERR_EOF at the end; tstamp is the time in nanoseconds
+// the capture file records
+int HAL_NextRecord(const uint8_t **frame, uint32_t *caplen, uint64_t *tstamp) {
+  if (record_held) {
+    record_held = false;
+    *frame = held_frame;
+    *caplen = held_caplen;
+    *tstamp = held_tstamp;
+    return 1;
+  }
+  if (input_map == NULL) {
+    struct pcap_pkthdr *hdr;
+    int res = pcap_next_ex(pcap_handle, &hdr, frame);
+    if (res == PCAP_ERROR_BREAK) {
+      return HAL_ERR_EOF;
+    } else if (res != 1) {
+      return 0;
+    }
+    *caplen = hdr->caplen;
+    *tstamp = (uint64_t)hdr->ts.tv_sec * 1000000000 +
+              (uint64_t)hdr->ts.tv_usec * 1000;
+    return 1;
+  }
+  if (input_offset + sizeof(pcap_record_header) > input_size) {
+    return HAL_ERR_EOF;
+  }
+  const uint8_t *record = &input_map[input_offset];
+  *caplen = HAL_InputWord(&record[8]);
+  if (*caplen > input_size - input_offset - sizeof(pcap_record_header)) {
+    // truncated capture
+    return HAL_ERR_EOF;
+  }
+  uint64_t fraction = HAL_InputWord(&record[4]);
+  *tstamp = (uint64_t)HAL_InputWord(&record[0]) * 1000000000 +
+            (input_nanosecond ? fraction : fraction * 1000);
+  *frame = &record[sizeof(pcap_record_header)];
+  input_offset += sizeof(pcap_record_header) + *caplen;
+  return 1;
+}
+
+// give back the record HAL_NextRecord returned last, it is still valid since
+// nothing else has been read
+void HAL_HoldRecord(const uint8_t *frame, uint32_t caplen, uint64_t tstamp) {
+  record_held = true;
+  held_frame = frame;
+  held_caplen = caplen;
+  held_tstamp = tstamp;
+}
+
+#ifdef HAL_VIRTUAL_CLOCK
+// time on the virtual clock a record with tstamp arrives, the clock never
+// goes back even if the capture does
+uint64_t HAL_VirtualArrival(uint64_t tstamp) {
+  if (!virtual_based) {
+    virtual_based = true;
+    virtual_base_ns = tstamp;
+  }
+  uint64_t arrival = tstamp > virtual_base_ns ? tstamp - virtual_base_ns : 0;
+  return arrival > virtual_ns ? arrival : virtual_ns;
+}
+#endif
+
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header) {
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // VLAN
+  header[12] = 0x81;
+  header[13] = 0x00;
+  header[14] = 0x00;
+  header[15] = if_index;
+  // IPv4
+  header[16] = 0x08;
+  header[17] = 0x00;
+}
+
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t dst_mac) {
+  macaddr_t mac;
+  memcpy(mac, dst_mac, sizeof(macaddr_t));
+  HAL_SendIPPacket(if_index, buffer, length, mac);
+}
+
+// learn the sender of an ARP frame and reply if it asks for us
+void HAL_HandleArp(int if_index, const uint8_t *packet, uint32_t caplen) {
+  if (caplen < 46) {
+    // truncated
+    return;
+  }
+  if (packet[25] == 0x01) {
+    interface_stats[if_index].arp_requests_rx++;
+  } else if (packet[25] == 0x02) {
+    interface_stats[if_index].arp_replies_rx++;
+  }
+  macaddr_t mac;
+  memcpy(mac, &packet[26], sizeof(macaddr_t));
+  in_addr_t ip;
+  memcpy(&ip, &packet[32], sizeof(in_addr_t));
+
+  if (HAL_ArpTableLearn(if_index, ip, mac) && debugEnabled) {
+    struct in_addr addr;
+    addr.s_addr = ip;
+    fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
+            inet_ntoa(addr));
+  }
+
+  in_addr_t dst_ip;
+  memcpy(&dst_ip, &packet[42], sizeof(in_addr_t));
+  if (dst_ip == interface_addrs[if_index] && packet[25] == 0x01) {
+    // reply
+    uint8_t buffer[64] = {0};
+    // dst mac
+    memcpy(buffer, &packet[6], sizeof(macaddr_t));
+    // src mac
+    macaddr_t mac;
+    HAL_GetInterfaceMacAddress(if_index, mac);
+    memcpy(&buffer[6], mac, sizeof(macaddr_t));
+    // VLAN
+    buffer[12] = 0x81;
+    buffer[13] = 0x00;
+    buffer[14] = 0x00;
+    buffer[15] = if_index;
+    // ARP
+    buffer[16] = 0x08;
+    buffer[17] = 0x06;
+    // hardware type
+    buffer[19] = 0x01;
+    // protocol type
+    buffer[20] = 0x08;
+    // hardware size
+    buffer[22] = 0x06;
+    // protocol size
+    buffer[23] = 0x04;
+    // opcode
+    buffer[25] = 0x02;
+    // sender
+    memcpy(&buffer[26], mac, sizeof(macaddr_t));
+    memcpy(&buffer[32], &dst_ip, sizeof(in_addr_t));
+    // target
+    memcpy(&buffer[36], &packet[22], sizeof(macaddr_t));
+    memcpy(&buffer[42], &packet[28], sizeof(in_addr_t));
+
+    memcpy(HAL_AppendOutput(sizeof(buffer)), buffer, sizeof(buffer));
+    HAL_FlushOutput();
+    interface_stats[if_index].arp_replies_tx++;
+
+    if (debugEnabled) {
+      struct in_addr addr;
+      addr.s_addr = ip;
+      fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
+              inet_ntoa(addr));
+    }
+  }
+}
+
+// handle a frame read from the input, return true if it is an IPv4 packet for
+// the caller
+bool HAL_DeliverFrame(const uint8_t *packet, uint32_t caplen,
+                      uint64_t timestamp, HAL_Packet *output) {
+  // check 802.1Q
+  if (caplen >= IP_OFFSET && packet[12] == 0x81 && packet[13] == 0x00 &&
+      packet[14] == 0x00 && packet[15] < N_IFACE_ON_BOARD) {
+    int current_port = packet[15];
+    if (packet[16] == 0x08 && packet[17] == 0x00) {
+      // IPv4
+      // assuming len == caplen
+      size_t ip_len = caplen - IP_OFFSET;
+      if (output->buffer == NULL) {
+        // lend the frame out in place
+        borrowed_frame = (uint8_t *)packet;
+        output->buffer = &borrowed_frame[IP_OFFSET];
+        output->buffer_size = ip_len;
+      } else {
+        size_t real_length =
+            output->buffer_size > ip_len ? ip_len : output->buffer_size;
+        memcpy(output->buffer, &packet[IP_OFFSET], real_length);
+        if (real_length < ip_len) {
+          interface_stats[current_port].rx_truncated++;
+        }
+      }
+      interface_stats[current_port].rx_packets++;
+      interface_stats[current_port].rx_bytes += ip_len;
+      memcpy(output->dst_mac, &packet[0], sizeof(macaddr_t));
+      memcpy(output->src_mac, &packet[6], sizeof(macaddr_t));
+      output->length = ip_len;
+      output->if_index = current_port;
+      output->timestamp = timestamp;
+      return true;
+    } else if (packet[16] == 0x08 && packet[17] == 0x06) {
+      // ARP
+      HAL_HandleArp(current_port, packet, caplen);
+    }
+  }
+  return false;
+}
+
+bool HAL_IsBorrowed(const HAL_Packet *packet) {
+  return borrowed_frame != NULL &&
+         packet->buffer == &borrowed_frame[IP_OFFSET];
+}
+
+// read packets from stdin
+int HAL_ReadFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // reading again invalidates the frame lent out last time
+  borrowed_frame = NULL;
+
+  // frames queued since the last call go out before we read more input
+  HAL_FlushSend();
+
+  if (stashed_caplen) {
+    HAL_DeliverFrame(stashed_frame, stashed_caplen, stashed_timestamp,
+                     &packets[0]);
+    stashed_caplen = 0;
+  }
+
+  int64_t begin = HAL_GetTicks();
+  int64_t current_time = 0;
+  size_t received = 0;
+  // times in the capture file are unrelated to our clock, so packets arrive
+  // when they are read; one reading of the clock serves the whole call
+  uint64_t read_time = HAL_GetTicksNs();
+#ifdef HAL_VIRTUAL_CLOCK
+  uint64_t begin_ns = virtual_ns;
+#endif
+
+  const uint8_t *packet;
+  uint32_t caplen;
+  uint64_t tstamp;
+  do {
+    int res = HAL_NextRecord(&packet, &caplen, &tstamp);
+    if (res == HAL_ERR_EOF) {
+      // report the packets we already have first
+      return received > 0 ? received : HAL_ERR_EOF;
+    } else if (res != 1) {
+      // retry
+      continue;
+    }
+
+#ifdef HAL_VIRTUAL_CLOCK
+    uint64_t arrival = HAL_VirtualArrival(tstamp);
+    if (received > 0 ? arrival / 1000000 > virtual_ns / 1000000
+                     : timeout != -1 &&
+                           arrival > begin_ns + (uint64_t)timeout * 1000000) {
+      // it has not arrived yet: a batch only takes what arrived in the same
+      // millisecond, and an empty wait times out
+      HAL_HoldRecord(packet, caplen, tstamp);
+      if (received == 0) {
+        virtual_ns = begin_ns + (uint64_t)timeout * 1000000;
+      }
+      return received;
+    }
+    virtual_ns = read_time = arrival;
+#endif
+
+    if (received > 0 && caplen >= IP_OFFSET && packet[16] == 0x08 &&
+        packet[17] == 0x06 && caplen <= sizeof(stashed_frame)) {
+      // ARP after some IPv4 packets: leave it for the next call
+      memcpy(stashed_frame, packet, caplen);
+      stashed_caplen = caplen;
+      stashed_timestamp = read_time;
+      return received;
+    }
+    if (HAL_DeliverFrame(packet, caplen, read_time, &packets[received])) {
+      received++;
+      if (received == count) {
+        return received;
+      }
+    }
+
+    // -1 for infinity
+  } while (received > 0 ||
+           (current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+  return 0;
+}
+
+// shared by the copying and the borrowing receive, remembers when the read
+// ended for HAL_GetLoopTicks
+int HAL_ReceiveFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  int res = HAL_ReadFrames(if_index_mask, packets, count, timeout);
+  HAL_UpdateLoopTicks();
+  return res;
+}
+
+void HAL_SendArpRequest(int if_index, in_addr_t ip,
+                        const macaddr_t dst_mac) {
+  if (debugEnabled) {
+    struct in_addr addr;
+    addr.s_addr = ip;
+    fprintf(
+        stderr,
+        "HAL_SendArpRequest: asking for ip address %s with arp request\n",
+        inet_ntoa(addr));
+  }
+  uint8_t buffer[64] = {0};
+  // dst mac, broadcast unless the neighbor is asked directly
+  if (dst_mac) {
+    memcpy(buffer, dst_mac, sizeof(macaddr_t));
+  } else {
+    memset(buffer, 0xff, sizeof(macaddr_t));
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // 802.1Q
+  buffer[12] = 0x81;
+  buffer[13] = 0x00;
+  buffer[14] = 0x00;
+  buffer[15] = if_index;
+  // ARP
+  buffer[16] = 0x08;
+  buffer[17] = 0x06;
+  // hardware type
+  buffer[19] = 0x01;
+  // protocol type
+  buffer[20] = 0x08;
+  // hardware size
+  buffer[22] = 0x06;
+  // protocol size
+  buffer[23] = 0x04;
+  // opcode
+  buffer[25] = 0x01;
+  // sender
+  memcpy(&buffer[26], mac, sizeof(macaddr_t));
+  memcpy(&buffer[32], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[42], &ip, sizeof(in_addr_t));
+
+  memcpy(HAL_AppendOutput(sizeof(buffer)), buffer, sizeof(buffer));
+  HAL_FlushOutput();
+  interface_stats[if_index].arp_requests_tx++;
+}
+
+// look ip up and send the arp request the table asks for
+int HAL_ArpQuery(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  int result = HAL_ArpTableLookup(if_index, ip, o_mac, count);
+  if (result == HAL_ARP_HIT_REFRESH) {
+    // about to expire, ask the neighbor directly if it is still there
+    HAL_SendArpRequest(if_index, ip, o_mac);
+  } else if (result == HAL_ARP_SEND_REQUEST || result == HAL_ARP_MISS) {
+    // the output only depends on the input, ask on every miss
+    HAL_SendArpRequest(if_index, ip, NULL);
+  }
+  return result == HAL_ARP_HIT || result == HAL_ARP_HIT_REFRESH
+             ? 0
+             : HAL_ERR_IP_NOT_EXIST;
+}
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -36,20 +530,25 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     return 0;
   }
   debugEnabled = debug;
+  HAL_UpdateLoopTicks();
+  HAL_ArpTableInit();
 
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
     // hard coded MAC
     macaddr_t mac = {2, 3, 3, 0, 0, (uint8_t)i};
     memcpy(interface_mac[i], mac, sizeof(macaddr_t));
-    memcpy(&arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-           interface_mac[i], sizeof(macaddr_t));
+    HAL_ArpTableAddStatic(i, if_addrs[i], interface_mac[i]);
   }
 
   char error_buffer[PCAP_ERRBUF_SIZE];
 
   // input
-  pcap_handle = pcap_open_offline("-", error_buffer);
-  if (!pcap_handle) {
+  if (HAL_MapInput() == 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: input of %zu bytes mapped into memory\n",
+              input_size);
+    }
+  } else if (!(pcap_handle = pcap_open_offline("-", error_buffer))) {
     if (debugEnabled) {
       fprintf(stderr, "pcap_open_offline failed with %s", error_buffer);
     }
@@ -63,11 +562,27 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
 }
 
 uint64_t HAL_GetTicks() {
+#ifdef HAL_VIRTUAL_CLOCK
+  return virtual_ns / 1000000;
+#else
   struct timespec tp = {0};
   clock_gettime(CLOCK_MONOTONIC, &tp);
   return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
+#endif
 }
 
+uint64_t HAL_GetTicksNs() {
+#ifdef HAL_VIRTUAL_CLOCK
+  return virtual_ns;
+#else
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+#endif
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
 int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -82,69 +597,46 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, &it->second, sizeof(macaddr_t));
+  return HAL_ArpQuery(if_index, ip, o_mac, true);
+}
+
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // multicast needs no resolution
+  if ((ip & 0xe0) == 0xe0) {
     return 0;
-  } else {
-    if (debugEnabled) {
-      struct in_addr addr;
-      addr.s_addr = ip;
-      fprintf(
-          stderr,
-          "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
-          inet_ntoa(addr));
-    }
-    uint8_t buffer[64] = {0};
-    // dst mac = broadcast
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // 802.1Q
-    buffer[12] = 0x81;
-    buffer[13] = 0x00;
-    buffer[14] = 0x00;
-    buffer[15] = if_index;
-    // ARP
-    buffer[16] = 0x08;
-    buffer[17] = 0x06;
-    // hardware type
-    buffer[19] = 0x01;
-    // protocol type
-    buffer[20] = 0x08;
-    // hardware size
-    buffer[22] = 0x06;
-    // protocol size
-    buffer[23] = 0x04;
-    // opcode
-    buffer[25] = 0x01;
-    // sender
-    memcpy(&buffer[26], mac, sizeof(macaddr_t));
-    memcpy(&buffer[32], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[42], &ip, sizeof(in_addr_t));
+  }
 
-    struct pcap_pkthdr header;
-    header.caplen = header.len = sizeof(buffer);
+  macaddr_t mac;
+  return HAL_ArpQuery(if_index, ip, mac, false);
+}
 
-    struct timespec tp = {0};
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    header.ts.tv_sec = tp.tv_sec;
-    header.ts.tv_usec = tp.tv_nsec / 1000;
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = arp_stats;
+  return 0;
+}
 
-    if (!outputInited) {
-      // output
-      pcap_out_handle = pcap_open_dead(DLT_EN10MB, 0x40000);
-      pcap_dumper = pcap_dump_open(pcap_out_handle, "-");
-      outputInited = true;
-    }
-    pcap_dump((u_char *)pcap_dumper, &header, buffer);
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
   }
-  return HAL_ERR_IP_NOT_EXIST;
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = interface_stats[if_index];
+  return 0;
 }
 
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
@@ -159,166 +651,230 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   return 0;
 }
 
+size_t HAL_GetMaxPacketSize() {
+  // whatever the input file holds
+  return 65535;
+}
+
 int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index) {
+  if (if_index == NULL || buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_Packet packet;
+  packet.buffer = buffer;
+  packet.buffer_size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
   }
-  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
-      (timeout < 0 && timeout != -1) || (if_index == NULL)) {
+  if (packets == NULL || count == 0) {
     return HAL_ERR_INVALID_PARAMETER;
   }
-
-  int64_t begin = HAL_GetTicks();
-  int64_t current_time = 0;
-
-  struct pcap_pkthdr *hdr;
-  const u_char *packet;
-  do {
-    int res = pcap_next_ex(pcap_handle, &hdr, &packet);
-    if (res == PCAP_ERROR_BREAK) {
-      return HAL_ERR_EOF;
-    } else if (res != 1) {
-      // retry
-      continue;
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
     }
+  }
 
-    // check 802.1Q
-    if (packet && hdr->caplen >= IP_OFFSET && packet[12] == 0x81 &&
-        packet[13] == 0x00 && packet[14] == 0x00 && packet[15] >= 0 &&
-        packet[15] < N_IFACE_ON_BOARD) {
-      int current_port = packet[15];
-      if (packet[16] == 0x08 && packet[17] == 0x00) {
-        // IPv4
-        // assuming len == caplen
-        size_t ip_len = hdr->caplen - IP_OFFSET;
-        size_t real_length = length > ip_len ? ip_len : length;
-        memcpy(buffer, &packet[IP_OFFSET], real_length);
-        memcpy(dst_mac, &packet[0], sizeof(macaddr_t));
-        memcpy(src_mac, &packet[6], sizeof(macaddr_t));
-        *if_index = current_port;
-        return ip_len;
-      } else if (packet[16] == 0x08 && packet[17] == 0x06) {
-        // ARP
-        macaddr_t mac;
-        memcpy(mac, &packet[26], sizeof(macaddr_t));
-        in_addr_t ip;
-        memcpy(&ip, &packet[32], sizeof(in_addr_t));
-
-        memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-               sizeof(macaddr_t));
-        if (debugEnabled) {
-          struct in_addr addr;
-          addr.s_addr = ip;
-          fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
-                  inet_ntoa(addr));
-        }
+  return HAL_ReceiveFrames(if_index_mask, packets, count, timeout);
+}
 
-        in_addr_t dst_ip;
-        memcpy(&dst_ip, &packet[42], sizeof(in_addr_t));
-        if (dst_ip == interface_addrs[current_port] && packet[25] == 0x01) {
-          // reply
-          uint8_t buffer[64] = {0};
-          // dst mac
-          memcpy(buffer, &packet[6], sizeof(macaddr_t));
-          // src mac
-          macaddr_t mac;
-          HAL_GetInterfaceMacAddress(current_port, mac);
-          memcpy(&buffer[6], mac, sizeof(macaddr_t));
-          // VLAN
-          buffer[12] = 0x81;
-          buffer[13] = 0x00;
-          buffer[14] = 0x00;
-          buffer[15] = current_port;
-          // ARP
-          buffer[16] = 0x08;
-          buffer[17] = 0x06;
-          // hardware type
-          buffer[19] = 0x01;
-          // protocol type
-          buffer[20] = 0x08;
-          // hardware size
-          buffer[22] = 0x06;
-          // protocol size
-          buffer[23] = 0x04;
-          // opcode
-          buffer[25] = 0x02;
-          // sender
-          memcpy(&buffer[26], mac, sizeof(macaddr_t));
-          memcpy(&buffer[32], &dst_ip, sizeof(in_addr_t));
-          // target
-          memcpy(&buffer[36], &packet[22], sizeof(macaddr_t));
-          memcpy(&buffer[42], &packet[28], sizeof(in_addr_t));
-
-          struct pcap_pkthdr header;
-          header.caplen = header.len = sizeof(buffer);
-
-          struct timespec tp = {0};
-          clock_gettime(CLOCK_MONOTONIC, &tp);
-          header.ts.tv_sec = tp.tv_sec;
-          header.ts.tv_usec = tp.tv_nsec / 1000;
-
-          if (!outputInited) {
-            // output
-            pcap_out_handle = pcap_open_dead(DLT_EN10MB, 0x40000);
-            pcap_dumper = pcap_dump_open(pcap_out_handle, "-");
-            outputInited = true;
-          }
-          pcap_dump((u_char *)pcap_dumper, &header, buffer);
-
-          if (debugEnabled) {
-            struct in_addr addr;
-            addr.s_addr = ip;
-            fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
-                    inet_ntoa(addr));
-          }
-        }
-        continue;
-      }
-    }
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // a NULL buffer asks HAL_DeliverFrame to lend the frame out
+  packet->buffer = NULL;
+  packet->buffer_size = 0;
+  return HAL_ReceiveFrames(if_index_mask, packet, 1, timeout);
+}
 
-    // -1 for infinity
-  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed_frame = NULL;
+  packet->buffer = NULL;
   return 0;
 }
 
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
+  HAL_Packet packet;
+  packet.buffer = buffer;
+  packet.length = length;
+  memcpy(packet.dst_mac, dst_mac, sizeof(macaddr_t));
+  packet.if_index = if_index;
+  int res = HAL_SendIPPacketBatch(&packet, 1);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_FlushSend();
+}
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].if_index >= N_IFACE_ON_BOARD || packets[i].if_index < 0 ||
+        packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    HAL_Packet *packet = &packets[i];
+    uint8_t *eth_buffer = HAL_AppendOutput(packet->length + IP_OFFSET);
+    HAL_BuildHeader(packet->if_index, packet->dst_mac, eth_buffer);
+    memcpy(&eth_buffer[IP_OFFSET], packet->buffer, packet->length);
+    interface_stats[packet->if_index].tx_packets++;
+    interface_stats[packet->if_index].tx_bytes += packet->length;
+  }
+  return count;
+}
+
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res == 0) {
+    HAL_Packet packet;
+    packet.buffer = buffer;
+    packet.length = length;
+    memcpy(packet.dst_mac, dst_mac, sizeof(macaddr_t));
+    packet.if_index = if_index;
+    res = HAL_SendIPPacketBatch(&packet, 1);
+    return res < 0 ? res : 0;
+  } else if (res != HAL_ERR_IP_NOT_EXIST) {
+    return res;
+  }
+  // keep it until the arp reply comes
+  return HAL_ArpPendingAdd(if_index, nexthop, buffer, length)
+             ? 1
+             : HAL_ERR_IP_NOT_EXIST;
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
   }
   if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
     return HAL_ERR_INVALID_PARAMETER;
   }
-  uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
-  // VLAN
-  eth_buffer[12] = 0x81;
-  eth_buffer[13] = 0x00;
-  eth_buffer[14] = 0x00;
-  eth_buffer[15] = if_index;
-  // IPv4
-  eth_buffer[16] = 0x08;
-  eth_buffer[17] = 0x00;
+  int adjacency = HAL_AdjacencyGet(if_index, nexthop);
+  // start resolving it right away
+  HAL_ArpResolve(if_index, nexthop);
+  return adjacency;
+}
+
+int HAL_ReleaseAdjacency(int adjacency) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return HAL_AdjacencyRelease(adjacency) ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t header[HAL_ADJACENCY_HEADER];
+  int if_index;
+  in_addr_t nexthop;
+  int resolved = HAL_AdjacencyRead(adjacency, header, &if_index, &nexthop);
+  if (resolved < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  } else if (resolved == 0) {
+    return HAL_SendIPPacketToNexthop(if_index, buffer, length, nexthop);
+  }
+  uint8_t *eth_buffer = HAL_AppendOutput(length + IP_OFFSET);
+  memcpy(eth_buffer, header, IP_OFFSET);
   memcpy(&eth_buffer[IP_OFFSET], buffer, length);
-  struct pcap_pkthdr header;
-  header.caplen = header.len = length + IP_OFFSET;
+  interface_stats[if_index].tx_packets++;
+  interface_stats[if_index].tx_bytes += length;
+  return 0;
+}
 
-  struct timespec tp = {0};
-  clock_gettime(CLOCK_MONOTONIC, &tp);
-  header.ts.tv_sec = tp.tv_sec;
-  header.ts.tv_usec = tp.tv_nsec / 1000;
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet) ||
+      packet->length > packet->buffer_size ||
+      packet->if_index >= N_IFACE_ON_BOARD || packet->if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t *frame = borrowed_frame;
+  borrowed_frame = NULL;
+  packet->buffer = NULL;
+
+  // rewrite the ethernet header in place, the ethertype is already IPv4
+  memcpy(frame, packet->dst_mac, sizeof(macaddr_t));
+  memcpy(&frame[6], interface_mac[packet->if_index], sizeof(macaddr_t));
+  frame[15] = packet->if_index;
+  memcpy(HAL_AppendOutput(packet->length + IP_OFFSET), frame,
+         packet->length + IP_OFFSET);
+  HAL_FlushOutput();
+  interface_stats[packet->if_index].tx_packets++;
+  interface_stats[packet->if_index].tx_bytes += packet->length;
+  return 0;
+}
 
-  if (!outputInited) {
-    // output
-    pcap_out_handle = pcap_open_dead(DLT_EN10MB, 0x40000);
-    pcap_dumper = pcap_dump_open(pcap_out_handle, "-");
-    outputInited = true;
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
   }
-  pcap_dump((u_char *)pcap_dumper, &header, eth_buffer);
-  free(eth_buffer);
+  // the input is a recorded trace, nothing to filter in the kernel
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  HAL_FlushOutput();
   return 0;
 }
-}
\ No newline at end of file
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // only a single queue
+  return n == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return queue == 0 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+}
@@ -0,0 +1,993 @@
+#include "router_hal.h"
+#include "router_hal_common.h"
+#include "router_hal_arp.h"
+#include <stdio.h>
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/if_link.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <xdp/xsk.h>
+
+// AF_XDP shares the interface configuration with the Linux backend
+#ifndef HAL_PLATFORM_TESTING
+#include "../linux/platform/standard.h"
+#else
+#include "../linux/platform/testing.h"
+#endif
+
+// frames in the UMEM of each interface, half of them are kept in the fill
+// ring for RX, the other half are used for TX
+#ifndef HAL_XDP_NUM_FRAMES
+#define HAL_XDP_NUM_FRAMES 4096
+#endif
+#define HAL_XDP_RX_FRAMES (HAL_XDP_NUM_FRAMES / 2)
+#define HAL_XDP_TX_FRAMES (HAL_XDP_NUM_FRAMES - HAL_XDP_RX_FRAMES)
+#define HAL_XDP_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+// queued TX descriptors before the kernel is woken up
+#ifndef HAL_XDP_KICK_BATCH
+#define HAL_XDP_KICK_BATCH 64
+#endif
+// give up waiting for a free TX frame after this many milliseconds, the
+// kernel never completes frames while the link is down
+#ifndef HAL_XDP_TX_TIMEOUT
+#define HAL_XDP_TX_TIMEOUT 100
+#endif
+// RX queue the socket is bound to, other queues still go to the kernel
+#ifndef HAL_XDP_QUEUE_ID
+#define HAL_XDP_QUEUE_ID 0
+#endif
+
+const int IP_OFFSET = 14;
+
+bool inited = false;
+int debugEnabled = 0;
+in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
+macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
+
+struct XskInterface {
+  struct xsk_umem *umem;
+  struct xsk_socket *xsk;
+  struct xsk_ring_prod fill;
+  struct xsk_ring_cons comp;
+  struct xsk_ring_cons rx;
+  struct xsk_ring_prod tx;
+  void *area;
+  // TX frames not owned by the kernel
+  uint64_t free_frames[HAL_XDP_TX_FRAMES];
+  uint32_t free_count;
+  // TX descriptors submitted since the last kick
+  uint32_t tx_pending;
+  bool zero_copy;
+} xsk_interfaces[N_IFACE_ON_BOARD];
+
+// port to start the next round robin from
+int next_port = 0;
+
+// RX frame lent out by HAL_ReceiveIPPacketBorrowed, it is kept out of the
+// fill ring until it is released, sent or the next receive
+uint8_t *borrowed_frame = NULL;
+uint64_t borrowed_addr;
+int borrowed_if;
+
+// HAL_GetTicks() when the last receive returned
+uint64_t loop_ticks = 0;
+
+// counters of HAL_GetInterfaceStats, kernel drops are read from the socket
+HAL_InterfaceStats interface_stats[N_IFACE_ON_BOARD];
+
+bool HAL_XskEnabled(int if_index) {
+  return xsk_interfaces[if_index].xsk != NULL;
+}
+
+// bind an AF_XDP socket to ifname, trying zero copy first and falling back
+// to copy mode for drivers like veth
+int HAL_XskOpen(XskInterface *x, const char *ifname) {
+  static const struct {
+    uint32_t xdp_flags;
+    uint16_t bind_flags;
+  } modes[] = {
+      {XDP_FLAGS_DRV_MODE, XDP_ZEROCOPY},
+      {XDP_FLAGS_DRV_MODE, XDP_COPY},
+      {XDP_FLAGS_SKB_MODE, XDP_COPY},
+  };
+  size_t area_size = (size_t)HAL_XDP_NUM_FRAMES * HAL_XDP_FRAME_SIZE;
+  if (posix_memalign(&x->area, getpagesize(), area_size) != 0) {
+    x->area = NULL;
+    return -1;
+  }
+
+  struct xsk_umem_config umem_config;
+  memset(&umem_config, 0, sizeof(umem_config));
+  umem_config.fill_size = HAL_XDP_RX_FRAMES;
+  umem_config.comp_size = HAL_XDP_TX_FRAMES;
+  umem_config.frame_size = HAL_XDP_FRAME_SIZE;
+  umem_config.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM;
+
+  struct xsk_socket_config xsk_config;
+  memset(&xsk_config, 0, sizeof(xsk_config));
+  xsk_config.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+  xsk_config.tx_size = HAL_XDP_TX_FRAMES;
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    // a failed bind may leave the rings half set up, so start over each time
+    if (xsk_umem__create(&x->umem, x->area, area_size, &x->fill, &x->comp,
+                         &umem_config) < 0) {
+      break;
+    }
+    xsk_config.xdp_flags = modes[i].xdp_flags;
+    xsk_config.bind_flags = modes[i].bind_flags | XDP_USE_NEED_WAKEUP;
+    if (xsk_socket__create(&x->xsk, ifname, HAL_XDP_QUEUE_ID, x->umem, &x->rx,
+                           &x->tx, &xsk_config) == 0) {
+      x->zero_copy = modes[i].bind_flags == XDP_ZEROCOPY;
+      break;
+    }
+    x->xsk = NULL;
+    xsk_umem__delete(x->umem);
+    x->umem = NULL;
+  }
+  if (x->xsk == NULL) {
+    free(x->area);
+    x->area = NULL;
+    return -1;
+  }
+
+  // hand the RX half to the kernel
+  uint32_t idx;
+  xsk_ring_prod__reserve(&x->fill, HAL_XDP_RX_FRAMES, &idx);
+  for (uint32_t i = 0; i < HAL_XDP_RX_FRAMES; i++) {
+    *xsk_ring_prod__fill_addr(&x->fill, idx + i) =
+        (uint64_t)i * HAL_XDP_FRAME_SIZE;
+  }
+  xsk_ring_prod__submit(&x->fill, HAL_XDP_RX_FRAMES);
+
+  // keep the TX half ourselves
+  x->free_count = 0;
+  for (uint32_t i = HAL_XDP_RX_FRAMES; i < HAL_XDP_NUM_FRAMES; i++) {
+    x->free_frames[x->free_count++] = (uint64_t)i * HAL_XDP_FRAME_SIZE;
+  }
+  x->tx_pending = 0;
+  return 0;
+}
+
+void HAL_XskWakeup(XskInterface *x) {
+  if (xsk_ring_prod__needs_wakeup(&x->tx)) {
+    sendto(xsk_socket__fd(x->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+  }
+}
+
+// wake the kernel up to send what has been submitted to the TX ring
+void HAL_XskKick(XskInterface *x) {
+  if (x->tx_pending == 0) {
+    return;
+  }
+  HAL_XskWakeup(x);
+  x->tx_pending = 0;
+}
+
+// take back TX frames the kernel is done with
+void HAL_XskReapCompletions(XskInterface *x) {
+  uint32_t idx;
+  uint32_t done = xsk_ring_cons__peek(&x->comp, HAL_XDP_TX_FRAMES, &idx);
+  for (uint32_t i = 0; i < done; i++) {
+    x->free_frames[x->free_count++] =
+        *xsk_ring_cons__comp_addr(&x->comp, idx + i);
+  }
+  xsk_ring_cons__release(&x->comp, done);
+}
+
+// get a free TX frame, waiting for the kernel if all of them are in flight;
+// NULL if none comes back in time, e.g. because the link is down
+uint8_t *HAL_XskTxFrame(XskInterface *x, uint64_t *addr) {
+  if (x->free_count == 0) {
+    HAL_XskReapCompletions(x);
+  }
+  uint64_t begin = HAL_GetTicks();
+  while (x->free_count == 0) {
+    if (HAL_GetTicks() >= begin + HAL_XDP_TX_TIMEOUT) {
+      return NULL;
+    }
+    // completions only show up after the kernel has been kicked
+    HAL_XskWakeup(x);
+    x->tx_pending = 0;
+    HAL_XskReapCompletions(x);
+  }
+  *addr = x->free_frames[--x->free_count];
+  return (uint8_t *)xsk_umem__get_data(x->area, *addr);
+}
+
+// put a filled TX frame on the TX ring
+void HAL_XskTxSubmit(XskInterface *x, uint64_t addr, uint32_t len) {
+  uint32_t idx;
+  // never fails: the TX ring is as large as the TX half of the UMEM
+  xsk_ring_prod__reserve(&x->tx, 1, &idx);
+  struct xdp_desc *desc = xsk_ring_prod__tx_desc(&x->tx, idx);
+  desc->addr = addr;
+  desc->len = len;
+  xsk_ring_prod__submit(&x->tx, 1);
+  if (++x->tx_pending >= HAL_XDP_KICK_BATCH) {
+    HAL_XskKick(x);
+  }
+}
+
+// send a complete ethernet frame right away, false if no TX frame is free
+bool HAL_XskSendFrame(int if_index, const uint8_t *frame, size_t length) {
+  XskInterface *x = &xsk_interfaces[if_index];
+  uint64_t addr;
+  uint8_t *data = HAL_XskTxFrame(x, &addr);
+  if (data == NULL) {
+    interface_stats[if_index].tx_errors++;
+    return false;
+  }
+  memcpy(data, frame, length);
+  HAL_XskTxSubmit(x, addr, length);
+  HAL_XskKick(x);
+  return true;
+}
+
+// fill in the ethernet header for an IP packet to dst_mac
+void HAL_BuildHeader(int if_index, const macaddr_t dst_mac, uint8_t *header) {
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+}
+
+// put a frame made of a prebuilt link layer header and an IP packet on the TX
+// ring; HAL_ERR_INVALID_PARAMETER if it does not fit in a frame,
+// HAL_ERR_UNKNOWN if no TX frame is free
+int HAL_QueueFrame(int if_index, const uint8_t *header, const uint8_t *buffer,
+                   size_t length) {
+  if (length + IP_OFFSET > HAL_XDP_FRAME_SIZE) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  XskInterface *x = &xsk_interfaces[if_index];
+  uint64_t addr;
+  uint8_t *frame = HAL_XskTxFrame(x, &addr);
+  if (frame == NULL) {
+    interface_stats[if_index].tx_errors++;
+    return HAL_ERR_UNKNOWN;
+  }
+  memcpy(frame, header, IP_OFFSET);
+  memcpy(&frame[IP_OFFSET], buffer, length);
+  HAL_XskTxSubmit(x, addr, length + IP_OFFSET);
+  interface_stats[if_index].tx_packets++;
+  interface_stats[if_index].tx_bytes += length;
+  return 0;
+}
+
+// queue an IP packet for if_index, with the same results as HAL_QueueFrame
+int HAL_QueueIPPacket(int if_index, const uint8_t *buffer, size_t length,
+                      const macaddr_t dst_mac) {
+  uint8_t header[IP_OFFSET];
+  HAL_BuildHeader(if_index, dst_mac, header);
+  return HAL_QueueFrame(if_index, header, buffer, length);
+}
+
+void HAL_ArpSendPending(int if_index, uint8_t *buffer, size_t length,
+                        const macaddr_t dst_mac) {
+  macaddr_t mac;
+  memcpy(mac, dst_mac, sizeof(macaddr_t));
+  HAL_SendIPPacket(if_index, buffer, length, mac);
+}
+
+void HAL_HandleArp(int if_index, const uint8_t *packet, uint32_t caplen) {
+  if (caplen < 42) {
+    // truncated
+    return;
+  }
+  if (packet[21] == 0x01) {
+    interface_stats[if_index].arp_requests_rx++;
+  } else if (packet[21] == 0x02) {
+    interface_stats[if_index].arp_replies_rx++;
+  }
+  // learn it
+  macaddr_t mac;
+  memcpy(mac, &packet[22], sizeof(macaddr_t));
+  in_addr_t ip;
+  memcpy(&ip, &packet[28], sizeof(in_addr_t));
+  if (HAL_ArpTableLearn(if_index, ip, mac) && debugEnabled) {
+    fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
+            inet_ntoa(in_addr{ip}));
+  }
+
+  in_addr_t dst_ip;
+  memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
+  // ask me: reply
+  if (dst_ip == interface_addrs[if_index] && packet[21] == 0x01) {
+    // reply
+    uint8_t buffer[64] = {0};
+    // dst mac
+    memcpy(buffer, &packet[6], sizeof(macaddr_t));
+    // src mac
+    macaddr_t mac;
+    HAL_GetInterfaceMacAddress(if_index, mac);
+    memcpy(&buffer[6], mac, sizeof(macaddr_t));
+    // ARP
+    buffer[12] = 0x08;
+    buffer[13] = 0x06;
+    // hardware type
+    buffer[15] = 0x01;
+    // protocol type
+    buffer[16] = 0x08;
+    // hardware size
+    buffer[18] = 0x06;
+    // protocol size
+    buffer[19] = 0x04;
+    // opcode
+    buffer[21] = 0x02;
+    // sender
+    memcpy(&buffer[22], mac, sizeof(macaddr_t));
+    memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
+    // target
+    memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
+    memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
+
+    if (HAL_XskSendFrame(if_index, buffer, sizeof(buffer))) {
+      interface_stats[if_index].arp_replies_tx++;
+    }
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
+              inet_ntoa(in_addr{ip}));
+    }
+  }
+}
+
+// handle a received frame, return true if it is an IPv4 packet for the caller
+bool HAL_DeliverFrame(int if_index, const uint8_t *frame, uint32_t caplen,
+                      uint64_t timestamp, HAL_Packet *packet) {
+  if (caplen < IP_OFFSET) {
+    return false;
+  } else if (frame[12] == 0x08 && frame[13] == 0x00) {
+    // IPv4
+    size_t ip_len = caplen - IP_OFFSET;
+    if (packet->buffer == NULL) {
+      // lend the frame out in place
+      borrowed_frame = (uint8_t *)frame;
+      packet->buffer = &borrowed_frame[IP_OFFSET];
+      packet->buffer_size = ip_len;
+    } else {
+      size_t real_length =
+          packet->buffer_size > ip_len ? ip_len : packet->buffer_size;
+      memcpy(packet->buffer, &frame[IP_OFFSET], real_length);
+      if (real_length < ip_len) {
+        interface_stats[if_index].rx_truncated++;
+      }
+    }
+    interface_stats[if_index].rx_packets++;
+    interface_stats[if_index].rx_bytes += ip_len;
+    memcpy(packet->dst_mac, &frame[0], sizeof(macaddr_t));
+    memcpy(packet->src_mac, &frame[6], sizeof(macaddr_t));
+    packet->length = ip_len;
+    packet->if_index = if_index;
+    packet->timestamp = timestamp;
+    return true;
+  } else if (frame[12] == 0x08 && frame[13] == 0x06) {
+    // ARP
+    HAL_HandleArp(if_index, frame, caplen);
+  }
+  return false;
+}
+
+// give RX frames back to the kernel
+void HAL_XskRefill(XskInterface *x, const uint64_t *addrs, uint32_t n) {
+  uint32_t idx;
+  // never fails: the fill ring has room for every RX frame
+  xsk_ring_prod__reserve(&x->fill, n, &idx);
+  for (uint32_t i = 0; i < n; i++) {
+    *xsk_ring_prod__fill_addr(&x->fill, idx + i) = addrs[i];
+  }
+  xsk_ring_prod__submit(&x->fill, n);
+}
+
+// copy out up to count packets from the RX ring of if_index, the frames go
+// straight back to the fill ring unless one is lent out
+size_t HAL_XskReceive(int if_index, HAL_Packet *packets, size_t count) {
+  XskInterface *x = &xsk_interfaces[if_index];
+  size_t received = 0;
+  uint64_t addrs[64];
+  while (received < count) {
+    uint32_t rx_idx;
+    size_t want = count - received < 64 ? count - received : 64;
+    uint32_t n = xsk_ring_cons__peek(&x->rx, want, &rx_idx);
+    if (n == 0) {
+      if (xsk_ring_prod__needs_wakeup(&x->fill)) {
+        recvfrom(xsk_socket__fd(x->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+      }
+      break;
+    }
+    // descriptors carry no receive time, stamp the batch when it is taken
+    uint64_t timestamp = HAL_GetTicksNs();
+    uint32_t recycled = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&x->rx, rx_idx + i);
+      const uint8_t *frame =
+          (const uint8_t *)xsk_umem__get_data(x->area, desc->addr);
+      bool borrowing = packets[received].buffer == NULL;
+      if (HAL_DeliverFrame(if_index, frame, desc->len, timestamp,
+                           &packets[received])) {
+        received++;
+        if (borrowing) {
+          borrowed_addr = desc->addr;
+          borrowed_if = if_index;
+          continue;
+        }
+      }
+      addrs[recycled++] = desc->addr;
+    }
+    xsk_ring_cons__release(&x->rx, n);
+    HAL_XskRefill(x, addrs, recycled);
+  }
+  return received;
+}
+
+bool HAL_IsBorrowed(const HAL_Packet *packet) {
+  return borrowed_frame != NULL &&
+         packet->buffer == &borrowed_frame[IP_OFFSET];
+}
+
+// hand the borrowed frame back to the fill ring
+void HAL_ReturnBorrowed() {
+  if (borrowed_frame != NULL) {
+    HAL_XskRefill(&xsk_interfaces[borrowed_if], &borrowed_addr, 1);
+    borrowed_frame = NULL;
+  }
+}
+
+// wait for packets on the interfaces in if_index_mask
+int HAL_WaitFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // receiving again takes back the frame lent out last time
+  HAL_ReturnBorrowed();
+
+  struct pollfd fds[N_IFACE_ON_BOARD];
+  int nfds = 0;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (HAL_XskEnabled(i) && (if_index_mask & (1 << i))) {
+      fds[nfds].fd = xsk_socket__fd(xsk_interfaces[i].xsk);
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+  }
+  if (nfds == 0) {
+    if (debugEnabled) {
+      fprintf(stderr,
+              "HAL_ReceiveIPPacket: no viable interfaces open for capture\n");
+    }
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+
+  // frames queued since the last call go out before we start waiting
+  HAL_FlushSend();
+
+  int64_t begin = HAL_GetTicks();
+  int64_t current_time = begin;
+  do {
+    // Round robin, continuing from where the last call stopped
+    size_t received = 0;
+    for (int round = 0; round < N_IFACE_ON_BOARD && received < count;
+         round++) {
+      int current_port = next_port;
+      next_port = (next_port + 1) % N_IFACE_ON_BOARD;
+      if ((if_index_mask & (1 << current_port)) == 0 ||
+          !HAL_XskEnabled(current_port)) {
+        continue;
+      }
+      received += HAL_XskReceive(current_port, &packets[received],
+                                 count - received);
+    }
+    if (received > 0) {
+      return received;
+    }
+    if (timeout == 0) {
+      break;
+    }
+
+    // sleep until some RX ring has frames or time is up
+    int wait = -1;
+    if (timeout != -1) {
+      wait = begin + timeout - current_time;
+      if (wait <= 0) {
+        break;
+      }
+    }
+    if (poll(fds, nfds, wait) < 0 && errno != EINTR) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacket: poll failed with %s\n",
+                strerror(errno));
+      }
+      return HAL_ERR_UNKNOWN;
+    }
+    // -1 for infinity
+  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+  return 0;
+}
+
+// shared by the copying and the borrowing receive, remembers when the wait
+// ended for HAL_GetLoopTicks
+int HAL_ReceiveFrames(int if_index_mask, HAL_Packet *packets, size_t count,
+                      int64_t timeout) {
+  int res = HAL_WaitFrames(if_index_mask, packets, count, timeout);
+  loop_ticks = HAL_GetTicks();
+  return res;
+}
+
+void HAL_SendArpRequest(int if_index, in_addr_t ip,
+                        const macaddr_t dst_mac) {
+  if (!HAL_XskEnabled(if_index)) {
+    return;
+  }
+  if (debugEnabled) {
+    fprintf(
+        stderr,
+        "HAL_SendArpRequest: asking for ip address %s with arp request\n",
+        inet_ntoa(in_addr{ip}));
+  }
+  uint8_t buffer[64] = {0};
+  // dst mac, broadcast unless the neighbor is asked directly
+  if (dst_mac) {
+    memcpy(buffer, dst_mac, sizeof(macaddr_t));
+  } else {
+    memset(buffer, 0xff, sizeof(macaddr_t));
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // ARP
+  buffer[12] = 0x08;
+  buffer[13] = 0x06;
+  // hardware type
+  buffer[15] = 0x01;
+  // protocol type
+  buffer[16] = 0x08;
+  // hardware size
+  buffer[18] = 0x06;
+  // protocol size
+  buffer[19] = 0x04;
+  // opcode
+  buffer[21] = 0x01;
+  // sender
+  memcpy(&buffer[22], mac, sizeof(macaddr_t));
+  memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+
+  if (HAL_XskSendFrame(if_index, buffer, sizeof(buffer))) {
+    interface_stats[if_index].arp_requests_tx++;
+  }
+}
+
+// look ip up and send the arp request the table asks for
+int HAL_ArpQuery(int if_index, in_addr_t ip, macaddr_t o_mac, bool count) {
+  int result = HAL_ArpTableLookup(if_index, ip, o_mac, count);
+  if (result == HAL_ARP_HIT_REFRESH) {
+    // about to expire, ask the neighbor directly if it is still there
+    HAL_SendArpRequest(if_index, ip, o_mac);
+  } else if (result == HAL_ARP_SEND_REQUEST) {
+    // not found, the table rate limits arp request by 1 req/s per address
+    HAL_SendArpRequest(if_index, ip, NULL);
+  }
+  return result == HAL_ARP_HIT || result == HAL_ARP_HIT_REFRESH
+             ? 0
+             : HAL_ERR_IP_NOT_EXIST;
+}
+
+extern "C" {
+int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
+  if (inited) {
+    return 0;
+  }
+  debugEnabled = debug;
+  loop_ticks = HAL_GetTicks();
+  HAL_ArpTableInit();
+
+  // find matching interfaces and get their MAC address
+  struct ifaddrs *ifaddr, *ifa;
+  if (getifaddrs(&ifaddr) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: getifaddrs failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL)
+      continue;
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      if (ifa->ifa_addr->sa_family == AF_PACKET &&
+          strcmp(ifa->ifa_name, interfaces[i]) == 0) {
+        // found
+        memcpy(interface_mac[i],
+               ((struct sockaddr_ll *)ifa->ifa_addr)->sll_addr,
+               sizeof(macaddr_t));
+        HAL_ArpTableAddStatic(i, if_addrs[i], interface_mac[i]);
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_Init: found MAC addr of interface %s\n",
+                  interfaces[i]);
+        }
+        break;
+      }
+    }
+  }
+  freeifaddrs(ifaddr);
+
+  // bind AF_XDP sockets
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (HAL_XskOpen(&xsk_interfaces[i], interfaces[i]) == 0) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: AF_XDP enabled for %s in %s mode\n",
+                interfaces[i],
+                xsk_interfaces[i].zero_copy ? "zero copy" : "copy");
+      }
+    } else {
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: AF_XDP disabled for %s, either the interface does "
+                "not exist or permission is denied\n",
+                interfaces[i]);
+      }
+    }
+  }
+
+  memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
+
+  inited = true;
+  // send igmp to join RIP multicast group
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (HAL_XskEnabled(i)) {
+      HAL_JoinIGMPGroup(i, if_addrs[i]);
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: Joining RIP multicast group 224.0.0.9 for %s\n",
+                interfaces[i]);
+      }
+    }
+  }
+  return 0;
+}
+
+uint64_t HAL_GetTicks() {
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  // millisecond
+  return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
+}
+
+uint64_t HAL_GetTicksNs() {
+  // served by the vDSO, no system call is made
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
+int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // handle multicast
+  if ((ip & 0xe0) == 0xe0) {
+    uint8_t multicasting_mac[6] = {0x01, 0, 0x5e, (uint8_t)((ip >> 8) & 0x7f), (uint8_t)(ip >> 16), (uint8_t)(ip >> 24)};
+    memcpy(o_mac, multicasting_mac, sizeof(macaddr_t));
+    return 0;
+  }
+
+  return HAL_ArpQuery(if_index, ip, o_mac, true);
+}
+
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // multicast needs no resolution
+  if ((ip & 0xe0) == 0xe0) {
+    return 0;
+  }
+
+  macaddr_t mac;
+  return HAL_ArpQuery(if_index, ip, mac, false);
+}
+
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = arp_stats;
+  return 0;
+}
+
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = interface_stats[if_index];
+  if (HAL_XskEnabled(if_index)) {
+    // the kernel keeps the totals, frames that found the RX ring full never
+    // reached us
+    struct xdp_statistics xstats;
+    socklen_t len = sizeof(xstats);
+    memset(&xstats, 0, sizeof(xstats));
+    if (getsockopt(xsk_socket__fd(xsk_interfaces[if_index].xsk), SOL_XDP,
+                   XDP_STATISTICS, &xstats, &len) == 0) {
+      o_stats->rx_kernel_drops = xstats.rx_dropped + xstats.rx_ring_full;
+    }
+  }
+  return 0;
+}
+
+int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+
+  memcpy(o_mac, interface_mac[if_index], sizeof(macaddr_t));
+  return 0;
+}
+
+size_t HAL_GetMaxPacketSize() {
+  // a frame never spans more than one UMEM chunk
+  return HAL_XDP_FRAME_SIZE - XSK_UMEM__DEFAULT_FRAME_HEADROOM - IP_OFFSET;
+}
+
+int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
+                        macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
+                        int *if_index) {
+  if (if_index == NULL || buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_Packet packet;
+  packet.buffer = buffer;
+  packet.buffer_size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL || count == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].buffer == NULL) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+  }
+
+  return HAL_ReceiveFrames(if_index_mask, packets, count, timeout);
+}
+
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // a NULL buffer asks HAL_DeliverFrame to lend the frame out
+  packet->buffer = NULL;
+  packet->buffer_size = 0;
+  return HAL_ReceiveFrames(if_index_mask, packet, 1, timeout);
+}
+
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_ReturnBorrowed();
+  packet->buffer = NULL;
+  return 0;
+}
+
+int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
+                     macaddr_t dst_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!HAL_XskEnabled(if_index)) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  // AF_XDP can not send a frame larger than one UMEM frame
+  int res = HAL_QueueIPPacket(if_index, buffer, length, dst_mac);
+  if (res < 0) {
+    return res;
+  }
+  HAL_XskKick(&xsk_interfaces[if_index]);
+  return 0;
+}
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].if_index >= N_IFACE_ON_BOARD || packets[i].if_index < 0 ||
+        packets[i].buffer == NULL ||
+        packets[i].length + IP_OFFSET > HAL_XDP_FRAME_SIZE) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+    if (!HAL_XskEnabled(packets[i].if_index)) {
+      return HAL_ERR_IFACE_NOT_EXIST;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    int res = HAL_QueueIPPacket(packets[i].if_index, packets[i].buffer,
+                                packets[i].length, packets[i].dst_mac);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return count;
+}
+
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res == 0) {
+    HAL_Packet packet;
+    packet.buffer = buffer;
+    packet.length = length;
+    memcpy(packet.dst_mac, dst_mac, sizeof(macaddr_t));
+    packet.if_index = if_index;
+    res = HAL_SendIPPacketBatch(&packet, 1);
+    return res < 0 ? res : 0;
+  } else if (res != HAL_ERR_IP_NOT_EXIST) {
+    return res;
+  }
+  // keep it until the arp reply comes
+  return HAL_ArpPendingAdd(if_index, nexthop, buffer, length)
+             ? 1
+             : HAL_ERR_IP_NOT_EXIST;
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int adjacency = HAL_AdjacencyGet(if_index, nexthop);
+  // start resolving it right away
+  HAL_ArpResolve(if_index, nexthop);
+  return adjacency;
+}
+
+int HAL_ReleaseAdjacency(int adjacency) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return HAL_AdjacencyRelease(adjacency) ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (buffer == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint8_t header[HAL_ADJACENCY_HEADER];
+  int if_index;
+  in_addr_t nexthop;
+  int resolved = HAL_AdjacencyRead(adjacency, header, &if_index, &nexthop);
+  if (resolved < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  } else if (resolved == 0) {
+    return HAL_SendIPPacketToNexthop(if_index, buffer, length, nexthop);
+  }
+  if (!HAL_XskEnabled(if_index)) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  // AF_XDP can not send a frame larger than one UMEM frame
+  return HAL_QueueFrame(if_index, header, buffer, length);
+}
+
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || !HAL_IsBorrowed(packet) ||
+      packet->length > packet->buffer_size ||
+      packet->if_index >= N_IFACE_ON_BOARD || packet->if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!HAL_XskEnabled(packet->if_index)) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  // each interface has its own UMEM, so the frame is copied to a TX frame
+  // once and the RX frame goes back to the fill ring
+  int res = HAL_QueueIPPacket(packet->if_index, packet->buffer,
+                              packet->length, packet->dst_mac);
+  HAL_XskKick(&xsk_interfaces[packet->if_index]);
+  HAL_ReturnBorrowed();
+  packet->buffer = NULL;
+  return res;
+}
+
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  // every frame on the bound queue is redirected to us by the XDP program
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (HAL_XskEnabled(i)) {
+      HAL_XskKick(&xsk_interfaces[i]);
+      HAL_XskReapCompletions(&xsk_interfaces[i]);
+    }
+  }
+  return 0;
+}
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // only a single queue
+  return n == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return queue == 0 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+}
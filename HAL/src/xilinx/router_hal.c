@@ -11,6 +11,16 @@ const int ARP_LENGTH = 28;
 
 int inited = 0;
 int debugEnabled = 0;
+
+// buffer behind HAL_ReceiveIPPacketBorrowed
+uint8_t borrow_buffer[2048];
+int borrowed = 0;
+// arrival time of the packet HAL_ReceiveIPPacket returned last
+uint64_t last_timestamp = 0;
+// HAL_GetTicks() when the last receive returned
+uint64_t loop_ticks = 0;
+// counters of HAL_GetInterfaceStats, there is no kernel to drop anything
+HAL_InterfaceStats interface_stats[N_IFACE_ON_BOARD];
 in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
 macaddr_t interface_mac = {2, 3, 3, 3, 3, 3};
 
@@ -180,6 +190,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
   memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
   memset(arpTable, 0, sizeof(arpTable));
 
+  loop_ticks = HAL_GetTicks();
   inited = 1;
   return 0;
 }
@@ -189,6 +200,13 @@ uint64_t HAL_GetTicks() {
   return XTmrCtr_GetValue(&tmrCtr, 0) * 1000 / XPAR_AXI_TIMER_0_CLOCK_FREQ_HZ;
 }
 
+uint64_t HAL_GetTicksNs() {
+  return (uint64_t)XTmrCtr_GetValue(&tmrCtr, 0) * 1000000000 /
+         XPAR_AXI_TIMER_0_CLOCK_FREQ_HZ;
+}
+
+uint64_t HAL_GetLoopTicks() { return loop_ticks; }
+
 int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -264,9 +282,30 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   memcpy(&buffer[42], &ip, sizeof(in_addr_t));
 
   XAxiDma_BdRingToHw(txRing, 1, bd);
+  interface_stats[if_index].arp_requests_tx++;
   return HAL_ERR_IP_NOT_EXIST;
 }
 
+int HAL_ArpResolve(int if_index, in_addr_t ip) {
+  macaddr_t mac;
+  return HAL_ArpGetMacAddress(if_index, ip, mac);
+}
+
+int HAL_GetArpStats(HAL_ArpStats *o_stats) {
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_GetInterfaceStats(int if_index, HAL_InterfaceStats *o_stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || o_stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  *o_stats = interface_stats[if_index];
+  return 0;
+}
+
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -279,6 +318,11 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   return 0;
 }
 
+size_t HAL_GetMaxPacketSize() {
+  // DMA buffers only hold a standard sized payload
+  return sizeof(rxBuffers[0].data);
+}
+
 int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index) {
@@ -309,8 +353,15 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         size_t ip_len = length - IP_OFFSET;
         size_t real_length = length > ip_len ? ip_len : length;
         memcpy(buffer, &data[IP_OFFSET], real_length);
+        if (*if_index >= 0 && *if_index < N_IFACE_ON_BOARD) {
+          interface_stats[*if_index].rx_packets++;
+          interface_stats[*if_index].rx_bytes += ip_len;
+        }
 
         PutBackBd(bd);
+        // no hardware timestamp, use the time the descriptor was taken
+        last_timestamp = HAL_GetTicksNs();
+        loop_ticks = current_time;
         return real_length;
       } else if (data && length >= IP_OFFSET + ARP_LENGTH && data[16] == 0x08 &&
                  data[17] == 0x06) {
@@ -320,6 +371,11 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         in_addr_t ip;
         memcpy(&ip, &data[32], sizeof(in_addr_t));
         u32 vlan = data[15] - 1;
+        if (vlan < N_IFACE_ON_BOARD && data[25] == 0x01) {
+          interface_stats[vlan].arp_requests_rx++;
+        } else if (vlan < N_IFACE_ON_BOARD && data[25] == 0x02) {
+          interface_stats[vlan].arp_replies_rx++;
+        }
 
         // update ARP Table
         int insert = 1;
@@ -395,6 +451,7 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
           memcpy(&buffer[42], &data[32], sizeof(in_addr_t));
 
           XAxiDma_BdRingToHw(txRing, 1, bd);
+          interface_stats[vlan].arp_replies_tx++;
 
           if (debugEnabled) {
             xil_printf("HAL_ReceiveIPPacket: replied ARP to %d.%d.%d.%d\r\n",
@@ -410,9 +467,102 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
       PutBackBd(bd);
     }
   }
+  loop_ticks = current_time;
+  return 0;
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_Packet *packets,
+                             size_t count, int64_t timeout) {
+  if (packets == NULL || count == 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no native batching on this platform: wait for the first packet, then take
+  // whatever is immediately available
+  size_t received = 0;
+  while (received < count) {
+    HAL_Packet *packet = &packets[received];
+    int res = HAL_ReceiveIPPacket(
+        if_index_mask, packet->buffer, packet->buffer_size, packet->src_mac,
+        packet->dst_mac, received == 0 ? timeout : 0, &packet->if_index);
+    if (res < 0) {
+      return received > 0 ? (int)received : res;
+    } else if (res == 0) {
+      break;
+    }
+    packet->length = res;
+    packet->timestamp = last_timestamp;
+    received++;
+  }
+  return received;
+}
+
+int HAL_ReceiveIPPacketBorrowed(int if_index_mask, HAL_Packet *packet,
+                                int64_t timeout) {
+  if (packet == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no way to lend out the capture buffer on this platform, receive into our
+  // own buffer instead
+  borrowed = 0;
+  packet->buffer = borrow_buffer;
+  packet->buffer_size = sizeof(borrow_buffer);
+  int res = HAL_ReceiveIPPacket(if_index_mask, packet->buffer,
+                                packet->buffer_size, packet->src_mac,
+                                packet->dst_mac, timeout, &packet->if_index);
+  if (res <= 0) {
+    packet->buffer = NULL;
+    return res;
+  }
+  packet->length = res;
+  packet->timestamp = last_timestamp;
+  borrowed = 1;
+  return 1;
+}
+
+int HAL_ReleaseIPPacket(HAL_Packet *packet) {
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = 0;
+  packet->buffer = NULL;
+  return 0;
+}
+
+int HAL_SendIPPacketToNexthop(int if_index, uint8_t *buffer, size_t length,
+                              in_addr_t nexthop) {
+  // no queue for unresolved nexthops, the packet is dropped
+  macaddr_t dst_mac;
+  int res = HAL_ArpGetMacAddress(if_index, nexthop, dst_mac);
+  if (res != 0) {
+    return res;
+  }
+  return HAL_SendIPPacket(if_index, buffer, length, dst_mac);
+}
+
+int HAL_GetAdjacency(int if_index, in_addr_t nexthop) {
+  // no adjacency table, callers use HAL_SendIPPacketToNexthop
   return 0;
 }
 
+int HAL_ReleaseAdjacency(int adjacency) {
+  return HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendIPPacketToAdjacency(int adjacency, uint8_t *buffer, size_t length) {
+  return HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_SendBorrowedIPPacket(HAL_Packet *packet) {
+  if (packet == NULL || !borrowed || packet->buffer != borrow_buffer ||
+      packet->length > packet->buffer_size) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  borrowed = 0;
+  packet->buffer = NULL;
+  return HAL_SendIPPacket(packet->if_index, borrow_buffer, packet->length,
+                          packet->dst_mac);
+}
+
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
   if (!inited) {
@@ -446,5 +596,52 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
   XAxiDma_BdSetCtrl(bd,
                     XAXIDMA_BD_CTRL_TXSOF_MASK | XAXIDMA_BD_CTRL_TXEOF_MASK);
   XAxiDma_BdRingToHw(txRing, 1, bd);
+  interface_stats[if_index].tx_packets++;
+  interface_stats[if_index].tx_bytes += length;
   return 0;
 }
+
+int HAL_SendIPPacketBatch(HAL_Packet *packets, size_t count) {
+  if (packets == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // no send queue on this platform, every packet goes out right away
+  for (size_t i = 0; i < count; i++) {
+    int res = HAL_SendIPPacket(packets[i].if_index, packets[i].buffer,
+                               packets[i].length, packets[i].dst_mac);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return count;
+}
+
+int HAL_SetCaptureFilter(int if_index_mask, const char *filter) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  // no kernel to filter in on this platform
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_FlushSend() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return 0;
+}
+
+int HAL_InitQueues(int n) {
+  if (inited || n < 1) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // only a single queue
+  return n == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_BindQueue(int queue) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return queue == 0 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+// 转发表（FIB）：路由表 table 之外单独维护的最长前缀匹配结构，
+// 由 lookup.cpp 在 update 和 eraseRoute 时同步修改，query 只查它。
+// 具体实现由 Makefile 中的 FIB 变量选择，例如 make FIB=trie
+
+// 一个前缀对应的转发结果，即路由表项中转发需要的部分
+typedef struct {
+  uint32_t nexthop;   // 大端序
+  uint32_t if_index;  // 小端序
+  uint32_t adjacency; // 邻接表项编号
+} FibResult;
+
+// 整体重建时使用的一个前缀
+typedef struct {
+  uint32_t addr; // 大端序
+  uint32_t len;  // 小端序
+  FibResult result;
+} FibEntry;
+
+// 插入前缀 addr/len 的转发结果，已经存在时替换；addr 为大端序且仅最低 len 位可能非零
+// 实现的容量用完时（如 Poptrie 的转发结果编号）输出错误并保留原来的状态
+void fibInsert(uint32_t addr, uint32_t len, const FibResult &result);
+// 删除前缀 addr/len，不存在时什么也不做
+void fibErase(uint32_t addr, uint32_t len);
+// 按照最长前缀匹配查找 addr（大端序），查到则写入 result 并返回 true
+bool fibLookup(uint32_t addr, FibResult *result);
+// 同时进行的查询数，批量查询时交替推进它们，让访存延迟互相重叠
+#define FIB_BATCH 16
+// 批量查找 addrs 中的 n 个地址，第 i 个的结果写入 results[i] 和 found[i]，
+// 与逐个调用 fibLookup 相同
+void fibLookupBatch(const uint32_t *addrs, size_t n, FibResult *results,
+                    bool *found);
+// 丢弃全部前缀，改为 entries 中的 n 个（不能重复），一次导入大量路由时比逐条插入快
+void fibBuild(const FibEntry *entries, size_t n);
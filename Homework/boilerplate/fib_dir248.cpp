@@ -0,0 +1,396 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// DIR-24-8：第一级是以地址高 24 位为下标的 2^24 项数组，长于 /24 的前缀
+// 所在的 /24 再指向一个 256 项的第二级分组。大多数查询只访问一次内存，
+// 最多两次。每一项记录写入它的前缀长度，插入时只覆盖不比自己长的前缀，
+// 删除时把自己写入的项换回次长的覆盖前缀
+
+extern uint32_t convertBigSmallEndian32(uint32_t num);
+
+// 表项：最高位表示有效，次高位表示指向第二级分组，接着 6 位是前缀长度，
+// 低 24 位是结果编号或者分组编号；全 0 表示没有路由
+#define DIR_VALID 0x80000000u
+#define DIR_GROUP 0x40000000u
+#define DIR_VALUE_MASK 0x00ffffffu
+
+// 第一级在第一次使用时分配，没有写过的页不占物理内存
+uint32_t *dirTable = NULL;
+// 第二级分组，第 g 组是 dirGroups[g * 256 .. g * 256 + 255]
+std::vector<uint32_t> dirGroups;
+std::vector<uint32_t> dirFreeGroups;
+
+// 每个前缀的转发结果，表项中保存的是它在这里的编号
+std::vector<FibResult> dirResults;
+std::vector<uint32_t> dirFreeResults;
+// 每种长度的前缀（小端序）到结果编号的映射，删除时用来寻找次长的覆盖前缀
+std::unordered_map<uint32_t, uint32_t> dirPrefixes[33];
+
+static inline uint32_t prefixMask(uint32_t len) {
+  return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+static inline uint32_t makeEntry(uint32_t len, uint32_t result) {
+  return DIR_VALID | len << 24 | result;
+}
+
+static inline uint32_t entryLen(uint32_t entry) {
+  return (entry >> 24) & 0x3f;
+}
+
+static void allocTable() {
+  if (dirTable == NULL) {
+    dirTable = (uint32_t *)calloc(1 << 24, sizeof(uint32_t));
+  }
+}
+
+// 新建一个分组，256 项都是 entry
+static uint32_t allocGroup(uint32_t entry) {
+  uint32_t group;
+  if (!dirFreeGroups.empty()) {
+    group = dirFreeGroups.back();
+    dirFreeGroups.pop_back();
+  } else {
+    group = dirGroups.size() / 256;
+    dirGroups.resize(dirGroups.size() + 256);
+  }
+  std::fill(&dirGroups[group * 256], &dirGroups[group * 256] + 256, entry);
+  return group;
+}
+
+// 第一级的 index 项指向的分组若 256 项都相同，就收回分组
+static void tryMerge(uint32_t index) {
+  uint32_t group = dirTable[index] & DIR_VALUE_MASK;
+  const uint32_t *entries = &dirGroups[group * 256];
+  for (int i = 1; i < 256; i++) {
+    if (entries[i] != entries[0]) {
+      return;
+    }
+  }
+  if (entryLen(entries[0]) > 24) {
+    return;
+  }
+  dirTable[index] = entries[0];
+  dirFreeGroups.push_back(group);
+}
+
+// 把 [begin, end) 中不比 len 长的项改为 entry
+static void fillRange(uint32_t *entries, uint32_t begin, uint32_t end,
+                      uint32_t len, uint32_t entry) {
+  for (uint32_t i = begin; i < end; i++) {
+    if (entryLen(entries[i]) <= len) {
+      entries[i] = entry;
+    }
+  }
+}
+
+// 把 [begin, end) 中由长度为 len 的前缀写入的项改为 entry
+static void replaceRange(uint32_t *entries, uint32_t begin, uint32_t end,
+                         uint32_t len, uint32_t entry) {
+  for (uint32_t i = begin; i < end; i++) {
+    if ((entries[i] & DIR_VALID) && entryLen(entries[i]) == len) {
+      entries[i] = entry;
+    }
+  }
+}
+
+// 第一级 [begin, end) 范围内写入长度为 len 的前缀，replace 为 true 时是删除
+static void writeLevel1(uint32_t begin, uint32_t end, uint32_t len,
+                        uint32_t entry, bool replace) {
+  for (uint32_t index = begin; index < end; index++) {
+    if (dirTable[index] & DIR_GROUP) {
+      uint32_t *group = &dirGroups[(dirTable[index] & DIR_VALUE_MASK) * 256];
+      if (replace) {
+        replaceRange(group, 0, 256, len, entry);
+        tryMerge(index);
+      } else {
+        fillRange(group, 0, 256, len, entry);
+      }
+    } else if (replace) {
+      replaceRange(dirTable, index, index + 1, len, entry);
+    } else {
+      fillRange(dirTable, index, index + 1, len, entry);
+    }
+  }
+}
+
+void fibInsert(uint32_t addr, uint32_t len, const FibResult &result) {
+  allocTable();
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  std::unordered_map<uint32_t, uint32_t>::iterator it =
+      dirPrefixes[len].find(key);
+  if (it != dirPrefixes[len].end()) {
+    // 已有的前缀只需要改结果，表项不变
+    dirResults[it->second] = result;
+    return;
+  }
+  uint32_t slot;
+  if (!dirFreeResults.empty()) {
+    slot = dirFreeResults.back();
+    dirFreeResults.pop_back();
+    dirResults[slot] = result;
+  } else {
+    slot = dirResults.size();
+    dirResults.push_back(result);
+  }
+  dirPrefixes[len][key] = slot;
+
+  uint32_t entry = makeEntry(len, slot);
+  if (len <= 24) {
+    writeLevel1(key >> 8, (key >> 8) + (1u << (24 - len)), len, entry, false);
+    return;
+  }
+  uint32_t index = key >> 8;
+  if (!(dirTable[index] & DIR_GROUP)) {
+    uint32_t group = allocGroup(dirTable[index]);
+    dirTable[index] = DIR_GROUP | group;
+  }
+  uint32_t *group = &dirGroups[(dirTable[index] & DIR_VALUE_MASK) * 256];
+  fillRange(group, key & 0xff, (key & 0xff) + (1u << (32 - len)), len, entry);
+}
+
+void fibErase(uint32_t addr, uint32_t len) {
+  if (dirTable == NULL) {
+    return;
+  }
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  std::unordered_map<uint32_t, uint32_t>::iterator it =
+      dirPrefixes[len].find(key);
+  if (it == dirPrefixes[len].end()) {
+    return;
+  }
+  uint32_t slot = it->second;
+  dirPrefixes[len].erase(it);
+  dirFreeResults.push_back(slot);
+
+  // 次长的覆盖前缀接替它的位置，没有则清空
+  uint32_t entry = 0;
+  for (int shorter = len - 1; shorter >= 0; shorter--) {
+    it = dirPrefixes[shorter].find(key & prefixMask(shorter));
+    if (it != dirPrefixes[shorter].end()) {
+      entry = makeEntry(shorter, it->second);
+      break;
+    }
+  }
+  if (len <= 24) {
+    writeLevel1(key >> 8, (key >> 8) + (1u << (24 - len)), len, entry, true);
+    return;
+  }
+  uint32_t index = key >> 8;
+  uint32_t *group = &dirGroups[(dirTable[index] & DIR_VALUE_MASK) * 256];
+  replaceRange(group, key & 0xff, (key & 0xff) + (1u << (32 - len)), len,
+               entry);
+  tryMerge(index);
+}
+
+bool fibLookup(uint32_t addr, FibResult *result) {
+  if (dirTable == NULL) {
+    return false;
+  }
+  uint32_t key = convertBigSmallEndian32(addr);
+  uint32_t entry = dirTable[key >> 8];
+  if (entry & DIR_GROUP) {
+    entry = dirGroups[(entry & DIR_VALUE_MASK) * 256 + (key & 0xff)];
+  }
+  if (!(entry & DIR_VALID)) {
+    return false;
+  }
+  *result = dirResults[entry & DIR_VALUE_MASK];
+  return true;
+}
+
+// 批量查找分几轮：先算出所有第一级下标并预取，再读第一级、预取第二级，
+// 最后读结果，各个查询的缺失互相重叠。有 AVX2 时前两轮用 gather 一次处理 8 个
+void fibLookupBatch(const uint32_t *addrs, size_t n, FibResult *results,
+                    bool *found) {
+  if (dirTable == NULL) {
+    for (size_t i = 0; i < n; i++) {
+      found[i] = false;
+    }
+    return;
+  }
+  for (size_t first = 0; first < n; first += FIB_BATCH) {
+    size_t count = n - first < FIB_BATCH ? n - first : FIB_BATCH;
+    const uint32_t *batch = addrs + first;
+    uint32_t entries[FIB_BATCH];
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i kind = _mm256_set1_epi32(DIR_VALID | DIR_GROUP);
+    const __m256i group = _mm256_set1_epi32(DIR_GROUP);
+    const __m256i valueMask = _mm256_set1_epi32(DIR_VALUE_MASK);
+    const __m256i lowMask = _mm256_set1_epi32(0xff);
+    for (; i + 8 <= count; i += 8) {
+      __m256i key = _mm256_shuffle_epi8(
+          _mm256_loadu_si256((const __m256i *)(batch + i)), swap);
+      __m256i entry = _mm256_i32gather_epi32(
+          (const int *)dirTable, _mm256_srli_epi32(key, 8), 4);
+      __m256i isGroup =
+          _mm256_cmpeq_epi32(_mm256_and_si256(entry, kind), group);
+      if (!_mm256_testz_si256(isGroup, isGroup)) {
+        __m256i index = _mm256_or_si256(
+            _mm256_slli_epi32(_mm256_and_si256(entry, valueMask), 8),
+            _mm256_and_si256(key, lowMask));
+        entry = _mm256_mask_i32gather_epi32(
+            entry, (const int *)dirGroups.data(), index, isGroup, 4);
+      }
+      _mm256_storeu_si256((__m256i *)(entries + i), entry);
+    }
+#endif
+    uint32_t keys[FIB_BATCH];
+    for (size_t j = i; j < count; j++) {
+      keys[j] = convertBigSmallEndian32(batch[j]);
+      __builtin_prefetch(&dirTable[keys[j] >> 8]);
+    }
+    for (size_t j = i; j < count; j++) {
+      entries[j] = dirTable[keys[j] >> 8];
+      if (entries[j] & DIR_GROUP) {
+        __builtin_prefetch(
+            &dirGroups[(entries[j] & DIR_VALUE_MASK) * 256 + (keys[j] & 0xff)]);
+      }
+    }
+    for (size_t j = i; j < count; j++) {
+      if (entries[j] & DIR_GROUP) {
+        entries[j] =
+            dirGroups[(entries[j] & DIR_VALUE_MASK) * 256 + (keys[j] & 0xff)];
+      }
+    }
+    for (size_t j = 0; j < count; j++) {
+      if (entries[j] & DIR_VALID) {
+        __builtin_prefetch(&dirResults[entries[j] & DIR_VALUE_MASK]);
+      }
+    }
+    for (size_t j = 0; j < count; j++) {
+      found[first + j] = (entries[j] & DIR_VALID) != 0;
+      if (found[first + j]) {
+        results[first + j] = dirResults[entries[j] & DIR_VALUE_MASK];
+      }
+    }
+  }
+}
+
+// 整体重建时每个线程负责第一级的一段，或者一部分第二级分组，
+// 按前缀长度从短到长写入，长的前缀自然覆盖短的
+struct DirBuildPrefix {
+  uint32_t key;
+  uint32_t len;
+  uint32_t slot;
+};
+
+static bool shorterFirst(const DirBuildPrefix &a, const DirBuildPrefix &b) {
+  return a.len < b.len;
+}
+
+static bool byIndexThenLength(const DirBuildPrefix &a,
+                              const DirBuildPrefix &b) {
+  return (a.key >> 8) != (b.key >> 8) ? (a.key >> 8) < (b.key >> 8)
+                                      : a.len < b.len;
+}
+
+static void buildLevel1(const std::vector<DirBuildPrefix> &prefixes,
+                        uint32_t begin, uint32_t end) {
+  std::fill(dirTable + begin, dirTable + end, 0);
+  for (size_t i = 0; i < prefixes.size(); i++) {
+    uint32_t first = prefixes[i].key >> 8;
+    uint32_t last = first + (1u << (24 - prefixes[i].len));
+    first = first > begin ? first : begin;
+    last = last < end ? last : end;
+    uint32_t entry = makeEntry(prefixes[i].len, prefixes[i].slot);
+    for (uint32_t index = first; index < last; index++) {
+      dirTable[index] = entry;
+    }
+  }
+}
+
+// runs[i] 是第 i 个分组的前缀在 prefixes 中的起点
+static void buildGroups(const std::vector<DirBuildPrefix> &prefixes,
+                        const std::vector<size_t> &runs, size_t begin,
+                        size_t end) {
+  for (size_t group = begin; group < end; group++) {
+    uint32_t index = prefixes[runs[group]].key >> 8;
+    uint32_t *entries = &dirGroups[group * 256];
+    std::fill(entries, entries + 256, dirTable[index]);
+    for (size_t i = runs[group]; i < runs[group + 1]; i++) {
+      uint32_t first = prefixes[i].key & 0xff;
+      uint32_t count = 1u << (32 - prefixes[i].len);
+      std::fill(entries + first, entries + first + count,
+                makeEntry(prefixes[i].len, prefixes[i].slot));
+    }
+    dirTable[index] = DIR_GROUP | group;
+  }
+}
+
+void fibBuild(const FibEntry *entries, size_t n) {
+  allocTable();
+  dirGroups.clear();
+  dirFreeGroups.clear();
+  dirResults.clear();
+  dirFreeResults.clear();
+  std::vector<DirBuildPrefix> level1, level2;
+  size_t counts[33] = {0};
+  for (size_t i = 0; i < n; i++) {
+    counts[entries[i].len]++;
+  }
+  for (int len = 0; len <= 32; len++) {
+    dirPrefixes[len].clear();
+    dirPrefixes[len].reserve(counts[len]);
+  }
+  dirResults.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    DirBuildPrefix prefix;
+    prefix.len = entries[i].len;
+    prefix.key = convertBigSmallEndian32(entries[i].addr) &
+                 prefixMask(prefix.len);
+    prefix.slot = dirResults.size();
+    dirResults.push_back(entries[i].result);
+    dirPrefixes[prefix.len][prefix.key] = prefix.slot;
+    (prefix.len <= 24 ? level1 : level2).push_back(prefix);
+  }
+  std::stable_sort(level1.begin(), level1.end(), shorterFirst);
+  std::sort(level2.begin(), level2.end(), byIndexThenLength);
+  std::vector<size_t> runs;
+  for (size_t i = 0; i < level2.size(); i++) {
+    if (i == 0 || (level2[i].key >> 8) != (level2[i - 1].key >> 8)) {
+      runs.push_back(i);
+    }
+  }
+  size_t groups = runs.size();
+  runs.push_back(level2.size());
+  dirGroups.resize(groups * 256);
+
+  // 路由不多时开线程反而更慢
+  unsigned int threads = std::thread::hardware_concurrency();
+  if (threads == 0 || n < 4096) {
+    threads = 1;
+  }
+  std::vector<std::thread> workers;
+  uint32_t step = (1u << 24) / threads;
+  for (unsigned int t = 0; t < threads; t++) {
+    uint32_t begin = t * step;
+    uint32_t end = t + 1 == threads ? 1u << 24 : begin + step;
+    workers.push_back(std::thread(buildLevel1, std::cref(level1), begin, end));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  workers.clear();
+  for (unsigned int t = 0; t < threads; t++) {
+    size_t begin = groups * t / threads;
+    size_t end = groups * (t + 1) / threads;
+    workers.push_back(std::thread(buildGroups, std::cref(level2),
+                                  std::cref(runs), begin, end));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+}
@@ -0,0 +1,499 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Poptrie：每个结点一次处理地址中的 6 位，64 个孩子用两个 64 位的位图表示，
+// vector 标记哪些孩子是内部结点，leafvec 标记叶子的连续段从哪里开始；
+// 孩子和叶子分别连续存放，用 popcount 算出下标。地址的最高 12 位直接索引
+// 一个 4096 项的数组，因此 /24 以内的查询最多读 4 次内存。叶子只存 16 位的
+// 转发结果编号，相同的转发结果只存一份，整个表很小，容易放进缓存
+//
+// 修改一个前缀时沿它的路径更新结点，只重建被它覆盖的子树，
+// 其余孩子的子树原样保留
+
+extern uint32_t convertBigSmallEndian32(uint32_t num);
+
+#define POPTRIE_DIRECT_BITS 12
+// 直接索引数组的项：最高位为 1 时低 16 位是叶子，否则是结点编号
+#define POPTRIE_LEAF 0x80000000u
+
+struct PoptrieNode {
+  uint64_t vector;  // 第 v 位为 1 表示第 v 个孩子是内部结点
+  uint64_t leafvec; // 第 v 位为 1 表示第 v 个孩子开始新的一段叶子
+  uint32_t base0;   // 叶子在 poptrieLeaves 中的起点
+  uint32_t base1;   // 内部结点在 poptrieNodes 中的起点
+};
+
+uint32_t poptrieDirect[1 << POPTRIE_DIRECT_BITS];
+std::vector<PoptrieNode> poptrieNodes;
+// 叶子是转发结果的编号，0 表示没有路由
+std::vector<uint16_t> poptrieLeaves;
+// 释放的块按大小分开保存，下次分配同样大小时复用
+std::vector<uint32_t> poptrieFreeNodes[65];
+std::vector<uint32_t> poptrieFreeLeaves[65];
+
+// 去重后的转发结果及其引用计数，下标 0 不用
+std::vector<FibResult> poptrieResults(1);
+std::vector<uint32_t> poptrieRefs(1);
+std::vector<uint16_t> poptrieFreeResults;
+std::map<std::pair<uint64_t, uint32_t>, uint16_t> poptrieResultIds;
+
+// 所有前缀，键为 (小端序地址 << 6 | 长度)，同一地址下短的在前，
+// 某个前缀之下的所有前缀是连续的一段
+std::map<uint64_t, uint16_t> poptriePrefixes;
+
+static inline uint32_t prefixMask(uint32_t len) {
+  return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+static inline uint64_t prefixKey(uint64_t key, uint32_t len) {
+  return key << 6 | len;
+}
+
+// key 从第 off 位开始的 6 位，超出 32 位的部分补 0
+static inline uint32_t chunk(uint32_t key, uint32_t off) {
+  return (uint32_t)(((uint64_t)key << 32) >> (58 - off)) & 63;
+}
+
+// 位图中第 0 到第 v 位
+static inline uint64_t bitsUpTo(uint32_t v) {
+  return (2ull << v) - 1;
+}
+
+static std::pair<uint64_t, uint32_t> resultKey(const FibResult &result) {
+  return std::make_pair((uint64_t)result.nexthop << 32 | result.if_index,
+                        result.adjacency);
+}
+
+// 取得转发结果的编号并增加引用，编号用完时返回 0
+static uint16_t acquireResult(const FibResult &result) {
+  std::map<std::pair<uint64_t, uint32_t>, uint16_t>::iterator it =
+      poptrieResultIds.find(resultKey(result));
+  if (it != poptrieResultIds.end()) {
+    poptrieRefs[it->second]++;
+    return it->second;
+  }
+  uint16_t id;
+  if (!poptrieFreeResults.empty()) {
+    id = poptrieFreeResults.back();
+    poptrieFreeResults.pop_back();
+  } else if (poptrieResults.size() < 65536) {
+    id = poptrieResults.size();
+    poptrieResults.push_back(FibResult());
+    poptrieRefs.push_back(0);
+  } else {
+    return 0;
+  }
+  poptrieResults[id] = result;
+  poptrieRefs[id] = 1;
+  poptrieResultIds[resultKey(result)] = id;
+  return id;
+}
+
+static void releaseResult(uint16_t id) {
+  if (id != 0 && --poptrieRefs[id] == 0) {
+    poptrieResultIds.erase(resultKey(poptrieResults[id]));
+    poptrieFreeResults.push_back(id);
+  }
+}
+
+template <typename T>
+static uint32_t allocBlock(std::vector<T> &pool, std::vector<uint32_t> *free,
+                           uint32_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if (!free[size].empty()) {
+    uint32_t base = free[size].back();
+    free[size].pop_back();
+    return base;
+  }
+  uint32_t base = pool.size();
+  pool.resize(pool.size() + size);
+  return base;
+}
+
+static void freeSubtree(uint32_t node) {
+  PoptrieNode n = poptrieNodes[node];
+  uint32_t children = __builtin_popcountll(n.vector);
+  for (uint32_t i = 0; i < children; i++) {
+    freeSubtree(n.base1 + i);
+  }
+  if (children != 0) {
+    poptrieFreeNodes[children].push_back(n.base1);
+  }
+  uint32_t leaves = __builtin_popcountll(n.leafvec);
+  if (leaves != 0) {
+    poptrieFreeLeaves[leaves].push_back(n.base0);
+  }
+}
+
+typedef std::map<uint64_t, uint16_t>::const_iterator PrefixIterator;
+
+// 结点 key/off 的 64 个位置：没有被覆盖的位置是 fallback，
+// vector 标出之下还有更长前缀的位置。遇到更长的前缀时直接跳到下一个位置，
+// 因此只访问止于本结点的前缀
+static void scanNode(uint32_t key, uint32_t off, uint16_t fallback,
+                     uint16_t *slots, uint64_t *vector) {
+  std::fill(slots, slots + 64, fallback);
+  *vector = 0;
+  // 同一位置上短的前缀在前，长的覆盖短的；但前面的位置上可能有更短的前缀
+  // 覆盖了后面的位置，所以按长度分开写
+  // 止于本结点的前缀最多有 2 + 4 + ... + 64 个
+  PrefixIterator ending[126];
+  uint32_t endingCount = 0;
+  uint64_t end = (uint64_t)key + (1ull << (32 - off));
+  PrefixIterator it = poptriePrefixes.lower_bound(prefixKey(key, off + 1));
+  PrefixIterator last = poptriePrefixes.lower_bound(prefixKey(end, 0));
+  while (it != last) {
+    uint32_t len = it->first & 63;
+    uint32_t v = chunk(it->first >> 6, off);
+    if (len <= off + 6) {
+      ending[endingCount++] = it++;
+    } else {
+      *vector |= 1ull << v;
+      uint64_t next = (uint64_t)key + ((uint64_t)(v + 1) << (26 - off));
+      it = poptriePrefixes.lower_bound(prefixKey(next, 0));
+    }
+  }
+  for (uint32_t len = off + 1; len <= off + 6; len++) {
+    for (uint32_t i = 0; i < endingCount; i++) {
+      if ((ending[i]->first & 63) == len) {
+        uint32_t begin = chunk(ending[i]->first >> 6, off);
+        std::fill(slots + begin, slots + begin + (1u << (off + 6 - len)),
+                  ending[i]->second);
+      }
+    }
+  }
+}
+
+// 按 slots 和 vector 重新写结点的叶子，相邻且相同的叶子只存一份，
+// 中间夹着的内部结点不打断
+static void writeLeaves(uint32_t node, const uint16_t *slots,
+                        uint64_t vector) {
+  uint64_t leafvec = 0;
+  uint16_t leaves[64];
+  uint32_t leafCount = 0;
+  for (uint32_t v = 0; v < 64; v++) {
+    if ((vector >> v) & 1) {
+      continue;
+    }
+    if (leafCount == 0 || leaves[leafCount - 1] != slots[v]) {
+      leafvec |= 1ull << v;
+      leaves[leafCount++] = slots[v];
+    }
+  }
+  uint32_t base0 = allocBlock(poptrieLeaves, poptrieFreeLeaves, leafCount);
+  std::copy(leaves, leaves + leafCount, poptrieLeaves.begin() + base0);
+  poptrieNodes[node].leafvec = leafvec;
+  poptrieNodes[node].base0 = base0;
+}
+
+static inline uint32_t childKey(uint32_t key, uint32_t off, uint32_t v) {
+  return key | v << (26 - off);
+}
+
+// 构建代表前缀 key/off 的结点 node 及其子树，没有被覆盖的位置使用 fallback
+static void buildNode(uint32_t node, uint32_t key, uint32_t off,
+                      uint16_t fallback) {
+  uint16_t slots[64];
+  uint64_t vector;
+  scanNode(key, off, fallback, slots, &vector);
+  uint32_t base1 = allocBlock(poptrieNodes, poptrieFreeNodes,
+                              __builtin_popcountll(vector));
+  poptrieNodes[node].vector = vector;
+  poptrieNodes[node].base1 = base1;
+  writeLeaves(node, slots, vector);
+  for (uint32_t v = 0; v < 64; v++) {
+    if ((vector >> v) & 1) {
+      buildNode(base1++, childKey(key, off, v), off + 6, slots[v]);
+    }
+  }
+}
+
+// 前缀 prefix/len 在结点 node（代表 key/off，len > off）之下发生了变化，
+// 更新 node：未受影响的孩子原样保留，新出现的孩子新建，
+// 被该前缀覆盖的孩子重建，包含该前缀的孩子递归更新
+static void updateNode(uint32_t node, uint32_t key, uint32_t off,
+                       uint16_t fallback, uint32_t prefix, uint32_t len) {
+  uint16_t slots[64];
+  uint64_t vector;
+  scanNode(key, off, fallback, slots, &vector);
+  PoptrieNode old = poptrieNodes[node];
+  uint32_t oldLeaves = __builtin_popcountll(old.leafvec);
+  if (oldLeaves != 0) {
+    poptrieFreeLeaves[oldLeaves].push_back(old.base0);
+  }
+  uint32_t base1 = old.base1;
+  uint64_t created = 0;
+  if (vector != old.vector) {
+    // 孩子的结点记录可以搬到新的块中，它们的子树不用动
+    base1 = allocBlock(poptrieNodes, poptrieFreeNodes,
+                       __builtin_popcountll(vector));
+    uint32_t oldChild = old.base1, child = base1;
+    for (uint32_t v = 0; v < 64; v++) {
+      bool inOld = (old.vector >> v) & 1, inNew = (vector >> v) & 1;
+      if (inOld && inNew) {
+        poptrieNodes[child] = poptrieNodes[oldChild];
+      } else if (inOld) {
+        freeSubtree(oldChild);
+      } else if (inNew) {
+        created |= 1ull << v;
+      }
+      oldChild += inOld;
+      child += inNew;
+    }
+    uint32_t oldChildren = __builtin_popcountll(old.vector);
+    if (oldChildren != 0) {
+      poptrieFreeNodes[oldChildren].push_back(old.base1);
+    }
+  }
+  poptrieNodes[node].vector = vector;
+  poptrieNodes[node].base1 = base1;
+  writeLeaves(node, slots, vector);
+
+  // 该前缀覆盖的位置范围
+  uint32_t first = chunk(prefix, off);
+  uint32_t count = len <= off + 6 ? 1u << (off + 6 - len) : 1;
+  uint32_t child = base1;
+  for (uint32_t v = 0; v < 64; v++) {
+    if (!((vector >> v) & 1)) {
+      continue;
+    }
+    uint32_t k = childKey(key, off, v);
+    if ((created >> v) & 1) {
+      buildNode(child, k, off + 6, slots[v]);
+    } else if (v >= first && v < first + count) {
+      if (len > off + 6) {
+        updateNode(child, k, off + 6, slots[v], prefix, len);
+      } else {
+        freeSubtree(child);
+        buildNode(child, k, off + 6, slots[v]);
+      }
+    }
+    child++;
+  }
+}
+
+// 覆盖 key 且不长于 len 的最长前缀
+static uint16_t longestCovering(uint32_t key, uint32_t len) {
+  for (int l = len; l >= 0; l--) {
+    std::map<uint64_t, uint16_t>::iterator it =
+        poptriePrefixes.find(prefixKey(key & prefixMask(l), l));
+    if (it != poptriePrefixes.end()) {
+      return it->second;
+    }
+  }
+  return 0;
+}
+
+// 直接索引数组的第 index 项之下是否还有前缀
+static bool hasLonger(uint32_t index) {
+  uint32_t key = index << (32 - POPTRIE_DIRECT_BITS);
+  uint64_t end = (uint64_t)key + (1u << (32 - POPTRIE_DIRECT_BITS));
+  return poptriePrefixes.lower_bound(
+             prefixKey(key, POPTRIE_DIRECT_BITS + 1)) !=
+         poptriePrefixes.lower_bound(prefixKey(end, 0));
+}
+
+// 重建直接索引数组的第 index 项及其下的子树
+static void rebuildDirect(uint32_t index) {
+  uint32_t key = index << (32 - POPTRIE_DIRECT_BITS);
+  uint16_t fallback = longestCovering(key, POPTRIE_DIRECT_BITS);
+  uint32_t node = poptrieDirect[index];
+  bool longer = hasLonger(index);
+  if (!(node & POPTRIE_LEAF)) {
+    freeSubtree(node);
+    if (!longer) {
+      poptrieFreeNodes[1].push_back(node);
+    }
+  } else if (longer) {
+    node = allocBlock(poptrieNodes, poptrieFreeNodes, 1);
+  }
+  if (!longer) {
+    poptrieDirect[index] = POPTRIE_LEAF | fallback;
+  } else {
+    buildNode(node, key, POPTRIE_DIRECT_BITS, fallback);
+    poptrieDirect[index] = node;
+  }
+}
+
+// 前缀 key/len 变化后更新受影响的部分：长度不超过 12 时重建它覆盖的直接索引项，
+// 否则从直接索引项的结点开始沿路径更新
+static void updatePrefix(uint32_t key, uint32_t len) {
+  uint32_t index = key >> (32 - POPTRIE_DIRECT_BITS);
+  if (len <= POPTRIE_DIRECT_BITS) {
+    for (uint32_t i = index; i < index + (1u << (POPTRIE_DIRECT_BITS - len));
+         i++) {
+      rebuildDirect(i);
+    }
+  } else if ((poptrieDirect[index] & POPTRIE_LEAF) || !hasLonger(index)) {
+    // 直接索引项需要在叶子和结点之间转换
+    rebuildDirect(index);
+  } else {
+    uint32_t nodeKey = key & prefixMask(POPTRIE_DIRECT_BITS);
+    updateNode(poptrieDirect[index], nodeKey, POPTRIE_DIRECT_BITS,
+               longestCovering(nodeKey, POPTRIE_DIRECT_BITS), key, len);
+  }
+}
+
+static void initDirect() {
+  static bool initialized = false;
+  if (!initialized) {
+    std::fill(poptrieDirect, poptrieDirect + (1 << POPTRIE_DIRECT_BITS),
+              POPTRIE_LEAF);
+    initialized = true;
+  }
+}
+
+void fibInsert(uint32_t addr, uint32_t len, const FibResult &result) {
+  initDirect();
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  uint16_t id = acquireResult(result);
+  std::map<uint64_t, uint16_t>::iterator it =
+      poptriePrefixes.find(prefixKey(key, len));
+  if (id == 0) {
+    // 编号 0 表示没有路由，不能存进叶子，否则这个前缀会把报文全部丢掉；
+    // 保留原来的结果，没有时继续使用更短的前缀
+    fprintf(stderr, "Poptrie: too many distinct forwarding results, "
+            "keeping the old route for prefix /%u\n", len);
+    return;
+  }
+  if (it != poptriePrefixes.end()) {
+    releaseResult(it->second);
+    if (it->second == id) {
+      return;
+    }
+    it->second = id;
+  } else {
+    poptriePrefixes[prefixKey(key, len)] = id;
+  }
+  updatePrefix(key, len);
+}
+
+void fibErase(uint32_t addr, uint32_t len) {
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  std::map<uint64_t, uint16_t>::iterator it =
+      poptriePrefixes.find(prefixKey(key, len));
+  if (it == poptriePrefixes.end()) {
+    return;
+  }
+  releaseResult(it->second);
+  poptriePrefixes.erase(it);
+  updatePrefix(key, len);
+}
+
+bool fibLookup(uint32_t addr, FibResult *result) {
+  initDirect();
+  uint32_t key = convertBigSmallEndian32(addr);
+  uint32_t entry = poptrieDirect[key >> (32 - POPTRIE_DIRECT_BITS)];
+  uint16_t leaf;
+  if (entry & POPTRIE_LEAF) {
+    leaf = entry;
+  } else {
+    uint32_t off = POPTRIE_DIRECT_BITS;
+    const PoptrieNode *n = &poptrieNodes[entry];
+    uint32_t v = chunk(key, off);
+    while ((n->vector >> v) & 1) {
+      n = &poptrieNodes[n->base1 +
+                        __builtin_popcountll(n->vector & bitsUpTo(v)) - 1];
+      off += 6;
+      v = chunk(key, off);
+    }
+    leaf = poptrieLeaves[n->base0 +
+                         __builtin_popcountll(n->leafvec & bitsUpTo(v)) - 1];
+  }
+  if (leaf == 0) {
+    return false;
+  }
+  *result = poptrieResults[leaf];
+  return true;
+}
+
+void fibLookupBatch(const uint32_t *addrs, size_t n, FibResult *results,
+                    bool *found) {
+  initDirect();
+  for (size_t first = 0; first < n; first += FIB_BATCH) {
+    size_t count = n - first < FIB_BATCH ? n - first : FIB_BATCH;
+    uint32_t keys[FIB_BATCH], nodes[FIB_BATCH], offs[FIB_BATCH];
+    uint16_t leaves[FIB_BATCH];
+    // 直接索引数组只有 16 KiB，总在缓存中；之后每一轮各个查询都向下走一层，
+    // 并预取下一层的结点或叶子
+    bool active = false;
+    for (size_t i = 0; i < count; i++) {
+      keys[i] = convertBigSmallEndian32(addrs[first + i]);
+      uint32_t entry = poptrieDirect[keys[i] >> (32 - POPTRIE_DIRECT_BITS)];
+      if (entry & POPTRIE_LEAF) {
+        leaves[i] = entry;
+        nodes[i] = POPTRIE_LEAF;
+      } else {
+        nodes[i] = entry;
+        offs[i] = POPTRIE_DIRECT_BITS;
+        __builtin_prefetch(&poptrieNodes[entry]);
+        active = true;
+      }
+    }
+    while (active) {
+      active = false;
+      for (size_t i = 0; i < count; i++) {
+        if (nodes[i] == POPTRIE_LEAF) {
+          continue;
+        }
+        const PoptrieNode &node = poptrieNodes[nodes[i]];
+        uint32_t v = chunk(keys[i], offs[i]);
+        if ((node.vector >> v) & 1) {
+          nodes[i] = node.base1 +
+                     __builtin_popcountll(node.vector & bitsUpTo(v)) - 1;
+          offs[i] += 6;
+          __builtin_prefetch(&poptrieNodes[nodes[i]]);
+          active = true;
+        } else {
+          leaves[i] = poptrieLeaves[node.base0 +
+                                    __builtin_popcountll(node.leafvec &
+                                                         bitsUpTo(v)) - 1];
+          nodes[i] = POPTRIE_LEAF;
+        }
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      found[first + i] = leaves[i] != 0;
+      if (leaves[i] != 0) {
+        results[first + i] = poptrieResults[leaves[i]];
+      }
+    }
+  }
+}
+
+void fibBuild(const FibEntry *entries, size_t n) {
+  initDirect();
+  poptriePrefixes.clear();
+  poptrieResults.resize(1);
+  poptrieRefs.resize(1);
+  poptrieFreeResults.clear();
+  poptrieResultIds.clear();
+  for (size_t i = 0; i < n; i++) {
+    uint32_t key = convertBigSmallEndian32(entries[i].addr) &
+                   prefixMask(entries[i].len);
+    uint16_t id = acquireResult(entries[i].result);
+    if (id == 0) {
+      fprintf(stderr, "Poptrie: too many distinct forwarding results, "
+              "skipping prefix /%u\n", entries[i].len);
+      continue;
+    }
+    poptriePrefixes[prefixKey(key, entries[i].len)] = id;
+  }
+  poptrieNodes.clear();
+  poptrieLeaves.clear();
+  for (int size = 0; size <= 64; size++) {
+    poptrieFreeNodes[size].clear();
+    poptrieFreeLeaves[size].clear();
+  }
+  for (uint32_t i = 0; i < (1u << POPTRIE_DIRECT_BITS); i++) {
+    poptrieDirect[i] = POPTRIE_LEAF;
+    rebuildDirect(i);
+  }
+}
@@ -0,0 +1,226 @@
+#include "fib.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+// 路径压缩的二叉字典树（Patricia trie）：只有一个孩子且没有路由的结点
+// 会被压缩掉，因此结点数不超过前缀数的两倍，查询最多访问 len+1 个结点，
+// 与路由表的大小无关
+
+extern uint32_t convertBigSmallEndian32(uint32_t num);
+
+struct TrieNode {
+  uint32_t key;       // 小端序，仅最高 len 位有效
+  uint32_t len;       // 结点代表的前缀长度
+  bool hasRoute;      // 该前缀本身是否是一条路由
+  FibResult result;
+  uint32_t child[2];  // 下一位为 0/1 的子树，0 表示没有
+};
+
+// 结点池，下标 0 不用，作为空指针
+std::vector<TrieNode> trieNodes(1);
+std::vector<uint32_t> trieFree;
+uint32_t trieRoot = 0;
+
+static inline uint32_t prefixMask(uint32_t len) {
+  return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+// key 中紧接在前 len 位之后的那一位
+static inline uint32_t nextBit(uint32_t key, uint32_t len) {
+  return (key >> (31 - len)) & 1;
+}
+
+static uint32_t allocNode(uint32_t key, uint32_t len) {
+  uint32_t node;
+  if (!trieFree.empty()) {
+    node = trieFree.back();
+    trieFree.pop_back();
+  } else {
+    node = trieNodes.size();
+    trieNodes.push_back(TrieNode());
+  }
+  TrieNode &n = trieNodes[node];
+  n.key = key & prefixMask(len);
+  n.len = len;
+  n.hasRoute = false;
+  n.child[0] = n.child[1] = 0;
+  return node;
+}
+
+// 把 parent 的 bit 孩子（parent 为 0 时是根）设为 node
+static void setChild(uint32_t parent, uint32_t bit, uint32_t node) {
+  if (parent == 0) {
+    trieRoot = node;
+  } else {
+    trieNodes[parent].child[bit] = node;
+  }
+}
+
+static uint32_t newRoute(uint32_t key, uint32_t len, const FibResult &result) {
+  uint32_t node = allocNode(key, len);
+  trieNodes[node].hasRoute = true;
+  trieNodes[node].result = result;
+  return node;
+}
+
+void fibInsert(uint32_t addr, uint32_t len, const FibResult &result) {
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  uint32_t parent = 0, bit = 0;
+  uint32_t node = trieRoot;
+  while (true) {
+    if (node == 0) {
+      setChild(parent, bit, newRoute(key, len, result));
+      return;
+    }
+    // 与该结点前缀的公共部分长度
+    uint32_t nodeLen = trieNodes[node].len;
+    uint32_t nodeKey = trieNodes[node].key;
+    uint32_t diff = key ^ nodeKey;
+    uint32_t common = diff == 0 ? 32 : __builtin_clz(diff);
+    common = common < len ? common : len;
+    common = common < nodeLen ? common : nodeLen;
+    if (common == nodeLen) {
+      if (len == nodeLen) {
+        trieNodes[node].hasRoute = true;
+        trieNodes[node].result = result;
+        return;
+      }
+      // 继续向下
+      parent = node;
+      bit = nextBit(key, nodeLen);
+      node = trieNodes[node].child[bit];
+      continue;
+    }
+    // 在公共前缀处分裂出一个新结点
+    uint32_t split = common == len ? newRoute(key, len, result)
+                                   : allocNode(key, common);
+    uint32_t oldBit = nextBit(nodeKey, common);
+    trieNodes[split].child[oldBit] = node;
+    if (common != len) {
+      // 先分配，分配可能使 trieNodes 中的引用失效
+      uint32_t leaf = newRoute(key, len, result);
+      trieNodes[split].child[oldBit ^ 1] = leaf;
+    }
+    setChild(parent, bit, split);
+    return;
+  }
+}
+
+void fibErase(uint32_t addr, uint32_t len) {
+  uint32_t key = convertBigSmallEndian32(addr) & prefixMask(len);
+  // 从根到目标结点经过的结点
+  uint32_t path[33];
+  int depth = 0;
+  uint32_t node = trieRoot;
+  while (node != 0) {
+    const TrieNode &n = trieNodes[node];
+    if (n.len > len || ((key ^ n.key) & prefixMask(n.len)) != 0) {
+      return;
+    }
+    path[depth++] = node;
+    if (n.len == len) {
+      break;
+    }
+    node = n.child[nextBit(key, n.len)];
+  }
+  if (node == 0 || !trieNodes[node].hasRoute) {
+    return;
+  }
+  trieNodes[node].hasRoute = false;
+  // 自下而上压缩：没有路由的结点若没有孩子则删除，只有一个孩子则用孩子替代
+  for (int i = depth - 1; i >= 0; i--) {
+    TrieNode &n = trieNodes[path[i]];
+    if (n.hasRoute || (n.child[0] != 0 && n.child[1] != 0)) {
+      break;
+    }
+    uint32_t replacement = n.child[0] != 0 ? n.child[0] : n.child[1];
+    if (i == 0) {
+      trieRoot = replacement;
+    } else {
+      TrieNode &p = trieNodes[path[i - 1]];
+      p.child[p.child[0] == path[i] ? 0 : 1] = replacement;
+    }
+    trieFree.push_back(path[i]);
+    if (replacement != 0) {
+      // 父结点的孩子数没有变化，不需要继续向上
+      break;
+    }
+  }
+}
+
+bool fibLookup(uint32_t addr, FibResult *result) {
+  uint32_t key = convertBigSmallEndian32(addr);
+  const TrieNode *best = NULL;
+  uint32_t node = trieRoot;
+  while (node != 0) {
+    const TrieNode &n = trieNodes[node];
+    if (((key ^ n.key) & prefixMask(n.len)) != 0) {
+      break;
+    }
+    if (n.hasRoute) {
+      best = &n;
+    }
+    if (n.len == 32) {
+      break;
+    }
+    node = n.child[nextBit(key, n.len)];
+  }
+  if (best == NULL) {
+    return false;
+  }
+  *result = best->result;
+  return true;
+}
+
+void fibLookupBatch(const uint32_t *addrs, size_t n, FibResult *results,
+                    bool *found) {
+  for (size_t first = 0; first < n; first += FIB_BATCH) {
+    size_t count = n - first < FIB_BATCH ? n - first : FIB_BATCH;
+    uint32_t keys[FIB_BATCH], nodes[FIB_BATCH];
+    const TrieNode *best[FIB_BATCH];
+    for (size_t i = 0; i < count; i++) {
+      keys[i] = convertBigSmallEndian32(addrs[first + i]);
+      nodes[i] = trieRoot;
+      best[i] = NULL;
+    }
+    // 每一轮各个查询都向下走一步，并预取下一步要访问的结点
+    bool active = trieRoot != 0;
+    while (active) {
+      active = false;
+      for (size_t i = 0; i < count; i++) {
+        if (nodes[i] == 0) {
+          continue;
+        }
+        const TrieNode &node = trieNodes[nodes[i]];
+        if (((keys[i] ^ node.key) & prefixMask(node.len)) != 0) {
+          nodes[i] = 0;
+          continue;
+        }
+        if (node.hasRoute) {
+          best[i] = &node;
+        }
+        nodes[i] = node.len == 32 ? 0 : node.child[nextBit(keys[i], node.len)];
+        if (nodes[i] != 0) {
+          __builtin_prefetch(&trieNodes[nodes[i]]);
+          active = true;
+        }
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      found[first + i] = best[i] != NULL;
+      if (best[i] != NULL) {
+        results[first + i] = best[i]->result;
+      }
+    }
+  }
+}
+
+void fibBuild(const FibEntry *entries, size_t n) {
+  trieNodes.resize(1);
+  trieFree.clear();
+  trieRoot = 0;
+  for (size_t i = 0; i < n; i++) {
+    fibInsert(entries[i].addr, entries[i].len, entries[i].result);
+  }
+}
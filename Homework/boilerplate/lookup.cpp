@@ -1,6 +1,9 @@
 #include "router.h"
+#include "router_hal.h"
+#include "fib.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <atomic>
 #include <vector>
 
 std::vector<RoutingTableEntry> table;
@@ -13,6 +16,7 @@ typedef struct {
   uint32_t metric;   // 小端序
   uint64_t timestamp;// 小端序
   uint32_t nexthop; // 大端序，下一跳的 IPv4 地址
+  uint32_t adjacency; // 下一跳的邻接表项编号，由 update 维护
 } RoutingTableEntry;
    约定 addr 和 nexthop 以 **大端序** 存储。
    这意味着 1.2.3.4 对应 0x04030201 而不是 0x01020304。
@@ -35,6 +39,150 @@ int find(const RoutingTableEntry &entry) {
   return -1;
 }
 
+void resolveNexthop(RoutingTableEntry &entry) {
+  // 取得下一跳的邻接表项，新的下一跳会立即发出 ARP 请求，
+  // 转发第一个报文时就已经知道它的 MAC 地址
+  entry.adjacency = 0;
+  if (entry.nexthop != 0) {
+    int adjacency = HAL_GetAdjacency(entry.if_index, entry.nexthop);
+    if (adjacency > 0) {
+      entry.adjacency = adjacency;
+    }
+  }
+}
+
+void releaseNexthop(const RoutingTableEntry &entry) {
+  if (entry.adjacency != 0) {
+    HAL_ReleaseAdjacency(entry.adjacency);
+  }
+}
+
+#ifndef ROUTE_CACHE_SIZE
+#define ROUTE_CACHE_SIZE 1024  // 路由缓存的项数，须为 2 的幂
+#endif
+
+// 按目的地址直接映射的路由缓存，保存 query 的结果（包括没有查到），
+// 少数目的地址占大部分流量时可以跳过最长前缀匹配。每个转发线程一份，
+// 不需要加锁；转发表变化时 routeGeneration 加一，旧的缓存项随之作废
+typedef struct {
+  uint32_t addr;        // 大端序
+  uint32_t generation;  // 写入时的 routeGeneration，0 表示空
+  uint32_t nexthop;
+  uint32_t if_index;
+  uint32_t adjacency;
+  bool found;
+} RouteCacheEntry;
+
+thread_local RouteCacheEntry routeCache[ROUTE_CACHE_SIZE];
+// 修改转发表时持有路由表的写锁，查询时持有读锁，因此一次查询中它不会变化
+std::atomic<uint32_t> routeGeneration(1);
+
+#ifndef ROUTE_CACHE_THREADS
+#define ROUTE_CACHE_THREADS 64  // 各自统计命中次数的线程数，超出的线程共用最后一组计数
+#endif
+
+// 路由缓存的命中和未命中次数，每个线程一组，各占一个缓存行，
+// 查询时只写自己的一组，不会和其他线程争用同一个缓存行；getRouteCacheStats 时再求和
+typedef struct alignas(64) {
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+} RouteCacheCounters;
+
+RouteCacheCounters routeCacheCounters[ROUTE_CACHE_THREADS];
+std::atomic<int> routeCacheThreads(0);
+thread_local int routeCacheThread = -1;  // 本线程的计数在 routeCacheCounters 中的下标
+
+static inline void countRouteCache(uint64_t hits, uint64_t misses) {
+  if (routeCacheThread < 0) {
+    routeCacheThread = routeCacheThreads.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (routeCacheThread < ROUTE_CACHE_THREADS - 1) {
+    // 只有本线程写，读出加上再写回即可，不需要带锁的原子加
+    RouteCacheCounters &counters = routeCacheCounters[routeCacheThread];
+    counters.hits.store(counters.hits.load(std::memory_order_relaxed) + hits, std::memory_order_relaxed);
+    counters.misses.store(counters.misses.load(std::memory_order_relaxed) + misses, std::memory_order_relaxed);
+  } else {
+    RouteCacheCounters &counters = routeCacheCounters[ROUTE_CACHE_THREADS - 1];
+    counters.hits.fetch_add(hits, std::memory_order_relaxed);
+    counters.misses.fetch_add(misses, std::memory_order_relaxed);
+  }
+}
+
+static inline RouteCacheEntry &routeCacheSlot(uint32_t addr) {
+  return routeCache[(addr * 2654435761u) >> 16 & (ROUTE_CACHE_SIZE - 1)];
+}
+
+static inline void invalidateRouteCache() {
+  routeGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+void getRouteCacheStats(uint64_t *hits, uint64_t *misses) {
+  // 所有线程累计的路由缓存命中和未命中次数
+  *hits = *misses = 0;
+  for (int i = 0; i < ROUTE_CACHE_THREADS; ++i) {
+    *hits += routeCacheCounters[i].hits.load(std::memory_order_relaxed);
+    *misses += routeCacheCounters[i].misses.load(std::memory_order_relaxed);
+  }
+}
+
+void installRoute(const RoutingTableEntry &entry) {
+  // 把路由表项的转发结果写入转发表，query 只查转发表
+  FibResult result;
+  result.nexthop = entry.nexthop;
+  result.if_index = entry.if_index;
+  result.adjacency = entry.adjacency;
+  fibInsert(entry.addr, entry.len, result);
+  invalidateRouteCache();
+}
+
+void rebuildFib() {
+  // 从路由表整体重建转发表，用于一次性导入大量路由之后
+  std::vector<FibEntry> entries(table.size());
+  for (size_t i = 0; i < table.size(); i++) {
+    entries[i].addr = table[i].addr;
+    entries[i].len = table[i].len;
+    entries[i].result.nexthop = table[i].nexthop;
+    entries[i].result.if_index = table[i].if_index;
+    entries[i].result.adjacency = table[i].adjacency;
+  }
+  fibBuild(entries.data(), entries.size());
+  invalidateRouteCache();
+}
+
+void eraseRoute(int index) {
+  // 删除路由表项，同时释放它的邻接表项
+  fibErase(table[index].addr, table[index].len);
+  invalidateRouteCache();
+  releaseNexthop(table[index]);
+  table.erase(table.begin() + index);
+}
+
+#ifndef ROUTE_REBUILD_RATIO
+#define ROUTE_REBUILD_RATIO 8  // 一次删除超过 1/8 的表项时整体重建转发表
+#endif
+
+void eraseRoutes(const std::vector<int> &indices) {
+  // 一次删除多条路由表项，indices 升序排列，例如一个邻居失效后它的路由同时超时。
+  // 删除得多时压缩路由表后整体重建转发表，比逐条删除快
+  if (indices.size() * ROUTE_REBUILD_RATIO < table.size()) {
+    for (size_t i = indices.size(); i > 0; i--) {
+      eraseRoute(indices[i - 1]);
+    }
+    return;
+  }
+  size_t next = 0, kept = 0;
+  for (size_t i = 0; i < table.size(); i++) {
+    if (next < indices.size() && indices[next] == (int)i) {
+      releaseNexthop(table[i]);
+      next++;
+    } else {
+      table[kept++] = table[i];
+    }
+  }
+  table.resize(kept);
+  rebuildFib();
+}
+
 /** 注意同之前 lookup oj 测试题中的实现不同
  * @brief 插入一条路由表表项，若 metric 为 16 则表示删除
  * @param entry 要插入/删除的表项
@@ -59,11 +207,15 @@ bool update(RoutingTableEntry entry) {
       // 首先判断来源是否相同，相同则直接更新
       if (entry.metric >= 16) {
         // 删除表项
-        table.erase(table.begin() + ind);
+        eraseRoute(ind);
         return true;
       } else if (entry.metric != table[ind].metric){
         // 不删除，仅更新
+        resolveNexthop(entry);
+        releaseNexthop(table[ind]);
         table[ind] = entry;
+        installRoute(entry);
+        return true;
       } else {
         // 无实质变动，仅更新timestamp，并返回 false
         table[ind].timestamp = entry.timestamp;
@@ -71,7 +223,10 @@ bool update(RoutingTableEntry entry) {
       }
     } else if (entry.metric < table[ind].metric) {
       // 否则若新 metric < 旧 metric
+      resolveNexthop(entry);
+      releaseNexthop(table[ind]);
       table[ind] = entry;
+      installRoute(entry);
       return true;
     } else {
       return false;
@@ -79,42 +234,94 @@ bool update(RoutingTableEntry entry) {
   } else if (entry.metric < 16){
     // 原表项中不存在该网段且新metric<16
     // TODO
+    resolveNexthop(entry);
     table.push_back(entry);
+    installRoute(entry);
     return true;
   } else {
     return false;
   }
 }
 
-bool match(const RoutingTableEntry &entry, uint32_t addr) {
-  // 判断地址 addr 是否处在 entry 所表示的网段中（由entry.addr和entry.len确定网段）
-  uint32_t addr2 = convertBigSmallEndian32(entry.addr);
-  addr = convertBigSmallEndian32(addr);
-  for (int i = 0; i < entry.len; ++i) {
-    if ((addr & (1 << (31-i))) != (addr2 & (1 << (31-i))))
-      return false;
-  }
-  return true;
-}
-
 /**
  * @brief 进行一次路由表的查询，按照最长前缀匹配原则
  * @param addr 需要查询的目标地址，大端序
  * @param nexthop 如果查询到目标，把表项的 nexthop 写入
  * @param if_index 如果查询到目标，把表项的 if_index 写入
+ * @param adjacency 如果查询到目标，把表项的 adjacency 写入
  * @return 查到则返回 true ，没查到则返回 false
  */
-bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) {
-  int ind = -1;
-  for (int i = 0; i < table.size(); ++i) {
-    if (match(table[i], addr)) {
-      if (ind == -1 || table[i].len > table[ind].len)
-        ind = i;
-    }
+bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *adjacency) {
+  // 先查路由缓存，未命中时才查转发表，开销只与前缀长度有关
+  uint32_t generation = routeGeneration.load(std::memory_order_relaxed);
+  RouteCacheEntry &cached = routeCacheSlot(addr);
+  if (cached.generation != generation || cached.addr != addr) {
+    countRouteCache(0, 1);
+    FibResult result = {};
+    cached.addr = addr;
+    cached.generation = generation;
+    cached.found = fibLookup(addr, &result);
+    cached.nexthop = result.nexthop;
+    cached.if_index = result.if_index;
+    cached.adjacency = result.adjacency;
+  } else {
+    countRouteCache(1, 0);
   }
-  if (ind == -1)
+  if (!cached.found)
     return false;
-  *nexthop = table[ind].nexthop;
-  *if_index = table[ind].if_index;
+  *nexthop = cached.nexthop;
+  *if_index = cached.if_index;
+  *adjacency = cached.adjacency;
   return true;
 }
+
+/**
+ * @brief 批量进行路由表的查询，结果与逐个调用 query 相同
+ * @param addrs 需要查询的 n 个目标地址，大端序
+ * @param n 地址个数，一次 8 到 16 个时效果最好，更多时分组进行
+ * @param nexthops 第 i 个地址查询到目标时，把表项的 nexthop 写入 nexthops[i]
+ * @param if_indices 同上，写入表项的 if_index
+ * @param adjacencies 同上，写入表项的 adjacency
+ * @param found 第 i 个地址查到则 found[i] 为 true ，否则为 false
+ */
+void queryBatch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indices, uint32_t *adjacencies, bool *found) {
+  // 命中路由缓存的直接得到结果，其余的凑成一组交替推进，
+  // 让它们的访存延迟互相重叠
+  uint32_t generation = routeGeneration.load(std::memory_order_relaxed);
+  uint32_t missAddrs[FIB_BATCH];
+  size_t missSlots[FIB_BATCH];
+  FibResult results[FIB_BATCH] = {};
+  bool missFound[FIB_BATCH];
+  size_t misses = 0, totalMisses = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const RouteCacheEntry &cached = routeCacheSlot(addrs[i]);
+    if (cached.generation == generation && cached.addr == addrs[i]) {
+      found[i] = cached.found;
+      nexthops[i] = cached.nexthop;
+      if_indices[i] = cached.if_index;
+      adjacencies[i] = cached.adjacency;
+    } else {
+      missAddrs[misses] = addrs[i];
+      missSlots[misses++] = i;
+    }
+    if (misses == FIB_BATCH || (i + 1 == n && misses != 0)) {
+      fibLookupBatch(missAddrs, misses, results, missFound);
+      for (size_t j = 0; j < misses; ++j) {
+        RouteCacheEntry &slot = routeCacheSlot(missAddrs[j]);
+        slot.addr = missAddrs[j];
+        slot.generation = generation;
+        slot.found = missFound[j];
+        slot.nexthop = results[j].nexthop;
+        slot.if_index = results[j].if_index;
+        slot.adjacency = results[j].adjacency;
+        found[missSlots[j]] = slot.found;
+        nexthops[missSlots[j]] = slot.nexthop;
+        if_indices[missSlots[j]] = slot.if_index;
+        adjacencies[missSlots[j]] = slot.adjacency;
+      }
+      totalMisses += misses;
+      misses = 0;
+    }
+  }
+  countRouteCache(n - totalMisses, totalMisses);
+}
@@ -6,7 +6,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
 #include <vector>
+#include <pthread.h>
 #define RIP_MAX_ENTRY 25
 #define TICKS_PER_SEC 1000
 #define TIMEOUT 60
@@ -15,7 +20,11 @@
 
 extern bool validateIPChecksum(uint8_t *packet, size_t len);
 extern bool update(RoutingTableEntry entry);
-extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *adjacency);
+extern void queryBatch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indices, uint32_t *adjacencies, bool *found);
+extern void getRouteCacheStats(uint64_t *hits, uint64_t *misses);
+extern void eraseRoute(int index);
+extern void eraseRoutes(const std::vector<int> &indices);
 extern bool forward(uint8_t *packet, size_t len);
 extern bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output);
 extern uint32_t assemble(const RipPacket *rip, uint8_t *buffer);
@@ -37,9 +46,55 @@ extern void printRouteTable(uint64_t time, FILE *file);
 
 bool DEBUG = false;  // 是否输出调试信息(总开关)，不能关闭路由表打印
 
-uint8_t packet[2048];
-uint8_t output[2048];
-uint16_t ipTag;  // ip头中的16位标识
+#define RX_BATCH 32  // 每次最多批量收取的报文数
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE 0  // 每个收包缓冲区的大小，0 表示按 HAL_GetMaxPacketSize() 的返回值
+#endif
+#ifndef WORKERS
+#define WORKERS 1  // 转发线程数，每个线程处理 HAL 的一个队列
+#endif
+
+// 每个转发线程各自的收发缓冲区
+thread_local std::vector<uint8_t> rxBuffers;  // RX_BATCH 个收包缓冲区首尾相接
+thread_local HAL_Packet rxPackets[RX_BATCH];
+// 一批报文中需要转发的那些的目的地址及其路由，收包后一次查出
+thread_local uint32_t rxDstAddrs[RX_BATCH];
+thread_local uint32_t rxNexthops[RX_BATCH];
+thread_local uint32_t rxIfIndices[RX_BATCH];
+thread_local uint32_t rxAdjacencies[RX_BATCH];
+thread_local bool rxFound[RX_BATCH];
+thread_local uint8_t output[2048];
+thread_local int messageId = 0;  // for debug
+std::atomic<uint16_t> ipTag;  // ip头中的16位标识
+
+// 路由表读多写少：转发只读，RIP 更新和超时才写。转发线程每批报文只进出一次
+// 读锁；写者优先，读者再多也不会让 RIP 更新和超时处理一直等下去，
+// 因此同一线程不能在持有读锁时再次加读锁
+pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER;
+void initTableLock() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&tableLock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+class TableLock {
+ public:
+  explicit TableLock(bool write) {
+    if (WORKERS > 1) {
+      if (write) {
+        pthread_rwlock_wrlock(&tableLock);
+      } else {
+        pthread_rwlock_rdlock(&tableLock);
+      }
+    }
+  }
+  ~TableLock() {
+    if (WORKERS > 1) {
+      pthread_rwlock_unlock(&tableLock);
+    }
+  }
+};
 // 0: 10.0.0.1
 // 1: 10.0.1.1
 // 2: 10.0.2.1
@@ -64,13 +119,13 @@ void sendRipPacketByHAL(const uint32_t &if_index, const RipPacket &rip, in_addr_
   uint32_t rip_len = assemble(&rip, &output[20 + 8]);
   in_addr_t srcAddr = addrs[if_index];
   // IP
-  ++ipTag;
+  uint16_t tag = ++ipTag;
   output[0]  = 0x45;
   output[1]  = 0xC0; // 此处设置为同抓包得到的相同，表示网间控制的一般服务
   output[2]  = ((rip_len + 20 + 8) >> 8) & 0xFF;
   output[3]  = (rip_len + 20 + 8) & 0xFF;
-  output[4]  = (ipTag >> 8) & 0xFF;  // IP 长度
-  output[5]  = ipTag & 0xFF;
+  output[4]  = (tag >> 8) & 0xFF;  // IP 长度
+  output[5]  = tag & 0xFF;
   output[6]  = 0x00;   // 不用考虑分片
   output[7]  = 0x00;
   output[8]  = 0x01;   // TTL为1，因为只向邻居发送rip报文
@@ -101,7 +156,13 @@ void sendRipPacketByHAL(const uint32_t &if_index, const RipPacket &rip, in_addr_
   // checksum calculation for ip and udp
   // if you don't want to calculate udp checksum, set it to zero
   // send it back
-  HAL_SendIPPacket(if_index, output, rip_len + 20 + 8, dstMac);
+  // 只加入发送队列，output 可以立即复用，由调用者在合适的时候 HAL_FlushSend
+  HAL_Packet out;
+  out.buffer = output;
+  out.length = rip_len + 20 + 8;
+  memcpy(out.dst_mac, dstMac, sizeof(macaddr_t));
+  out.if_index = if_index;
+  HAL_SendIPPacketBatch(&out, 1);
 }
 
 void sendRipUpdate(const RipPacket &upd) {
@@ -148,16 +209,253 @@ void sendRipRequest() {
   }
 }
 
+bool isLocalAddr(in_addr_t addr) {
+  // 发给路由器自己或者 RIP 组播地址的报文在本机处理，不需要查路由
+  if (addr == multicastAddr) {
+    return true;
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (addr == addrs[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void handlePacket(uint8_t *packet, int res, macaddr_t srcMac, int if_index, uint64_t rxTime, int slot) {
+  // 处理收到的一个 IP 报文，res 为其长度，rxTime 为其到达时间（纳秒），
+  // slot 为批量查出的路由的下标，-1 表示没有查询（发给自己或者太短），不会转发
+  ++messageId;
+  if (DEBUG) printf("%d:: Valid Message. res: %d\n", messageId, res);
+
+  if (!validateIPChecksum(packet, res)) {
+    if (DEBUG) printf("%d:: Invalid IP Checksum\n", messageId);
+    return;
+  }
+  in_addr_t srcAddr, dstAddr;
+  // extract srcAddr and dstAddr from packet
+  // big endian
+  srcAddr = getFourByte(packet + 12);
+  dstAddr = getFourByte(packet + 16);
+
+  if (isLocalAddr(dstAddr)) {
+    // 224.0.0.9 or me，进行接收处理
+    if (DEBUG) printf("%d:: Dst is me or multicast.\n", messageId);
+    RipPacket rip;
+    if (disassemble(packet, res, &rip)) {
+      // 为 rip 数据报
+      if (rip.command == 1) {
+        // request
+        // 请求报文必须满足 metric 为 16，注意 metric 为大端序
+        // 注意若表项数目大于 25，则需要分开发送
+        if (DEBUG) printf("%d:: Received rip request.\n", messageId);
+        uint32_t metricSmall = convertBigSmallEndian32(rip.entries[0].metric);
+        if (metricSmall != 16) return;
+        RipPacket resp;
+        // 封装响应报文，注意选择路由条目
+        resp.command = 2;  // response
+        resp.numEntries = 0;
+        TableLock lock(false);
+        for (int j = 0; j < table.size(); ++j) {
+          if (!isInSameNetworkSegment(table[j].addr, srcAddr, table[j].len)) {
+            // 与来源ip的网段不同
+            uint32_t id = resp.numEntries++;
+            resp.entries[id].addr = table[j].addr;
+            resp.entries[id].mask = convertBigSmallEndian32(getMaskFromLen(table[j].len));
+            resp.entries[id].nexthop = 0;
+            resp.entries[id].metric = convertBigSmallEndian32(table[j].metric);
+            if (isInSameNetworkSegment(table[j].nexthop, addrs[if_index], table[j].len)) {
+              // 毒性逆转
+              resp.entries[id].metric = convertBigSmallEndian32(16);
+            }
+            if (resp.numEntries == RIP_MAX_ENTRY) {
+              // 满 25 条，进行一次发送
+              sendRipPacketByHAL(if_index, resp, srcAddr, srcMac);
+              resp.numEntries = 0;
+            }
+          }
+        }
+        if (resp.numEntries) {
+          sendRipPacketByHAL(if_index, resp, srcAddr, srcMac);
+        }
+      } else {
+        // response
+        if (DEBUG) printf("%d:: Received rip response.\n", messageId);
+        RipPacket upd;
+        upd.numEntries = 0;
+        upd.command = 2;
+        // 同一批报文共用一次收包时记录的时间，不必为每个表项读取时钟
+        uint64_t now = HAL_GetLoopTicks();
+        TableLock lock(true);
+        for (int i = 0; i < rip.numEntries; ++i) {
+          RoutingTableEntry entry;
+          entry.addr = rip.entries[i].addr;
+          entry.len  = getLenFromMask(convertBigSmallEndian32(rip.entries[i].mask));
+          entry.if_index = if_index;
+          entry.metric = convertBigSmallEndian32(rip.entries[i].metric);
+          entry.timestamp = now;
+          entry.nexthop = srcAddr;
+          entry.adjacency = 0;
+          bool suc = update(entry);
+          if (suc) {
+            // 若更新路由表成功，触发更新
+            printf("%d:: Update router successfully.", messageId);
+            printRouteEntry(entry, stdout);
+            uint32_t id = upd.numEntries++;
+            upd.entries[id] = rip.entries[i];
+            upd.entries[id].nexthop = 0;
+            upd.entries[id].metric = convertBigSmallEndian32(entry.metric);
+            upd.entries[id].localTableInd = i;
+          }
+        }
+        if (upd.numEntries) {
+          sendRipUpdate(upd);
+        }
+      }
+    } else {
+      // Target is me but not rip.
+    }
+  } else {
+    // forward
+    // beware of endianness
+    if (DEBUG) printf("%d:: Forward.\n", messageId);
+    // slot >= 0 时调用者持有读锁，从批量查询到发送完成路由表都不会变化，
+    // 查出的邻接表项也不会被释放
+    if (slot < 0) {
+      return;
+    }
+    uint32_t nexthop = rxNexthops[slot];
+    uint32_t dest_if = rxIfIndices[slot];
+    uint32_t adjacency = rxAdjacencies[slot];
+    if (rxFound[slot]) {
+      // found
+      // direct routing
+      if (nexthop == 0) {
+        nexthop = dstAddr;
+      }
+      // update ttl and checksum
+      forward(packet, res);
+      // check ttl!=0
+      if (packet[8] != 0) {
+        // 下一跳的 MAC 地址未知时，HAL 会先保存报文并发出 ARP 请求，收到回复后再发出
+        // 有邻接表项时只需要复制预先构造好的链路层头部
+        int sent = adjacency != 0
+            ? HAL_SendIPPacketToAdjacency(adjacency, packet, res)
+            : HAL_SendIPPacketToNexthop(dest_if, packet, res, nexthop);
+        if (sent == 0) {
+          if (DEBUG) printf("%d:: Forward successfully. dest_if: %d  Nexthop:", messageId, dest_if);
+        } else if (sent == 1) {
+          if (DEBUG) printf("%d:: Waiting for mac address. dest_if: %d Nexthop:", messageId, dest_if);
+        } else {
+          if (DEBUG) printf("%d:: Failed to get mac address. dest_if: %d Nexthop:", messageId, dest_if);
+        }
+        if (DEBUG) printAddr(nexthop, stdout);
+        if (DEBUG && rxTime != 0) {
+          // 到达时间由网卡时钟换算而来，与 HAL_GetTicksNs 有少许误差，算出负数时记为 0
+          uint64_t now = HAL_GetTicksNs();
+          printf(" Latency: %lluns", (unsigned long long)(now > rxTime ? now - rxTime : 0));
+        }
+        if (DEBUG) printf("\n");
+      } else {
+        // ttl == 0
+        if (DEBUG) printf("%d:: TTL is 0.\n", messageId);
+      }
+    } else {
+      // not found
+      if (DEBUG) printf("%d:: No matching item in table.\n", messageId);
+    }
+  }
+}
+
+void initRxPackets() {
+  // GRO 合并后的报文可能远大于 MTU，缓冲区小了会被截断，所以在 HAL_Init 之后按 HAL 的实际情况分配
+  size_t size = RX_BUFFER_SIZE > 0 ? RX_BUFFER_SIZE : HAL_GetMaxPacketSize();
+  rxBuffers.resize(RX_BATCH * size);
+  for (int i = 0; i < RX_BATCH; ++i) {
+    rxPackets[i].buffer = &rxBuffers[i * size];
+    rxPackets[i].buffer_size = size;
+  }
+}
+
+int receiveAndHandle(int64_t timeout) {
+  // 收取并处理一批报文，返回值同 HAL_ReceiveIPPacketBatch
+  int mask = (1 << N_IFACE_ON_BOARD) - 1;
+  // 批量收包，摊薄每个报文在 HAL 和主循环中的开销
+  int res = HAL_ReceiveIPPacketBatch(mask, rxPackets, RX_BATCH, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  // 需要转发的报文记下它们的目的地址，发给自己的报文不查路由，免得占用路由缓存
+  int slots[RX_BATCH];
+  int count = 0;
+  for (int i = 0; i < res; ++i) {
+    slots[i] = -1;
+    if (rxPackets[i].length >= 20 && rxPackets[i].length <= rxPackets[i].buffer_size) {
+      uint32_t dstAddr = getFourByte(rxPackets[i].buffer + 16);
+      if (!isLocalAddr(dstAddr)) {
+        slots[i] = count;
+        rxDstAddrs[count++] = dstAddr;
+      }
+    }
+  }
+  // 先处理发给自己的报文，其中的 RIP 更新需要写锁
+  for (int i = 0; i < res; ++i) {
+    if (slots[i] >= 0 || rxPackets[i].length > rxPackets[i].buffer_size) {
+      // packet is truncated, ignore it
+      continue;
+    }
+    handlePacket(rxPackets[i].buffer, rxPackets[i].length, rxPackets[i].src_mac,
+        rxPackets[i].if_index, rxPackets[i].timestamp, -1);
+  }
+  if (count) {
+    // 再在一次读锁中一起查出需要转发的报文的路由并发出，查询之间的访存延迟可以重叠
+    TableLock lock(false);
+    queryBatch(rxDstAddrs, count, rxNexthops, rxIfIndices, rxAdjacencies, rxFound);
+    for (int i = 0; i < res; ++i) {
+      if (slots[i] >= 0) {
+        handlePacket(rxPackets[i].buffer, rxPackets[i].length, rxPackets[i].src_mac,
+            rxPackets[i].if_index, rxPackets[i].timestamp, slots[i]);
+      }
+    }
+  }
+  // 这一批报文处理中产生的转发和 RIP 报文一起发出
+  HAL_FlushSend();
+  return res;
+}
+
+void workerMain(int queue) {
+  // 队列 0 由主线程处理，其余队列各由一个线程处理，同一个流总是落在同一个队列
+  if (HAL_BindQueue(queue) < 0) {
+    fprintf(stderr, "Failed to bind queue %d\n", queue);
+    return;
+  }
+  initRxPackets();
+  while (receiveAndHandle(1000) >= 0) {
+  }
+}
+
 int main(int argc, char *argv[]) {
   freopen("nul", "w", stdout);  // 用于不输出琐碎的信息
   // freopen("nul", "w", stderr);  // 用于不输出关键的信息
   srand(time(NULL));
-  ipTag = (uint32_t)rand();
-  int res = HAL_Init(DEBUG, addrs);
-  int messageId = 0;  // for debug
+  ipTag = (uint16_t)rand();
+  initTableLock();
+  int res;
+  if (WORKERS > 1) {
+    res = HAL_InitQueues(WORKERS);
+    if (res < 0) {
+      return res;
+    }
+  }
+  res = HAL_Init(DEBUG, addrs);
   if (res < 0) {
     return res;
   }
+  res = HAL_BindQueue(0);
+  if (res < 0) {
+    return res;
+  }
+  initRxPackets();
   HAL_ArpGetMacAddress(0, multicastAddr, multicastMac); // 组播 ip 对应的组播 mac 地址，一定存在
 
   // Add direct routes
@@ -173,19 +471,24 @@ int main(int argc, char *argv[]) {
       .if_index = i, // small endian
       .metric = 0,  // small endian
       .timestamp = 0,  // small endian  直连网络不需要timestamp
-      .nexthop = 0 // big endian, means direct
+      .nexthop = 0, // big endian, means direct
+      .adjacency = 0 // 由 update 填写
     };
     update(entry);
   }
 
   // 加入时向各网口发出请求报文
   sendRipRequest();
+  HAL_FlushSend();
+  for (int q = 1; q < WORKERS; ++q) {
+    std::thread(workerMain, q).detach();
+  }
 
   uint64_t last_time = 0;
   int updCnt = 0;  // 每计6次（5*6 = 30s）进行一次更新
   bool first_send = false;
   while (1) {
-    uint64_t time = HAL_GetTicks();
+    uint64_t time = HAL_GetLoopTicks();
     if (!first_send || time > last_time + 5 * TICKS_PER_SEC) {
       // 例行更新
       // 发出响应报文之前记得确认timestamp
@@ -196,6 +499,8 @@ int main(int argc, char *argv[]) {
         RipPacket upd;
         upd.command = 2;
         upd.numEntries = 0;
+        TableLock lock(true);
+        std::vector<int> expired;
         for (int i = 0; i < table.size(); ++i) {
           uint32_t id = upd.numEntries++;
           upd.entries[id].addr = table[i].addr;
@@ -203,10 +508,12 @@ int main(int argc, char *argv[]) {
           upd.entries[id].nexthop = 0;
           upd.entries[id].metric = convertBigSmallEndian32(table[i].metric);
           upd.entries[id].localTableInd = i;
-          if (table[i].nexthop != 0 && (double)(time - table[i].timestamp) / TICKS_PER_SEC > TIMEOUT) {
+          // 其他转发线程各自记录收包时间，可能比本线程的 time 更新，不能直接相减
+          if (table[i].nexthop != 0 && table[i].timestamp < time &&
+              (double)(time - table[i].timestamp) / TICKS_PER_SEC > TIMEOUT) {
             // 非直连，且路由表项超时，这里采取简单的做法，直接发出报文——一个更好的做法是等待一段时间之后未被更新再发出报文
             upd.entries[id].metric = convertBigSmallEndian32(16);
-            table.erase(table.begin() + i);
+            expired.push_back(i);
           }
           if (upd.numEntries == RIP_MAX_ENTRY) {
             sendRipUpdate(upd);
@@ -216,157 +523,42 @@ int main(int argc, char *argv[]) {
         if (upd.numEntries) {
           sendRipUpdate(upd);
         }
+        // 超时的表项最后一起删除，邻居失效时往往有大量路由同时超时
+        if (!expired.empty()) {
+          eraseRoutes(expired);
+        }
+        // 所有更新报文一起交给系统发送
+        HAL_FlushSend();
       }
       last_time = time;
-      printRouteTable(time, stderr);
+      // 已知的下一跳在 ARP 表项过期之前重新询问，转发时不会遇到未解析的下一跳；
+      // 大量路由共用少数几个下一跳，先在读锁中去重地记下来，再在锁外逐个询问
+      std::vector<std::pair<uint32_t, uint32_t> > nexthops;  // (if_index, nexthop)
+      {
+        TableLock lock(false);
+        for (int i = 0; i < table.size(); ++i) {
+          if (table[i].nexthop != 0) {
+            nexthops.push_back(std::make_pair(table[i].if_index, table[i].nexthop));
+          }
+        }
+        printRouteTable(time, stderr);
+      }
+      std::sort(nexthops.begin(), nexthops.end());
+      nexthops.erase(std::unique(nexthops.begin(), nexthops.end()), nexthops.end());
+      for (size_t i = 0; i < nexthops.size(); ++i) {
+        HAL_ArpResolve(nexthops[i].first, nexthops[i].second);
+      }
+      uint64_t hits, misses;
+      getRouteCacheStats(&hits, &misses);
+      fprintf(stderr, "Route cache: %llu hits, %llu misses\n",
+          (unsigned long long)hits, (unsigned long long)misses);
     }
 
-    int mask = (1 << N_IFACE_ON_BOARD) - 1;
-    macaddr_t srcMac;
-    macaddr_t dstMac;
-    int if_index;
-    res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), srcMac,
-        dstMac, 1000, &if_index);
+    res = receiveAndHandle(1000);
     if (res == HAL_ERR_EOF) {
       break;
     } else if (res < 0) {
       return res;
-    } else if (res == 0) {
-      // Timeout
-      continue;
-    } else if (res > sizeof(packet)) {
-      // packet is truncated, ignore it
-      continue;
-    }
-    ++messageId;
-    if (DEBUG) printf("%d:: Valid Message. res: %d\n", messageId, res);
-
-    if (!validateIPChecksum(packet, res)) {
-      if (DEBUG) printf("%d:: Invalid IP Checksum\n", messageId);
-      continue;
-    }
-    in_addr_t srcAddr, dstAddr;
-    // extract srcAddr and dstAddr from packet
-    // big endian
-    srcAddr = getFourByte(packet + 12);
-    dstAddr = getFourByte(packet + 16);
-
-    bool dst_is_me = false;
-    for (int i = 0; i < N_IFACE_ON_BOARD;i++) {
-      if (memcmp(&dstAddr, &addrs[i], sizeof(in_addr_t)) == 0) {
-        dst_is_me = true;
-        break;
-      }
-    }
-    bool isMulti = (dstAddr == multicastAddr);
-    if (isMulti || dst_is_me) {  
-      // 224.0.0.9 or me，进行接收处理
-      if (DEBUG) printf("%d:: Dst is me or multicast.\n", messageId);
-      RipPacket rip;
-      if (disassemble(packet, res, &rip)) {
-        // 为 rip 数据报
-        if (rip.command == 1) {
-          // request
-          // 请求报文必须满足 metric 为 16，注意 metric 为大端序
-          // 注意若表项数目大于 25，则需要分开发送
-          if (DEBUG) printf("%d:: Received rip request.\n", messageId);
-          uint32_t metricSmall = convertBigSmallEndian32(rip.entries[0].metric);
-          if (metricSmall != 16) continue;
-          RipPacket resp;
-          // 封装响应报文，注意选择路由条目
-          resp.command = 2;  // response
-          resp.numEntries = 0;
-          for (int j = 0; j < table.size(); ++j) {
-            if (!isInSameNetworkSegment(table[j].addr, srcAddr, table[j].len)) {
-              // 与来源ip的网段不同
-              uint32_t id = resp.numEntries++;
-              resp.entries[id].addr = table[j].addr;
-              resp.entries[id].mask = convertBigSmallEndian32(getMaskFromLen(table[j].len));
-              resp.entries[id].nexthop = 0;
-              resp.entries[id].metric = convertBigSmallEndian32(table[j].metric);
-              if (isInSameNetworkSegment(table[j].nexthop, addrs[if_index], table[j].len)) {
-                // 毒性逆转
-                resp.entries[id].metric = convertBigSmallEndian32(16);
-              }
-              if (resp.numEntries == RIP_MAX_ENTRY) {
-                // 满 25 条，进行一次发送
-                sendRipPacketByHAL(if_index, resp, srcAddr, srcMac);
-                resp.numEntries = 0;
-              }
-            }
-          }
-          if (resp.numEntries) {
-            sendRipPacketByHAL(if_index, resp, srcAddr, srcMac);
-          }
-        } else {
-          // response
-          if (DEBUG) printf("%d:: Received rip response.\n", messageId);
-          RipPacket upd;
-          upd.numEntries = 0;
-          upd.command = 2;
-          for (int i = 0; i < rip.numEntries; ++i) {
-            RoutingTableEntry entry;
-            entry.addr = rip.entries[i].addr;
-            entry.len  = getLenFromMask(convertBigSmallEndian32(rip.entries[i].mask));
-            entry.if_index = if_index;
-            entry.metric = convertBigSmallEndian32(rip.entries[i].metric);
-            entry.timestamp = HAL_GetTicks();
-            entry.nexthop = srcAddr;
-            bool suc = update(entry);
-            if (suc) {
-              // 若更新路由表成功，触发更新
-              printf("%d:: Update router successfully.", messageId);
-              printRouteEntry(entry, stdout);
-              uint32_t id = upd.numEntries++;
-              upd.entries[id] = rip.entries[i];
-              upd.entries[id].nexthop = 0;
-              upd.entries[id].metric = convertBigSmallEndian32(entry.metric);
-              upd.entries[id].localTableInd = i;
-            }
-          }
-          if (upd.numEntries) {
-            sendRipUpdate(upd);
-          }
-        }
-      } else {
-        // Target is me but not rip.
-      }
-    } else {
-      // forward
-      // beware of endianness
-      if (DEBUG) printf("%d:: Forward.\n", messageId);
-      uint32_t nexthop, dest_if;
-      if (query(dstAddr, &nexthop, &dest_if)) {
-        // found
-        macaddr_t dest_mac;
-        // direct routing
-        if (nexthop == 0) {
-          nexthop = dstAddr;
-        }
-        if (HAL_ArpGetMacAddress(dest_if, nexthop, dest_mac) == 0) {
-          // found
-          // update ttl and checksum
-          forward(packet, res);
-          // check ttl!=0
-          if (packet[8] != 0) {
-            HAL_SendIPPacket(dest_if, packet, res, dest_mac);
-            if (DEBUG) printf("%d:: Forward successfully. dest_if: %d  Nexthop:", messageId, dest_if);
-            if (DEBUG) printAddr(nexthop, stdout);
-            if (DEBUG) printf("\n");
-          } else {
-            // ttl == 0
-            if (DEBUG) printf("%d:: TTL is 0.\n", messageId);
-          }
-        } else {
-          // not found
-          if (DEBUG) printf("%d:: Failed to get mac address. dest_if: %d Nexthop:", messageId, dest_if);
-          if (DEBUG) printAddr(nexthop, stdout);
-          if (DEBUG) printf("\n");
-        }
-      } else {
-        // not found
-        if (DEBUG) printf("%d:: No matching item in table.\n", messageId);
-      }
     }
   }
   return 0;
@@ -6,4 +6,5 @@ typedef struct {
     uint32_t metric;
     uint64_t timestamp;
     uint32_t nexthop;
+    uint32_t adjacency; // 下一跳的邻接表项编号，0 表示没有（直连路由或邻接表已满）
 } RoutingTableEntry;
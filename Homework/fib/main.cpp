@@ -0,0 +1,84 @@
+#include "router_hal.h"
+#include "router.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+extern bool update(RoutingTableEntry entry);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *adjacency);
+extern void queryBatch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indices, uint32_t *adjacencies, bool *found);
+extern void eraseRoutes(const std::vector<int> &indices);
+extern int find(const RoutingTableEntry &entry);
+char buffer[1 << 20];  // 一次删除很多路由时一行很长
+
+// 读出 line 中逗号后面的下一个数，没有则返回 false
+bool nextNumber(char **line, uint32_t *num) {
+  char *comma = strchr(*line, ',');
+  if (comma == NULL) {
+    return false;
+  }
+  *line = comma + 1;
+  *num = strtoul(*line, NULL, 0);
+  return true;
+}
+
+void printResult(bool found, uint32_t nexthop, uint32_t if_index) {
+  if (found) {
+    printf("0x%08x %d\n", nexthop, if_index);
+  } else {
+    printf("Not Found\n");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // I,地址,长度,出端口,下一跳：插入一条 metric 为 0 的路由
+  // D,地址,长度[,地址,长度...]：用一次 eraseRoutes 删除列出的所有路由
+  // Q,地址：用 query 查询一个地址
+  // B,地址[,地址...]：用 queryBatch 一次查询列出的所有地址，每个地址输出一行
+  uint32_t addr, len, if_index, nexthop, adjacency;
+  while (fgets(buffer, sizeof(buffer), stdin)) {
+    char *line = buffer;
+    if (buffer[0] == 'I') {
+      nextNumber(&line, &addr);
+      nextNumber(&line, &len);
+      nextNumber(&line, &if_index);
+      nextNumber(&line, &nexthop);
+      RoutingTableEntry entry = {
+          .addr = addr, .len = len, .if_index = if_index, .metric = 0,
+          .timestamp = 0, .nexthop = nexthop, .adjacency = 0};
+      update(entry);
+    } else if (buffer[0] == 'D') {
+      std::vector<int> indices;
+      while (nextNumber(&line, &addr) && nextNumber(&line, &len)) {
+        RoutingTableEntry entry = {.addr = addr, .len = len};
+        int index = find(entry);
+        if (index >= 0) {
+          indices.push_back(index);
+        }
+      }
+      std::sort(indices.begin(), indices.end());
+      eraseRoutes(indices);
+    } else if (buffer[0] == 'Q') {
+      nextNumber(&line, &addr);
+      bool found = query(addr, &nexthop, &if_index, &adjacency);
+      printResult(found, nexthop, if_index);
+    } else if (buffer[0] == 'B') {
+      std::vector<uint32_t> addrs;
+      while (nextNumber(&line, &addr)) {
+        addrs.push_back(addr);
+      }
+      size_t n = addrs.size();
+      std::vector<uint32_t> nexthops(n), if_indices(n), adjacencies(n);
+      bool *found = new bool[n];
+      queryBatch(addrs.data(), n, nexthops.data(), if_indices.data(), adjacencies.data(), found);
+      for (size_t i = 0; i < n; ++i) {
+        printResult(found[i], nexthops[i], if_indices[i]);
+      }
+      delete[] found;
+    }
+  }
+  return 0;
+}